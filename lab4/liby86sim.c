@@ -0,0 +1,4064 @@
+/* Instruction set simulator for Y86 Architecture (liby86sim) */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "y86sim_int.h"
+
+/* report an error of 'sim', see set_err_fn() */
+#define err_print(_sim, _s, _a ...) \
+    sim_error(_sim, _s, _a)
+
+char *stat_names[] = { "AOK", "HLT", "ADR", "INS" };
+
+char *stat_name(stat_t e)
+{
+    if (e < STAT_AOK || e > STAT_INS)
+        return "Invalid Status";
+    return stat_names[e];
+}
+
+/* sim_error: keep the message in sim->err and pass it to the sink, if any */
+void sim_error(y86sim_t *sim, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(sim->err, ERR_LEN, fmt, ap);
+    va_end(ap);
+    if (sim->err_fn)
+        sim->err_fn(sim->err_arg, sim->err);
+}
+
+/* set_err_fn: send the messages of 'sim' to 'fn' (NULL: only keep them) */
+void set_err_fn(y86sim_t *sim, err_fn_t fn, void *arg)
+{
+    sim->err_fn = fn;
+    sim->err_arg = arg;
+}
+
+/* err_to_file: the error sink writing a line to the FILE * 'arg' */
+void err_to_file(void *arg, const char *msg)
+{
+    fprintf((FILE *)arg, "%s\n", msg);
+}
+
+char *cc_names[8] = {
+    "Z=0 S=0 O=0",
+    "Z=0 S=0 O=1",
+    "Z=0 S=1 O=0",
+    "Z=0 S=1 O=1",
+    "Z=1 S=0 O=0",
+    "Z=1 S=0 O=1",
+    "Z=1 S=1 O=0",
+    "Z=1 S=1 O=1" };
+
+char *cc_name(cc_t c)
+{
+    int ci = c;
+    if (ci < 0 || ci > 7)
+        return "???????????";
+    else
+        return cc_names[c];
+}
+
+/* mem_calloc: calloc() for 'm', telling its simulator if that fails */
+static void *mem_calloc(mem_t *m, size_t n, size_t size)
+{
+    void *p = calloc(n, size);
+    if (!p && m->sim)
+        err_print(m->sim, "Out of memory (0x%lx bytes)", (unsigned long)(n * size));
+    return p;
+}
+
+/* page_data: the data page holding 'addr', allocated on first touch (NULL if it can't be) */
+static byte_t *page_data(mem_t *m, long_t addr)
+{
+    page_t *p = &m->page[addr >> PG_BITS];
+    if (!p->data)
+        p->data = (byte_t *)mem_calloc(m, PG_SIZE, 1);
+    return p->data;
+}
+
+bool_t get_byte_val(mem_t *m, long_t addr, byte_t *dest)
+{
+    byte_t *data;
+    if (addr < 0 || addr >= m->len)
+        return FALSE;
+    data = m->page[addr >> PG_BITS].data;
+    *dest = data ? data[addr & PG_MASK] : 0;
+    return TRUE;
+}
+
+/* Y86 words are little-endian: on such hosts load/store them with memcpy */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define HOST_LE 1
+#else
+#define HOST_LE 0
+#endif
+
+bool_t get_long_val(mem_t *m, long_t addr, long_t *dest)
+{
+    int i;
+    long_t val;
+    if (addr < 0 || addr > m->len - 4)
+	    return FALSE;
+    if (HOST_LE && (addr & PG_MASK) <= PG_SIZE - 4) {
+        byte_t *data = m->page[addr >> PG_BITS].data;
+        if (data)
+            memcpy(dest, data + (addr & PG_MASK), 4);
+        else
+            *dest = 0;
+        return TRUE;
+    }
+    /* big-endian host or a word crossing two pages */
+    val = 0;
+    for (i = 0; i < 4; i++) {
+        byte_t b = 0;
+        get_byte_val(m, addr+i, &b);
+        val = val | b<<(8*i);
+    }
+    *dest = val;
+    return TRUE;
+}
+
+/* code_at: whether a byte of [addr, addr+len) was decoded as code */
+static bool_t code_at(mem_t *m, long_t addr, int len)
+{
+    long_t pc;
+    bool_t code = FALSE;
+
+    for (pc = addr; pc < addr + len; pc++) {
+        byte_t *map;
+        if (pc < 0 || pc >= m->len)
+            continue;
+        map = m->page[pc >> PG_BITS].code;
+        if (map)
+            code |= map[pc & PG_MASK];
+    }
+    return code;
+}
+
+/*
+ * invalidate_icache: drop decoded instructions overlapping [addr, addr+len)
+ * (only when the written bytes have been decoded as code before)
+ */
+void invalidate_icache(mem_t *m, long_t addr, int len)
+{
+    long_t pc;
+
+    if (!code_at(m, addr, len))
+        return;
+
+    pc = addr - (MAX_INSBYTES - 1);
+    if (pc < 0)
+        pc = 0;
+    for (; pc < addr + len; pc++) {
+        dinst_t *icache = m->page[pc >> PG_BITS].icache;
+        if (icache) {
+            icache[pc & PG_MASK].valid = FALSE;
+            icache[pc & PG_MASK].op = NULL;
+        }
+    }
+    m->icache_gen++;
+}
+
+/* watch_written: note a write of [addr, addr+len) into a page with watches */
+static void watch_written(mem_t *m, long_t addr, int len)
+{
+    long_t a;
+
+    for (a = addr; a < addr + len && !m->watch_hit; a++) {
+        byte_t *map = m->page[a >> PG_BITS].watch;
+        if (map && MAP_BIT(map, a & PG_MASK)) {
+            m->watch_hit = TRUE;
+            m->watch_addr = a;
+        }
+    }
+}
+
+bool_t set_byte_val(mem_t *m, long_t addr, byte_t val)
+{
+    page_t *p;
+    byte_t *data;
+    if (addr < 0 || addr >= m->len)
+	    return FALSE;
+    if (!(data = page_data(m, addr)))
+        return FALSE;
+    data[addr & PG_MASK] = val;
+    p = &m->page[addr >> PG_BITS];
+    p->dirty = 1;
+    if (p->code)
+        invalidate_icache(m, addr, 1);
+    if (p->watch)
+        watch_written(m, addr, 1);
+    return TRUE;
+}
+
+bool_t set_long_val(mem_t *m, long_t addr, long_t val)
+{
+    int i;
+    if (addr < 0 || addr > m->len - 4)
+	    return FALSE;
+    if (HOST_LE && (addr & PG_MASK) <= PG_SIZE - 4) {
+        page_t *p = &m->page[addr >> PG_BITS];
+        byte_t *data = page_data(m, addr);
+        if (!data)
+            return FALSE;
+        memcpy(data + (addr & PG_MASK), &val, 4);
+        p->dirty = 1;
+        if (p->code)
+            invalidate_icache(m, addr, 4);
+        if (p->watch)
+            watch_written(m, addr, 4);
+        return TRUE;
+    }
+    /* big-endian host or a word crossing two pages */
+    for (i = 0; i < 4; i++) {
+        if (!set_byte_val(m, addr+i, val & 0xFF))
+            return FALSE;
+        val >>= 8;
+    }
+    return TRUE;
+}
+
+/*
+ * store_long: set_long_val() for the engines, FALSE only if out of memory
+ * (a word running past the end of memory is dropped, as it always was)
+ */
+static inline bool_t store_long(mem_t *m, long_t addr, long_t val)
+{
+    return set_long_val(m, addr, val) || addr < 0 || addr > m->len - 4;
+}
+
+/* init_mem: an empty memory of 'len' bytes, NULL if out of memory */
+mem_t *init_mem(int len)
+{
+    mem_t *m = (mem_t *)malloc(sizeof(mem_t));
+    if (!m)
+        return NULL;
+    len = ((len+BLK_SIZE-1)/BLK_SIZE)*BLK_SIZE;
+    m->len = len;
+    m->npages = (len + PG_SIZE - 1) >> PG_BITS;
+    m->page = (page_t *)calloc(m->npages, sizeof(page_t));
+    if (!m->page) {
+        free(m);
+        return NULL;
+    }
+    m->icache_gen = 0;
+    m->map = NULL;
+    m->map_len = 0;
+    m->all_dirty = FALSE;
+    m->watch_hit = FALSE;
+    m->watch_addr = 0;
+    m->sim = NULL;
+
+    return m;
+}
+
+/* whether a page's data is part of the image mapping (not to be freed) */
+#define IN_MAP(_m, _p) ((_p) >= (_m)->map && (_p) < (_m)->map + (_m)->map_len)
+
+/*
+ * clear_mem: drop every page, the memory reads as zeros again
+ * (watches and breakpoints stay)
+ */
+void clear_mem(mem_t *m)
+{
+    int i;
+    for (i = 0; i < m->npages; i++) {
+        page_t *p = &m->page[i];
+        if (!IN_MAP(m, p->data))
+            free((void *) p->data);
+        free((void *) p->code);
+        free((void *) p->icache);
+        p->data = p->code = NULL;
+        p->icache = NULL;
+        p->dirty = 0;
+    }
+    m->all_dirty = TRUE;
+    if (m->map)
+        munmap(m->map, m->map_len);
+    m->map = NULL;
+    m->map_len = 0;
+    m->icache_gen++;
+}
+
+void free_mem(mem_t *m)
+{
+    int i;
+    clear_mem(m);
+    for (i = 0; i < m->npages; i++) {
+        free((void *) m->page[i].watch);
+        free((void *) m->page[i].brk);
+    }
+    free((void *) m->page);
+    free((void *) m);
+}
+
+/*
+ * dup_mem: snapshot the data of touched pages (no decoded instructions),
+ * NULL if out of memory
+ */
+mem_t *dup_mem(mem_t *oldm)
+{
+    int i;
+    mem_t *newm = init_mem(oldm->len);
+    if (!newm) {
+        if (oldm->sim)
+            sim_error(oldm->sim, "Out of memory");
+        return NULL;
+    }
+    newm->sim = oldm->sim;
+    for (i = 0; i < oldm->npages; i++) {
+        if (!oldm->page[i].data)
+            continue;
+        newm->page[i].data = (byte_t *)mem_calloc(newm, PG_SIZE, 1);
+        if (!newm->page[i].data) {
+            free_mem(newm);
+            return NULL;
+        }
+        memcpy(newm->page[i].data, oldm->page[i].data, PG_SIZE);
+        newm->page[i].dirty = oldm->page[i].dirty;
+    }
+    newm->all_dirty = oldm->all_dirty;
+    return newm;
+}
+
+/*
+ * copy_mem: make 'dst' hold the data of 'src' (of the same length);
+ * FALSE if out of memory, with the pages from the failed one on unchanged
+ */
+bool_t copy_mem(mem_t *dst, mem_t *src)
+{
+    int i;
+    for (i = 0; i < dst->npages; i++) {
+        page_t *p = &dst->page[i];
+        if (src->page[i].data && !page_data(dst, i << PG_BITS)) {
+            dst->icache_gen++;
+            return FALSE;
+        }
+        if (src->page[i].data)
+            memcpy(p->data, src->page[i].data, PG_SIZE);
+        else if (p->data)
+            memset(p->data, 0, PG_SIZE);
+        p->dirty = src->page[i].dirty;
+        /* the decoded code may not match any more */
+        free((void *) p->code);
+        free((void *) p->icache);
+        p->code = NULL;
+        p->icache = NULL;
+    }
+    dst->all_dirty = src->all_dirty;
+    dst->icache_gen++;
+    return TRUE;
+}
+
+/* words diff_mem() and diff_reg() compare at once */
+#define DIFF_WORDS 8
+
+typedef long_t vword_t __attribute__((vector_size(DIFF_WORDS * sizeof(long_t))));
+
+/* words_differ: whether DIFF_WORDS words at 'a' and 'b' differ */
+static inline bool_t words_differ(const void *a, const void *b)
+{
+    vword_t va, vb;
+    int i;
+
+    memcpy(&va, a, sizeof(va));
+    memcpy(&vb, b, sizeof(vb));
+    va ^= vb;
+    for (i = 1; i < DIFF_WORDS; i++)
+        va[0] |= va[i];
+    return va[0] != 0;
+}
+
+/*
+ * diff_mem: compare word by word the pages either image has written since
+ * it was loaded (so both must be loads of the same image, as the 'savem'
+ * of reload_mem()), skipping runs of DIFF_WORDS equal words at once
+ */
+bool_t diff_mem(mem_t *oldm, mem_t *newm, FILE *outfile)
+{
+    static const byte_t zero[PG_SIZE];
+    long_t pos, base, end;
+    int i, npages, off;
+    int len = oldm->len;
+    bool_t all = oldm->all_dirty || newm->all_dirty;
+    bool_t diff = FALSE;
+    
+    if (newm->len < len)
+	    len = newm->len;
+    npages = (len + PG_SIZE - 1) >> PG_BITS;
+    
+    for (i = 0; (!diff || outfile) && i < npages; i++) {
+        page_t *op = &oldm->page[i];
+        page_t *np = &newm->page[i];
+        const byte_t *od = op->data ? op->data : zero;
+        const byte_t *nd = np->data ? np->data : zero;
+        if (od == nd || (!all && !op->dirty && !np->dirty))
+            continue;
+        base = i << PG_BITS;
+        end = len - base < PG_SIZE ? len - base : PG_SIZE;
+        for (off = 0; (!diff || outfile) && off < end; off += DIFF_WORDS * 4) {
+            if (!words_differ(od + off, nd + off))
+                continue;
+            for (pos = base + off; pos < base + off + DIFF_WORDS * 4
+                 && pos < base + end; pos += 4) {
+                long_t ov = 0;  long_t nv = 0;
+                get_long_val(oldm, pos, &ov);
+                get_long_val(newm, pos, &nv);
+                if (nv != ov) {
+                    diff = TRUE;
+                    if (outfile)
+                        fprintf(outfile, "0x%.4x:\t0x%.8x\t0x%.8x\n", pos, ov, nv);
+                }
+            }
+        }
+    }
+    return diff;
+}
+
+
+reg_t reg_table[REG_CNT] = {
+    {"%eax", REG_EAX},
+    {"%ecx", REG_ECX},
+    {"%edx", REG_EDX},
+    {"%ebx", REG_EBX},
+    {"%esp", REG_ESP},
+    {"%ebp", REG_EBP},
+    {"%esi", REG_ESI},
+    {"%edi", REG_EDI},
+};
+
+/* find_reg: the register named 'name' ("%eax" or "eax"), REG_ERR if none */
+regid_t find_reg(char *name)
+{
+    int i;
+    for (i = 0; i < REG_CNT; i++)
+        if (!strcmp(name, reg_table[i].name) || !strcmp(name, reg_table[i].name + 1))
+            return reg_table[i].id;
+    return REG_ERR;
+}
+
+long_t get_reg_val(long_t *r, regid_t id)
+{
+    if ((unsigned)id >= REG_CNT)
+        return 0;
+    return r[id];
+}
+
+void set_reg_val(long_t *r, regid_t id, long_t val)
+{
+    if ((unsigned)id < REG_CNT)
+        r[id] = val;
+}
+
+void free_reg(long_t *r)
+{
+    free((void *) r);
+}
+
+long_t *dup_reg(long_t *oldr)
+{
+    long_t *newr = (long_t *)malloc(REG_CNT * sizeof(long_t));
+    memcpy(newr, oldr, REG_CNT * sizeof(long_t));
+    return newr;
+}
+
+bool_t diff_reg(long_t *oldr, long_t *newr, FILE *outfile)
+{
+    int id;
+    bool_t diff = FALSE;
+
+    if (REG_CNT == DIFF_WORDS && !words_differ(oldr, newr))
+        return FALSE;
+    for (id = REG_EAX; (!diff || outfile) && id < REG_CNT; id++) {
+        long_t ov = oldr[id];
+        long_t nv = newr[id];
+        if (nv != ov) {
+            diff = TRUE;
+            if (outfile)
+                fprintf(outfile, "%s:\t0x%.8x\t0x%.8x\n",
+                        reg_table[id].name, ov, nv);
+        }
+    }
+    return diff;
+}
+
+/* create an y86 image with registers and memory, NULL if out of memory */
+y86sim_t *new_y86sim(int slen)
+{
+    y86sim_t *sim = (y86sim_t*)malloc(sizeof(y86sim_t));
+    if (!sim)
+        return NULL;
+    sim->pc = 0;
+    memset(sim->r, 0, sizeof(sim->r));
+    sim->m = init_mem(slen);
+    if (!sim->m) {
+        free(sim);
+        return NULL;
+    }
+    sim->m->sim = sim;
+    sim->cc = DEFAULT_CC;
+    sim->lazy_op = A_NONE;
+    sim->brk = NULL;
+    sim->brk_hit = NULL;
+    sim->err[0] = '\0';
+    sim->err_fn = NULL;
+    sim->err_arg = NULL;
+    return sim;
+}
+
+/*
+ * Watches and breakpoints cost nothing until a run gets near them: a page
+ * holding watched bytes has a 'watch' bitmap that the stores into it check,
+ * and run_thread() never caches the handler of a PC marked in its page's
+ * 'brk' bitmap, so only those PCs go through the breakpoint check. The
+ * other engines stop the same way: run_switch() and the lanes look at the
+ * bitmap only if the sim has breakpoints, and the JIT ends its blocks
+ * before breakpoint PCs and leaves native code to store into watched pages.
+ */
+
+/* watch_mem: stop runs after they write a byte of [addr, addr+len) */
+bool_t watch_mem(mem_t *m, long_t addr, int len)
+{
+    long_t a;
+
+    if (len <= 0 || addr < 0 || addr > m->len - len)
+        return FALSE;
+    for (a = addr; a < addr + len; a++) {
+        page_t *p = &m->page[a >> PG_BITS];
+        if (!p->watch && !(p->watch = (byte_t *)mem_calloc(m, PG_SIZE / 8, 1)))
+            return FALSE;
+        MAP_SET(p->watch, a & PG_MASK);
+    }
+    return TRUE;
+}
+
+/* set_brk: stop runs before the instruction at 'pc' if 'reg' holds 'val' */
+bool_t set_brk(y86sim_t *sim, long_t pc, regid_t reg, long_t val)
+{
+    mem_t *m = sim->m;
+    page_t *p;
+    brkpt_t *b;
+
+    if (pc < 0 || pc >= m->len || !(NORM_REG(reg) || NONE_REG(reg)))
+        return FALSE;
+    p = &m->page[pc >> PG_BITS];
+    if (!p->brk && !(p->brk = (byte_t *)mem_calloc(m, PG_SIZE / 8, 1)))
+        return FALSE;
+    if (!(b = (brkpt_t *)mem_calloc(m, 1, sizeof(brkpt_t))))
+        return FALSE;
+    MAP_SET(p->brk, pc & PG_MASK);
+    if (p->icache)
+        p->icache[pc & PG_MASK].op = NULL;
+
+    b->pc = pc;
+    b->reg = reg;
+    b->val = val;
+    b->next = sim->brk;
+    sim->brk = b;
+    return TRUE;
+}
+
+/* clear_brk: delete every breakpoint and watch */
+void clear_brk(y86sim_t *sim)
+{
+    mem_t *m = sim->m;
+    int i;
+
+    while (sim->brk) {
+        brkpt_t *b = sim->brk;
+        sim->brk = b->next;
+        free(b);
+    }
+    for (i = 0; i < m->npages; i++) {
+        free((void *) m->page[i].watch);
+        free((void *) m->page[i].brk);
+        m->page[i].watch = m->page[i].brk = NULL;
+    }
+    sim->brk_hit = NULL;
+    m->watch_hit = FALSE;
+}
+
+static inline bool_t brk_at(mem_t *m, long_t pc)
+{
+    byte_t *map;
+
+    if (pc < 0 || pc >= m->len)
+        return FALSE;
+    map = m->page[pc >> PG_BITS].brk;
+    return map && MAP_BIT(map, pc & PG_MASK);
+}
+
+/* brk_hit: a breakpoint at 'pc' whose condition holds, NULL if none */
+brkpt_t *brk_hit(y86sim_t *sim, long_t pc)
+{
+    brkpt_t *b;
+
+    if (!brk_at(sim->m, pc))
+        return NULL;
+    for (b = sim->brk; b; b = b->next)
+        if (b->pc == pc && (NONE_REG(b->reg) || sim->r[b->reg] == b->val))
+            return b;
+    return NULL;
+}
+
+/* watch_hit: whether the last run stopped at a watch, and the byte written */
+bool_t watch_hit(y86sim_t *sim, long_t *addr)
+{
+    if (sim->m->watch_hit && addr)
+        *addr = sim->m->watch_addr;
+    return sim->m->watch_hit;
+}
+
+/* clear_hits: forget the breakpoint or watch the last run stopped at */
+void clear_hits(y86sim_t *sim)
+{
+    sim->brk_hit = NULL;
+    sim->m->watch_hit = FALSE;
+}
+
+/* print_stop: say which breakpoint or watch the last run stopped at */
+void print_stop(FILE *out, y86sim_t *sim)
+{
+    brkpt_t *b = sim->brk_hit;
+
+    if (sim->m->watch_hit)
+        fprintf(out, "Watchpoint: 0x%x written\n", sim->m->watch_addr);
+    else if (b && NONE_REG(b->reg))
+        fprintf(out, "Breakpoint at 0x%x\n", b->pc);
+    else if (b)
+        fprintf(out, "Breakpoint at 0x%x, %s = 0x%x\n", b->pc,
+                reg_table[b->reg].name, b->val);
+}
+
+void free_y86sim(y86sim_t *sim)
+{
+    clear_brk(sim);
+    free_mem(sim->m);
+    free((void *) sim);
+}
+
+/*
+ * map_binfile: map the whole pages of the image in 'f' straight into the
+ * page table, so loading costs the same for any image size. The mapping
+ * is MAP_PRIVATE: a write copies the host page and never reaches the
+ * file. The partial last page is read into a page of its own.
+ * return
+ *     1: 'f' can't be mapped (not a regular file, ...), read it instead
+ *     0, -1: as load_binfile()
+ */
+static int map_binfile(y86sim_t *sim, mem_t *m, FILE *f)
+{
+    struct stat st;
+    long host_pg = sysconf(_SC_PAGESIZE);
+    size_t size, full, i;
+    byte_t *map;
+
+    if (host_pg <= 0 || PG_SIZE % host_pg || fstat(fileno(f), &st) < 0
+        || !S_ISREG(st.st_mode) || ftell(f) != 0)
+        return 1;
+    size = st.st_size;
+    /* as with fread(), an image filling up all memory is too large */
+    if (size >= (size_t)m->len) {
+        err_print(sim, "too large memory footprint (0x%x)", m->len);
+        return -1;
+    }
+
+    full = size & ~(size_t)PG_MASK;
+    if (full) {
+        map = (byte_t *)mmap(NULL, full, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                             fileno(f), 0);
+        if (map == MAP_FAILED)
+            return 1;
+        m->map = map;
+        m->map_len = full;
+        for (i = 0; i < full >> PG_BITS; i++)
+            m->page[i].data = map + (i << PG_BITS);
+    }
+    if (size > full && !page_data(m, full))
+        return -1;
+    if (size > full && (fseek(f, full, SEEK_SET) < 0
+        || fread(m->page[full >> PG_BITS].data, 1, size - full, f) != size - full)) {
+        err_print(sim, "fread() failed (0x%x)", (int)full);
+        return -1;
+    }
+    return 0;
+}
+
+/* load binary code and data from file to memory image */
+int load_binfile(y86sim_t *sim, mem_t *m, FILE *f)
+{
+    int flen = 0;
+    long_t addr;
+    int ret = map_binfile(sim, m, f);
+
+    if (ret <= 0)
+        return ret;
+    clearerr(f);
+    for (addr = 0; addr < m->len; addr += PG_SIZE) {
+        int size = m->len - addr < PG_SIZE ? m->len - addr : PG_SIZE;
+        byte_t *data = page_data(m, addr);
+        int n;
+        if (!data)
+            return -1;
+        n = fread(data, sizeof(byte_t), size, f);
+        flen += n;
+        if (n < size)
+            break;
+    }
+    if (ferror(f)) {
+        err_print(sim, "fread() failed (0x%x)", flen);
+        return -1;
+    }
+    if (!feof(f)) {
+        err_print(sim, "too large memory footprint (0x%x)", flen);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * compute_alu: do ALU operations 
+ * args
+ *     op: operations (A_ADD, A_SUB, A_AND, A_XOR)
+ *     argA: the first argument 
+ *     argB: the second argument
+ *
+ * return
+ *     val: the result of operation on argA and argB
+ */
+long_t compute_alu(alu_t op, long_t argA, long_t argB)
+{
+    long_t val = 0;
+    switch(op){
+        case A_ADD:
+            val = argB + argA;
+            break;
+        case A_SUB:
+            val = argB - argA;
+            break;
+        case A_AND:
+            val = argB & argA;
+            break;
+        case A_XOR:
+            val = argB ^ argA;
+            break;
+        default:
+            break;
+    } 
+    return val;
+}
+
+/*
+ * compute_cc: modify condition codes according to operations 
+ * args
+ *     op: operations (A_ADD, A_SUB, A_AND, A_XOR)
+ *     argA: the first argument 
+ *     argB: the second argument
+ *     val: the result of operation on argA and argB
+ *
+ * return
+ *     PACK_CC: the final condition codes
+ */
+cc_t compute_cc(alu_t op, long_t argA, long_t argB, long_t val)
+{
+    bool_t zero = FALSE;
+    bool_t sign = FALSE;
+    bool_t ovf = FALSE;
+
+    zero = (val == 0);
+    sign = (val < 0);
+    ovf = (((argA < 0) == (argB < 0))&&((val < 0) != (argB < 0)));
+    if(ovf == TRUE && op == A_SUB){
+        ovf = FALSE;
+    }
+    return PACK_CC(zero,sign,ovf);
+}
+
+/*
+ * set_cc_lazy: record an ALU operation instead of computing its CC,
+ * most of them are overwritten before any cmovXX/jXX reads them
+ */
+static inline void set_cc_lazy(y86sim_t *sim, alu_t op, long_t argA,
+                               long_t argB, long_t val)
+{
+#ifdef EAGER_CC
+    sim->cc = compute_cc(op, argA, argB, val);
+#else
+    sim->lazy_op = op;
+    sim->lazy_argA = argA;
+    sim->lazy_argB = argB;
+    sim->lazy_val = val;
+#endif
+}
+
+/* get_cc: materialize the condition codes of the last ALU operation */
+cc_t get_cc(y86sim_t *sim)
+{
+    if (sim->lazy_op != A_NONE) {
+        sim->cc = compute_cc(sim->lazy_op, sim->lazy_argA,
+                             sim->lazy_argB, sim->lazy_val);
+        sim->lazy_op = A_NONE;
+    }
+    return sim->cc;
+}
+
+/*
+ * cond_doit: whether do (mov or jmp) it?  
+ * args
+ *     PACK_CC: the current condition codes
+ *     cond: conditions (C_YES, C_LE, C_L, C_E, C_NE, C_GE, C_G)
+ *
+ * return
+ *     TRUE: do it
+ *     FALSE: not do it
+ */
+bool_t cond_doit(cc_t cc, cond_t cond) 
+{
+    bool_t doit = FALSE;
+    bool_t zero = (cc>>2)&0x1;
+    bool_t sign = (cc>>1)&0x1;
+    bool_t ovf = cc&0x1;
+
+    switch(cond){
+        case C_YES:
+            doit = TRUE; 
+            break;
+        case C_LE:
+            doit = (sign^ovf) | zero;
+            break;
+        case C_L:
+            doit = sign^ovf;
+            break;
+        case C_E:
+            doit = zero;
+            break;
+        case C_NE:
+            doit = !zero;
+            break;
+        case C_GE:
+            doit = !(sign^ovf);
+            break;
+        case C_G:
+            doit = (!(sign^ovf))&(!zero);
+            break;
+        default:
+            break;
+    }
+    return doit;
+}
+
+/*
+ * decode_inst: fetch and decode the instruction at 'pc' into the icache
+ * args
+ *     m: the memory
+ *     pc: the address of instruction
+ *     dp: store the pointer of decoded record
+ *
+ * return
+ *     STAT_AOK: success, '*dp' is a valid record
+ *     STAT_ADR: the instruction runs out of memory (the caller reports it),
+ *         or the host does (reported through m->sim)
+ */
+stat_t decode_inst(mem_t *m, long_t pc, dinst_t **dp)
+{
+    dinst_t *d;
+    page_t *p;
+    byte_t codefun = 0;
+    byte_t regSpecifier = HPACK(REG_NONE, REG_NONE);
+    long_t imm = 0;
+    long_t next_pc = pc, a;
+    itype_t icode;
+
+    /* get code and function (1 byte) */
+    if (!get_byte_val(m, next_pc, &codefun)) {
+        return STAT_ADR;
+    }
+    icode = GET_ICODE(codefun);
+    next_pc++;
+
+    /* get registers if needed (1 byte) */
+    if((0x2<=icode&&icode<=0x6)||(0xA<=icode)){
+        if(!get_byte_val(m,next_pc,&regSpecifier)){
+            return STAT_ADR;
+        }
+        next_pc++;
+    }
+
+    /* get immediate if needed (4 bytes) */
+    if((0x3<=icode&&icode<=0x8)&&icode != 0x6){
+        if(!get_long_val(m,next_pc,&imm)){
+            return STAT_ADR;
+        }
+        next_pc += 4;
+    }
+
+    /* the maps first, so that running out of memory leaves no half record */
+    for (a = pc; a < next_pc; a++) {
+        p = &m->page[a >> PG_BITS];
+        if (!p->code && !(p->code = (byte_t *)mem_calloc(m, PG_SIZE, 1)))
+            return STAT_ADR;
+    }
+    p = &m->page[pc >> PG_BITS];
+    if (!p->icache && !(p->icache = (dinst_t *)mem_calloc(m, PG_SIZE, sizeof(dinst_t))))
+        return STAT_ADR;
+
+    /* fill the record and mark its bytes as code */
+    d = &p->icache[pc & PG_MASK];
+    d->icode = icode;
+    d->ifun = GET_FUN(codefun);
+    d->rA = GET_REGA(regSpecifier);
+    d->rB = GET_REGB(regSpecifier);
+    d->valC = imm;
+    d->next_pc = next_pc;
+    d->op = NULL;
+    for (; pc < next_pc; pc++)
+        m->page[pc >> PG_BITS].code[pc & PG_MASK] = TRUE;
+    d->valid = TRUE;
+
+    *dp = d;
+    return STAT_AOK;
+}
+
+/* 
+ * nexti: execute single instruction and return status.
+ * args
+ *     sim: the y86 image with PC, register and memory
+ *
+ * return
+ *     STAT_AOK: continue
+ *     STAT_HLT: halt
+ *     STAT_ADR: invalid instruction address, data address, stack address, ...
+ *     STAT_INS: invalid instruction, register id, ...
+ */
+stat_t nexti(y86sim_t *sim)
+{
+    dinst_t *d;
+    itype_t icode;
+    alu_t ifun;
+    long_t next_pc;
+
+    /* get the decoded instruction (decode it at the first time) */
+    if (!(d = cached_inst(sim->m, sim->pc))) {
+        stat_t e = decode_inst(sim->m, sim->pc, &d);
+        if (e != STAT_AOK) {
+            err_print(sim, "PC = 0x%x, Invalid instruction address", sim->pc);
+            return e;
+        }
+    }
+    icode = d->icode;
+    ifun = d->ifun;
+    next_pc = d->next_pc;
+
+    regid_t regA = d->rA;
+    regid_t regB = d->rB;
+    long_t valA = get_reg_val(sim->r,regA);
+    long_t valB = get_reg_val(sim->r,regB);
+    long_t imm = d->valC;
+
+    /* execute the instruction */
+    switch (icode) {
+      case I_HALT: /* 0:0 */
+        return STAT_HLT;
+        break;
+      case I_NOP: /* 1:0 */
+        sim->pc = next_pc;
+        break;
+      case I_RRMOVL:{  /* 2:x regA:regB */
+        if(ifun>0x6){
+            err_print(sim, "PC = 0x%x, Invalid instruction address", sim->pc);
+            return STAT_INS;
+        }
+        if(cond_doit(get_cc(sim),ifun) == TRUE){
+            set_reg_val(sim->r,regB,valA);
+        }
+        sim->pc = next_pc;
+        break;
+        }
+      case I_IRMOVL: /* 3:0 F:regB imm */
+        set_reg_val(sim->r,regB,imm);
+        sim->pc = next_pc;
+        break;
+      case I_RMMOVL: {/* 4:0 regA:regB imm */
+        long_t addr = valB + imm;
+        if(addr>sim->m->len||addr<0){
+            err_print(sim, "PC = 0x%x, Invalid data address 0x%.2x", sim->pc, addr);
+            return STAT_ADR;
+        }
+        if (!store_long(sim->m,addr,valA))
+            return STAT_ADR;
+        sim->pc = next_pc;
+        break;
+        }
+      case I_MRMOVL: {/* 5:0 regB:regA imm */
+        long_t addr = valB + imm;
+        if(addr>sim->m->len||addr<0){
+            err_print(sim, "PC = 0x%x, Invalid data address 0x%.2x", sim->pc, addr);
+            return STAT_ADR;
+        }
+        get_long_val(sim->m,addr,&valA);
+        set_reg_val(sim->r,regA,valA);
+        sim->pc = next_pc;
+        break;
+        }
+      case I_ALU: /* 6:x regA:regB */
+        if(ifun>0x3){
+            err_print(sim, "PC = 0x%x, Invalid instruction address", sim->pc);
+            return STAT_INS;
+        }
+        long_t val = compute_alu(ifun,valA,valB);
+        set_cc_lazy(sim,ifun,valA,valB,val);
+        set_reg_val(sim->r,regB,val);
+        sim->pc = next_pc;
+        break;
+      case I_JMP: /* 7:x imm */
+        if(ifun>0x6){
+            err_print(sim, "PC = 0x%x, Invalid instruction address", sim->pc);
+            return STAT_INS;
+        }
+        if(cond_doit(get_cc(sim),ifun) == TRUE){
+            sim->pc = imm;
+        }else{
+            sim->pc = next_pc;
+        }
+        break;
+      case I_CALL: {/* 8:x imm */
+        long_t nextAddr = imm; 
+        long_t valS = get_reg_val(sim->r,REG_ESP) - 4;
+        set_reg_val(sim->r,REG_ESP,valS);
+        if(nextAddr>sim->m->len||nextAddr < 0){
+            err_print(sim, "PC = 0x%x, Invalid stack address 0x%.2x", sim->pc, nextAddr);
+            return STAT_ADR;
+        }
+        if(valS>sim->m->len||valS < 0){
+            err_print(sim, "PC = 0x%x, Invalid stack address 0x%.2x", sim->pc, valS);
+            return STAT_ADR;
+        }
+        long_t returnAddr = next_pc;
+        if (!store_long(sim->m,valS,returnAddr))
+            return STAT_ADR;
+        sim->pc = imm;
+        break;
+        }
+      case I_RET: {/* 9:0 */
+        long_t valS = get_reg_val(sim->r,REG_ESP);
+        long_t retAddr = 0;
+        get_long_val(sim->m,valS,&retAddr);
+        valS += 4;
+        set_reg_val(sim->r,REG_ESP,valS);
+        sim->pc = retAddr;
+        break;
+        }
+      case I_PUSHL:{ /* A:0 regA:F */
+        long_t valS = get_reg_val(sim->r,REG_ESP);
+        valS -= 4;
+        set_reg_val(sim->r,REG_ESP,valS);
+        if(valS < 0x0){
+            err_print(sim, "PC = 0x%x, Invalid stack address 0x%.2x", sim->pc, valS);
+            return STAT_ADR;
+        }
+        if (!store_long(sim->m,valS,valA))
+            return STAT_ADR;
+        sim->pc = next_pc;
+        break;
+        }
+      case I_POPL:{ /* B:0 regA:F */
+        long_t valS = get_reg_val(sim->r,REG_ESP);
+        get_long_val(sim->m,valS,&valA);
+        valS += 4;
+        set_reg_val(sim->r,REG_ESP,valS);
+        set_reg_val(sim->r,regA,valA);
+        sim->pc = next_pc;
+        break;
+        }
+      default:
+        err_print(sim, "PC = 0x%x, Invalid instruction %.2x", sim->pc,
+                  HPACK(icode, ifun));
+        return STAT_INS;
+    }
+    
+    return STAT_AOK;
+}
+
+/*
+ * run_switch: execute step-by-step with nexti() (the reference engine),
+ * stopping at breakpoints and watches like run_thread()
+ */
+stat_t run_switch(y86sim_t *sim, int max_steps, int *steps)
+{
+    mem_t *m = sim->m;
+    int step;
+    stat_t e = STAT_AOK;
+
+    m->watch_hit = FALSE;
+    sim->brk_hit = NULL;
+    for (step = 0; step < max_steps && e == STAT_AOK && !m->watch_hit; step++) {
+        /* breakpoints don't stop the first instruction, to resume from them */
+        if (sim->brk && step > 0 && (sim->brk_hit = brk_hit(sim, sim->pc)))
+            break;
+        e = nexti(sim);
+    }
+
+    *steps = step;
+    return e;
+}
+
+/*
+ * Superinstructions: pairs of instructions the threaded engine runs as one
+ * handler, entering the second without a dispatch. The second still
+ * counts as a step of its own, so the state after any step is unchanged.
+ */
+typedef enum { FUSE_NONE, FUSE_IRMOVL_ALU, FUSE_ALU_JXX, FUSE_LOAD_STORE,
+    FUSE_CNT } fuse_t;
+
+static char *fuse_names[] = { "", "irmovl+OPl", "OPl+jXX", "mrmovl+rmmovl" };
+
+/* fuse_kind: the superinstruction 'd' starts with 'next' (at d->next_pc) */
+static fuse_t fuse_kind(dinst_t *d, dinst_t *next)
+{
+    if (d->icode == I_IRMOVL && next->icode == I_ALU && next->ifun <= A_XOR)
+        return FUSE_IRMOVL_ALU;
+    if (d->icode == I_ALU && d->ifun <= A_XOR && next->icode == I_JMP
+        && next->ifun != C_YES && next->ifun <= C_G)
+        return FUSE_ALU_JXX;
+    if (d->icode == I_MRMOVL && next->icode == I_RMMOVL)
+        return FUSE_LOAD_STORE;
+    return FUSE_NONE;
+}
+
+/*
+ * run_thread: execute with direct-threaded dispatch (GCC labels-as-values)
+ * over the pre-decoded instructions. Each dinst_t caches the address of its
+ * handler, so an instruction jumps straight to the next one's handler.
+ * The state changes, error messages and step counting are the same as
+ * calling nexti() in a loop. It also stops at the breakpoints (before the
+ * instruction) and watches (after the write), see set_brk() and watch_mem().
+ */
+stat_t run_thread(y86sim_t *sim, int max_steps, int *steps)
+{
+    mem_t *m = sim->m;
+    long_t *r = sim->r;
+    long_t pc = sim->pc;
+    int step = 0;
+    stat_t e = STAT_AOK;
+    dinst_t *d;
+    dinst_t *icache = NULL; /* icache of the page [base, base + PG_SIZE) */
+    long_t base = 0;
+    long_t valA, valB, val;
+
+/* fetch the next decoded instruction and jump to its handler */
+#define DISPATCH() do { \
+    if (step >= max_steps) \
+        goto out; \
+    step++; \
+    if ((unsigned)pc - (unsigned)base < PG_SIZE && icache \
+        && (d = &icache[pc - base])->op) \
+        goto *d->op; \
+    goto lookup; \
+} while (0)
+
+#define NEXT() do { \
+    pc = d->next_pc; \
+    DISPATCH(); \
+} while (0)
+
+/* end of the first half of a superinstruction: 'd' becomes the second */
+#define FUSE(_ok) do { \
+    pc = d->next_pc; \
+    if (step >= max_steps) \
+        goto out; \
+    step++; \
+    if ((unsigned)pc - (unsigned)base >= PG_SIZE || !icache \
+        || !(d = &icache[pc - base])->valid || !d->op || !(_ok)) \
+        goto lookup; \
+} while (0)
+
+/* stop after an instruction that wrote a watched byte */
+#define WATCHED() do { \
+    if (m->watch_hit) \
+        goto out; \
+} while (0)
+
+    m->watch_hit = FALSE;
+    sim->brk_hit = NULL;
+    DISPATCH();
+
+lookup:
+    if (pc >= 0 && pc < m->len) {
+        base = pc & ~PG_MASK;
+        icache = m->page[pc >> PG_BITS].icache;
+        if (icache && (d = &icache[pc - base])->op)
+            goto *d->op;
+        /* breakpoints don't stop the first instruction, to resume from them */
+        if (step > 1 && (sim->brk_hit = brk_hit(sim, pc))) {
+            step--;
+            goto out;
+        }
+    }
+    if ((e = decode_inst(m, pc, &d)) != STAT_AOK) {
+        err_print(sim, "PC = 0x%x, Invalid instruction address", pc);
+        goto out;
+    }
+    switch (d->icode) {
+      case I_HALT:   d->op = &&op_halt; break;
+      case I_NOP:    d->op = &&op_nop; break;
+      case I_RRMOVL:
+        d->op = d->ifun > C_G ? &&op_badfun :
+                d->ifun == C_YES ? &&op_rrmovl : &&op_cmov;
+        break;
+      case I_IRMOVL: d->op = &&op_irmovl; break;
+      case I_RMMOVL: d->op = &&op_rmmovl; break;
+      case I_MRMOVL: d->op = &&op_mrmovl; break;
+      case I_ALU: {
+        static const void *alu_ops[] = { &&op_addl, &&op_subl, &&op_andl, &&op_xorl };
+        d->op = d->ifun > A_XOR ? &&op_badfun : alu_ops[d->ifun];
+        break;
+      }
+      case I_JMP:
+        d->op = d->ifun > C_G ? &&op_badfun :
+                d->ifun == C_YES ? &&op_jmp : &&op_jxx;
+        break;
+      case I_CALL:   d->op = &&op_call; break;
+      case I_RET:    d->op = &&op_ret; break;
+      case I_PUSHL:  d->op = &&op_pushl; break;
+      case I_POPL:   d->op = &&op_popl; break;
+      default:       d->op = &&op_badins; break;
+    }
+
+    /* start a superinstruction if the next one goes with this one */
+    if (d->icode == I_IRMOVL || d->icode == I_ALU || d->icode == I_MRMOVL) {
+        static const void *irmovl_ops[] = { &&op_irmovl_addl, &&op_irmovl_subl,
+            &&op_irmovl_andl, &&op_irmovl_xorl };
+        static const void *jxx_ops[] = { &&op_addl_jxx, &&op_subl_jxx,
+            &&op_andl_jxx, &&op_xorl_jxx };
+        dinst_t *next = cached_inst(m, d->next_pc);
+
+        if (next || decode_inst(m, d->next_pc, &next) == STAT_AOK) {
+            switch (fuse_kind(d, next)) {
+              case FUSE_IRMOVL_ALU: d->op = irmovl_ops[next->ifun]; break;
+              case FUSE_ALU_JXX:    d->op = jxx_ops[d->ifun]; break;
+              case FUSE_LOAD_STORE: d->op = &&op_mrmovl_rmmovl; break;
+              default:              break;
+            }
+        }
+    }
+    /* a breakpoint PC keeps its handler uncached to come back here */
+    if (brk_at(m, pc)) {
+        const void *op = d->op;
+        d->op = NULL;
+        goto *op;
+    }
+    goto *d->op;
+
+op_halt:
+    e = STAT_HLT;
+    goto out;
+
+op_nop:
+    NEXT();
+
+op_rrmovl:
+    set_reg_val(r, d->rB, get_reg_val(r, d->rA));
+    NEXT();
+
+op_cmov:
+    valA = get_reg_val(r, d->rA);
+    if (cond_doit(get_cc(sim), d->ifun) == TRUE)
+        set_reg_val(r, d->rB, valA);
+    NEXT();
+
+op_irmovl:
+    set_reg_val(r, d->rB, d->valC);
+    NEXT();
+
+op_rmmovl:
+    valA = get_reg_val(r, d->rA);
+    val = get_reg_val(r, d->rB) + d->valC;
+    if (val > m->len || val < 0) {
+        err_print(sim, "PC = 0x%x, Invalid data address 0x%.2x", pc, val);
+        e = STAT_ADR;
+        goto out;
+    }
+    if (!store_long(m, val, valA)) {
+        e = STAT_ADR;
+        goto out;
+    }
+    pc = d->next_pc;
+    WATCHED();
+    DISPATCH();
+
+#define OP_MRMOVL() do { \
+    valA = get_reg_val(r, d->rA); \
+    val = get_reg_val(r, d->rB) + d->valC; \
+    if (val > m->len || val < 0) { \
+        err_print(sim, "PC = 0x%x, Invalid data address 0x%.2x", pc, val); \
+        e = STAT_ADR; \
+        goto out; \
+    } \
+    get_long_val(m, val, &valA); \
+    set_reg_val(r, d->rA, valA); \
+} while (0)
+
+op_mrmovl:
+    OP_MRMOVL();
+    NEXT();
+
+/* ALU operations, one handler per function code */
+#define OP_ALU(_op, _expr) do { \
+    valA = get_reg_val(r, d->rA); \
+    valB = get_reg_val(r, d->rB); \
+    val = (_expr); \
+    set_cc_lazy(sim, _op, valA, valB, val); \
+    set_reg_val(r, d->rB, val); \
+} while (0)
+
+op_addl:
+    OP_ALU(A_ADD, valB + valA);
+    NEXT();
+op_subl:
+    OP_ALU(A_SUB, valB - valA);
+    NEXT();
+op_andl:
+    OP_ALU(A_AND, valB & valA);
+    NEXT();
+op_xorl:
+    OP_ALU(A_XOR, valB ^ valA);
+    NEXT();
+
+op_jmp:
+    pc = d->valC;
+    DISPATCH();
+
+op_jxx:
+    pc = cond_doit(get_cc(sim), d->ifun) == TRUE ? d->valC : d->next_pc;
+    DISPATCH();
+
+op_call:
+    val = get_reg_val(r, REG_ESP) - 4;
+    set_reg_val(r, REG_ESP, val);
+    if (d->valC > m->len || d->valC < 0) {
+        err_print(sim, "PC = 0x%x, Invalid stack address 0x%.2x", pc, d->valC);
+        e = STAT_ADR;
+        goto out;
+    }
+    if (val > m->len || val < 0) {
+        err_print(sim, "PC = 0x%x, Invalid stack address 0x%.2x", pc, val);
+        e = STAT_ADR;
+        goto out;
+    }
+    if (!store_long(m, val, d->next_pc)) {
+        e = STAT_ADR;
+        goto out;
+    }
+    pc = d->valC;
+    WATCHED();
+    DISPATCH();
+
+op_ret:
+    val = get_reg_val(r, REG_ESP);
+    valA = 0;
+    get_long_val(m, val, &valA);
+    set_reg_val(r, REG_ESP, val + 4);
+    pc = valA;
+    DISPATCH();
+
+op_pushl:
+    valA = get_reg_val(r, d->rA);
+    val = get_reg_val(r, REG_ESP) - 4;
+    set_reg_val(r, REG_ESP, val);
+    if (val < 0x0) {
+        err_print(sim, "PC = 0x%x, Invalid stack address 0x%.2x", pc, val);
+        e = STAT_ADR;
+        goto out;
+    }
+    if (!store_long(m, val, valA)) {
+        e = STAT_ADR;
+        goto out;
+    }
+    pc = d->next_pc;
+    WATCHED();
+    DISPATCH();
+
+op_popl:
+    valA = get_reg_val(r, d->rA);
+    val = get_reg_val(r, REG_ESP);
+    get_long_val(m, val, &valA);
+    set_reg_val(r, REG_ESP, val + 4);
+    set_reg_val(r, d->rA, valA);
+    NEXT();
+
+/* superinstructions, see fuse_kind() */
+#define OP_IRMOVL_ALU(_op, _second) do { \
+    set_reg_val(r, d->rB, d->valC); \
+    FUSE(d->icode == I_ALU && d->ifun == (_op)); \
+    goto _second; \
+} while (0)
+
+op_irmovl_addl:
+    OP_IRMOVL_ALU(A_ADD, op_addl);
+op_irmovl_subl:
+    OP_IRMOVL_ALU(A_SUB, op_subl);
+op_irmovl_andl:
+    OP_IRMOVL_ALU(A_AND, op_andl);
+op_irmovl_xorl:
+    OP_IRMOVL_ALU(A_XOR, op_xorl);
+
+/* the jXX reads the CC right away, so compute it instead of deferring */
+#define OP_ALU_JXX(_op, _expr) do { \
+    valA = get_reg_val(r, d->rA); \
+    valB = get_reg_val(r, d->rB); \
+    val = (_expr); \
+    sim->cc = compute_cc(_op, valA, valB, val); \
+    sim->lazy_op = A_NONE; \
+    set_reg_val(r, d->rB, val); \
+    FUSE(d->icode == I_JMP && d->ifun != C_YES && d->ifun <= C_G); \
+    pc = cond_doit(sim->cc, d->ifun) == TRUE ? d->valC : d->next_pc; \
+    DISPATCH(); \
+} while (0)
+
+op_addl_jxx:
+    OP_ALU_JXX(A_ADD, valB + valA);
+op_subl_jxx:
+    OP_ALU_JXX(A_SUB, valB - valA);
+op_andl_jxx:
+    OP_ALU_JXX(A_AND, valB & valA);
+op_xorl_jxx:
+    OP_ALU_JXX(A_XOR, valB ^ valA);
+
+op_mrmovl_rmmovl:
+    OP_MRMOVL();
+    FUSE(d->icode == I_RMMOVL);
+    goto op_rmmovl;
+
+op_badfun:
+    err_print(sim, "PC = 0x%x, Invalid instruction address", pc);
+    e = STAT_INS;
+    goto out;
+
+op_badins:
+    err_print(sim, "PC = 0x%x, Invalid instruction %.2x", pc,
+              HPACK(d->icode, d->ifun));
+    e = STAT_INS;
+    goto out;
+
+#undef OP_ALU_JXX
+#undef OP_IRMOVL_ALU
+#undef OP_ALU
+#undef OP_MRMOVL
+#undef WATCHED
+#undef FUSE
+#undef NEXT
+#undef DISPATCH
+
+out:
+    sim->pc = pc;
+    *steps = step;
+    return e;
+}
+
+#if defined(__x86_64__)
+/*
+ * Basic-block JIT (x86-64 hosts only)
+ *
+ * Hot Y86 basic blocks are translated into native code in an mmap'd
+ * executable buffer. While native code runs, the Y86 registers live in
+ * r8d..r15d, the packed CC in ebp, the remaining step budget in ebx and
+ * the page table in rsi; rdi points to the jit_ctx_t. Blocks exit to the
+ * dispatcher in run_jit(), which chains direct branches by patching the
+ * exit jump to the target block. Anything unusual (ADR/INS conditions,
+ * untouched pages, stores into translated code or watched pages, halt,
+ * budget smaller than the block) leaves
+ * the native code before touching state and is executed with nexti().
+ * Blocks end before breakpoint PCs and are never chained to them, so the
+ * dispatcher checks every breakpoint.
+ */
+
+#define JIT_CODE_SIZE   (4<<20)
+#define JIT_MAX_BLOCKS  (1<<14)
+#define JIT_HASH_SIZE   (JIT_MAX_BLOCKS<<1)
+#define JIT_BLOCK_INS   64
+#define JIT_INS_BYTES   384     /* worst-case native bytes per instruction */
+#define JIT_INS_EXITS   6       /* most exit stubs of one instruction */
+#ifndef JIT_HOT
+#define JIT_HOT         8       /* interpreted visits before translating */
+#endif
+
+/* why native code returned to the dispatcher */
+typedef enum { EXIT_BRANCH, EXIT_FALLBACK } jit_exit_t;
+
+typedef struct jit_ctx {
+    int regs[8];
+    int cc;
+    int budget;
+    int exit_pc;
+    int exit_reason;
+    byte_t *exit_patch;     /* rel32 to chain, NULL for indirect exits */
+    page_t *page;           /* mem_t.page */
+    byte_t cond_tab[8][8];  /* cond_doit() result by [cond][cc] */
+} jit_ctx_t;
+
+typedef struct jit_block {
+    long_t pc;
+    int count;              /* interpreted visits while cold */
+    bool_t nojit;           /* first instruction can't be translated */
+    byte_t *entry;
+} jit_block_t;
+
+typedef struct jit {
+    jit_ctx_t ctx;
+    byte_t *buf;
+    byte_t *ptr;            /* next free byte of buf */
+    byte_t *enter;          /* trampoline: int enter(jit_ctx_t *, void *) */
+    byte_t *leave;          /* common epilogue of all exits */
+    byte_t *blocks_start;
+    jit_block_t blocks[JIT_MAX_BLOCKS];
+    int nblocks;
+    int hash[JIT_HASH_SIZE];    /* index+1 into blocks, 0 if empty */
+    long_t mem_limit;       /* largest address of an in-bounds 4-byte access */
+} jit_t;
+
+#define CTX_OFF(_f) ((int)offsetof(jit_ctx_t, _f))
+
+/* host registers */
+enum { H_RAX, H_RCX, H_RDX, H_RBX, H_RSP, H_RBP, H_RSI, H_RDI };
+#define H_GUEST(_id) (8 + (_id))
+
+/* x86 condition codes */
+enum { X_O = 0x0, X_B = 0x2, X_E = 0x4, X_NE = 0x5, X_S = 0x8, X_NS = 0x9,
+    X_L = 0xC, X_GE = 0xD, X_LE = 0xE, X_G = 0xF };
+
+static void emit8(jit_t *j, int b)
+{
+    *j->ptr++ = (byte_t)b;
+}
+
+static void emit32(jit_t *j, int v)
+{
+    memcpy(j->ptr, &v, 4);
+    j->ptr += 4;
+}
+
+static void emit64(jit_t *j, uint64_t v)
+{
+    memcpy(j->ptr, &v, 8);
+    j->ptr += 8;
+}
+
+static void emit_rex(jit_t *j, int w, int reg, int rm)
+{
+    int rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+    if (rex != 0x40)
+        emit8(j, rex);
+}
+
+/* <op> r/m32(dst), r32(src), e.g. 0x89 mov, 0x01 add, 0x29 sub */
+static void emit_rr(jit_t *j, int op, int dst, int src)
+{
+    emit_rex(j, 0, src, dst);
+    emit8(j, op);
+    emit8(j, 0xC0 | ((src & 7) << 3) | (dst & 7));
+}
+
+/* mov r32, imm32 */
+static void emit_mov_ri(jit_t *j, int dst, int imm)
+{
+    emit_rex(j, 0, 0, dst);
+    emit8(j, 0xB8 | (dst & 7));
+    emit32(j, imm);
+}
+
+/* 0x81 /ext r32, imm32 (ext: 0 add, 5 sub, 7 cmp) */
+static void emit_alu_ri(jit_t *j, int ext, int dst, int imm)
+{
+    emit_rex(j, 0, 0, dst);
+    emit8(j, 0x81);
+    emit8(j, 0xC0 | (ext << 3) | (dst & 7));
+    emit32(j, imm);
+}
+
+/* lea eax, [base + disp32] */
+static void emit_lea_eax(jit_t *j, int base, int disp)
+{
+    emit_rex(j, 0, 0, base);
+    emit8(j, 0x8D);
+    emit8(j, 0x80 | (base & 7));
+    if ((base & 7) == H_RSP)
+        emit8(j, 0x24);
+    emit32(j, disp);
+}
+
+/* <op> r32, [rcx + rax] (0x8B load) or [rcx + rax], r32 (0x89 store) */
+static void emit_mem(jit_t *j, int op, int reg)
+{
+    emit_rex(j, 0, reg, 0);
+    emit8(j, op);
+    emit8(j, 0x04 | ((reg & 7) << 3));
+    emit8(j, 0x01);
+}
+
+/* <op> r32, [rdi + disp8] (0x8B) or [rdi + disp8], r32 (0x89) */
+static void emit_ctx(jit_t *j, int op, int reg, int disp)
+{
+    emit_rex(j, 0, reg, H_RDI);
+    emit8(j, op);
+    emit8(j, 0x47 | ((reg & 7) << 3));
+    emit8(j, disp);
+}
+
+/* mov dword [rdi + disp8], imm32 */
+static void emit_ctx_imm(jit_t *j, int disp, int imm)
+{
+    emit8(j, 0xC7);
+    emit8(j, 0x47);
+    emit8(j, disp);
+    emit32(j, imm);
+}
+
+/* jcc/jmp rel32 to nowhere yet, return the address of rel32 */
+static byte_t *emit_jump(jit_t *j, int xcc)
+{
+    if (xcc < 0)
+        emit8(j, 0xE9);
+    else {
+        emit8(j, 0x0F);
+        emit8(j, 0x80 | xcc);
+    }
+    j->ptr += 4;
+    return j->ptr - 4;
+}
+
+static void patch_rel32(byte_t *rel, byte_t *target)
+{
+    int disp = (int)(target - (rel + 4));
+    memcpy(rel, &disp, 4);
+}
+
+/* build the enter trampoline and the common exit epilogue */
+static void jit_emit_glue(jit_t *j)
+{
+    static const byte_t saved[] = { H_RBX, H_RBP, 12, 13, 14, 15 };
+    int i;
+
+    j->enter = j->ptr;
+    for (i = 0; i < 6; i++) {
+        emit_rex(j, 0, 0, saved[i]);
+        emit8(j, 0x50 | (saved[i] & 7));    /* push */
+    }
+    emit8(j, 0x48); emit8(j, 0x89); emit8(j, 0xF0);     /* mov rax, rsi */
+    emit8(j, 0x48); emit8(j, 0x8B); emit8(j, 0x77);     /* mov rsi, [rdi+page] */
+    emit8(j, CTX_OFF(page));
+    emit_ctx(j, 0x8B, H_RBX, CTX_OFF(budget));
+    emit_ctx(j, 0x8B, H_RBP, CTX_OFF(cc));
+    for (i = 0; i < 8; i++)
+        emit_ctx(j, 0x8B, H_GUEST(i), CTX_OFF(regs) + 4*i);
+    emit8(j, 0xFF); emit8(j, 0xE0);                     /* jmp rax */
+
+    j->leave = j->ptr;
+    for (i = 0; i < 8; i++)
+        emit_ctx(j, 0x89, H_GUEST(i), CTX_OFF(regs) + 4*i);
+    emit_ctx(j, 0x89, H_RBX, CTX_OFF(budget));
+    emit_ctx(j, 0x89, H_RBP, CTX_OFF(cc));
+    for (i = 5; i >= 0; i--) {
+        emit_rex(j, 0, 0, saved[i]);
+        emit8(j, 0x58 | (saved[i] & 7));    /* pop */
+    }
+    emit8(j, 0xC3);                                     /* ret */
+
+    j->blocks_start = j->ptr;
+}
+
+/* drop every translated block (code buffer full or code overwritten) */
+static void jit_flush(jit_t *j)
+{
+    j->ptr = j->blocks_start;
+    j->nblocks = 0;
+    memset(j->hash, 0, sizeof(j->hash));
+}
+
+static jit_t *jit_new(mem_t *m)
+{
+    jit_t *j = (jit_t *)calloc(1, sizeof(jit_t));
+    int cond, cc;
+
+    if (!j)
+        return NULL;
+    j->buf = mmap(NULL, JIT_CODE_SIZE, PROT_READ|PROT_WRITE|PROT_EXEC,
+                  MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (j->buf == MAP_FAILED) {
+        free(j);
+        return NULL;
+    }
+    j->ptr = j->buf;
+    j->ctx.page = m->page;
+    for (cond = C_YES; cond <= C_G; cond++)
+        for (cc = 0; cc < 8; cc++)
+            j->ctx.cond_tab[cond][cc] = cond_doit(cc, cond);
+    j->mem_limit = m->len - 4;
+    jit_emit_glue(j);
+    return j;
+}
+
+static void jit_free(jit_t *j)
+{
+    munmap(j->buf, JIT_CODE_SIZE);
+    free(j);
+}
+
+/* find the block entry of 'pc', creating a cold one if needed */
+static jit_block_t *jit_lookup(jit_t *j, long_t pc)
+{
+    unsigned h = ((unsigned)pc * 2654435761u) & (JIT_HASH_SIZE - 1);
+    jit_block_t *b;
+
+    while (j->hash[h]) {
+        b = &j->blocks[j->hash[h] - 1];
+        if (b->pc == pc)
+            return b;
+        h = (h + 1) & (JIT_HASH_SIZE - 1);
+    }
+    if (j->nblocks == JIT_MAX_BLOCKS)
+        return NULL;
+    b = &j->blocks[j->nblocks++];
+    memset(b, 0, sizeof(jit_block_t));
+    b->pc = pc;
+    j->hash[h] = j->nblocks;
+    return b;
+}
+
+/* a fixed-up exit: side exits are emitted out of line after the body */
+typedef struct jit_stub {
+    byte_t *rel;        /* rel32 jumping to this stub */
+    long_t pc;          /* exit_pc */
+    jit_exit_t reason;
+    int refund;         /* steps not executed in the block */
+} jit_stub_t;
+
+/* whether the decoded instruction can run natively */
+static bool_t jit_supported(mem_t *m, dinst_t *d)
+{
+#define GUEST(_r) ((_r) < REG_CNT)
+    switch (d->icode) {
+      case I_NOP:
+        return TRUE;
+      case I_RRMOVL:
+        return d->ifun <= C_G && GUEST(d->rA) && GUEST(d->rB);
+      case I_IRMOVL:
+        return GUEST(d->rB);
+      case I_RMMOVL:
+      case I_MRMOVL:
+        return GUEST(d->rA) && GUEST(d->rB);
+      case I_ALU:
+        return d->ifun <= A_XOR && GUEST(d->rA) && GUEST(d->rB);
+      case I_JMP:
+        return d->ifun <= C_G;
+      case I_CALL:
+        return d->valC >= 0 && d->valC <= m->len;
+      case I_RET:
+        return TRUE;
+      case I_PUSHL:
+      case I_POPL:
+        return GUEST(d->rA);
+      default:
+        return FALSE;
+    }
+#undef GUEST
+}
+
+/* x86 jcc equal to cond_doit() right after ALU 'op', or -1 if none */
+static int host_jcc(alu_t op, cond_t cond)
+{
+    static const int xcc[] = { -1, X_LE, X_L, X_E, X_NE, X_GE, X_G };
+
+    if (cond == C_E || cond == C_NE)
+        return xcc[cond];
+    /* add and and set OF like compute_cc(), sub never sets it */
+    if (op == A_ADD || op == A_AND)
+        return xcc[cond];
+    if (op == A_SUB && cond == C_L)
+        return X_S;
+    if (op == A_SUB && cond == C_GE)
+        return X_NS;
+    return -1;
+}
+
+/* test the packed CC in ebp against 'cond', return the x86 jcc if true */
+static int emit_cond_test(jit_t *j, cond_t cond)
+{
+    /* test byte [rdi + rbp + cond_tab[cond]], 1 */
+    emit8(j, 0xF6); emit8(j, 0x84); emit8(j, 0x2F);
+    emit32(j, CTX_OFF(cond_tab) + 8*cond);
+    emit8(j, 1);
+    return X_NE;
+}
+
+/* mov al/cl/dl flags to the packed CC in ebp (all flag-preserving) */
+static void emit_cc(jit_t *j, alu_t op)
+{
+    emit8(j, 0x0F); emit8(j, 0x94); emit8(j, 0xC1);     /* setz cl */
+    emit8(j, 0x0F); emit8(j, 0x98); emit8(j, 0xC2);     /* sets dl */
+    emit8(j, 0x0F); emit8(j, 0xB6); emit8(j, 0xC9);     /* movzx ecx, cl */
+    emit8(j, 0x0F); emit8(j, 0xB6); emit8(j, 0xD2);     /* movzx edx, dl */
+    emit8(j, 0x8D); emit8(j, 0x2C); emit8(j, 0x12);     /* lea ebp, [rdx+rdx] */
+    emit8(j, 0x8D); emit8(j, 0x6C); emit8(j, 0x8D); emit8(j, 0); /* lea ebp, [rbp+rcx*4] */
+    if (op == A_ADD) {
+        emit8(j, 0x0F); emit8(j, 0x90); emit8(j, 0xC0); /* seto al */
+        emit8(j, 0x0F); emit8(j, 0xB6); emit8(j, 0xC0); /* movzx eax, al */
+    }
+    if (op == A_ADD || op == A_XOR) {
+        emit8(j, 0x8D); emit8(j, 0x6C); emit8(j, 0x05); emit8(j, 0); /* lea ebp, [rbp+rax] */
+    }
+}
+
+/* whether an instruction may leave the block through a side exit */
+static bool_t jit_may_exit(dinst_t *d)
+{
+    switch (d->icode) {
+      case I_RMMOVL: case I_MRMOVL: case I_CALL: case I_RET:
+      case I_PUSHL: case I_POPL:
+        return TRUE;
+      default:
+        return FALSE;
+    }
+}
+
+/*
+ * emit_page_walk: turn the guest address in eax into the host address
+ * rcx + rax (page data + offset). Leaves through the returned jumps when the
+ * address is out of memory, the page is untouched or the word crosses it,
+ * and for a 'store' also when the page has watches or the word overlaps
+ * decoded code. A 'store' marks the page dirty.
+ */
+static int emit_page_walk(jit_t *j, bool_t store, byte_t **exits)
+{
+    int n = 0;
+
+    emit_alu_ri(j, 7, H_RAX, j->mem_limit);
+    exits[n++] = emit_jump(j, 0x7);                     /* ja: negative or too big */
+    emit_rr(j, 0x89, H_RDX, H_RAX);                     /* mov edx, eax */
+    emit8(j, 0xC1); emit8(j, 0xEA); emit8(j, PG_BITS);  /* shr edx, PG_BITS */
+    emit8(j, 0x69); emit8(j, 0xD2);                     /* imul edx, edx, sizeof */
+    emit32(j, sizeof(page_t));
+    emit8(j, 0x48); emit8(j, 0x01); emit8(j, 0xF2);     /* add rdx, rsi */
+    emit8(j, 0x48); emit8(j, 0x8B); emit8(j, 0x4A);     /* mov rcx, [rdx+data] */
+    emit8(j, offsetof(page_t, data));
+    emit8(j, 0x48); emit8(j, 0x85); emit8(j, 0xC9);     /* test rcx, rcx */
+    exits[n++] = emit_jump(j, X_E);
+    if (store) {
+        emit8(j, 0x48); emit8(j, 0x83); emit8(j, 0x7A); /* cmp qword [rdx+watch], 0 */
+        emit8(j, offsetof(page_t, watch)); emit8(j, 0);
+        exits[n++] = emit_jump(j, X_NE);
+        emit8(j, 0xC6); emit8(j, 0x42);                 /* mov byte [rdx+dirty], 1 */
+        emit8(j, offsetof(page_t, dirty)); emit8(j, 1);
+    }
+    emit8(j, 0x25); emit32(j, PG_MASK);                 /* and eax, PG_MASK */
+    emit8(j, 0x3D); emit32(j, PG_SIZE - 4);             /* cmp eax, PG_SIZE-4 */
+    exits[n++] = emit_jump(j, 0x7);
+    if (store) {
+        emit8(j, 0x48); emit8(j, 0x8B); emit8(j, 0x52); /* mov rdx, [rdx+code] */
+        emit8(j, offsetof(page_t, code));
+        emit8(j, 0x48); emit8(j, 0x85); emit8(j, 0xD2); /* test rdx, rdx */
+        emit8(j, 0x74); emit8(j, 10);                   /* jz over the check */
+        emit8(j, 0x83); emit8(j, 0x3C); emit8(j, 0x02); emit8(j, 0); /* cmp dword [rdx+rax], 0 */
+        exits[n++] = emit_jump(j, X_NE);
+    }
+    return n;
+}
+
+/*
+ * jit_compile: translate the basic block starting at b->pc
+ *
+ * return
+ *     1: success, b->entry is the native code
+ *     0: the first instruction can't run natively
+ *     -1: the code buffer is full
+ */
+static int jit_compile(jit_t *j, y86sim_t *sim, jit_block_t *b)
+{
+    mem_t *m = sim->m;
+    dinst_t *ins[JIT_BLOCK_INS];
+    bool_t cc_live[JIT_BLOCK_INS];
+    jit_stub_t stubs[JIT_INS_EXITS*JIT_BLOCK_INS + 2];
+    int nstub = 0;
+    int n = 0, i;
+    long_t pc = b->pc;
+    int flags_op = -1;  /* ALU op whose result is still in host flags */
+    bool_t live;
+
+    /* collect the instructions of the block */
+    while (n < JIT_BLOCK_INS) {
+        dinst_t *d;
+        if (!(d = cached_inst(m, pc)) && decode_inst(m, pc, &d) != STAT_AOK)
+            break;
+        if (!jit_supported(m, d) || (n > 0 && brk_at(m, pc)))
+            break;
+        ins[n++] = d;
+        if (d->icode == I_JMP || d->icode == I_CALL || d->icode == I_RET)
+            break;
+        pc = d->next_pc;
+    }
+    if (n == 0)
+        return 0;
+
+    if (j->ptr + (n + 2) * JIT_INS_BYTES > j->buf + JIT_CODE_SIZE)
+        return -1;
+
+    /* the CC of an ALU op is dead if another ALU op overwrites it first */
+    live = TRUE;
+    for (i = n - 1; i >= 0; i--) {
+        cc_live[i] = live;
+        if (ins[i]->icode == I_ALU)
+            live = FALSE;
+        else if (jit_may_exit(ins[i]) || ins[i]->icode == I_RRMOVL
+                 || ins[i]->icode == I_JMP)
+            live = TRUE;
+    }
+
+    b->entry = j->ptr;
+
+    /* take the whole block from the step budget: sub ebx, n; jb out */
+    emit_alu_ri(j, 5, H_RBX, n);
+    stubs[nstub++] = (jit_stub_t){ emit_jump(j, X_B), b->pc, EXIT_FALLBACK, 0 };
+
+    pc = b->pc;
+    for (i = 0; i < n; i++) {
+        dinst_t *d = ins[i];
+        int rA = H_GUEST(d->rA & 7), rB = H_GUEST(d->rB & 7);
+        int refund = n - i;
+        int xcc;
+
+#define PAGE_WALK(_store) do { \
+    byte_t *exits[5]; \
+    int k, nexit = emit_page_walk(j, (_store), exits); \
+    for (k = 0; k < nexit; k++) \
+        stubs[nstub++] = (jit_stub_t){ exits[k], pc, EXIT_FALLBACK, refund }; \
+} while (0)
+
+        switch (d->icode) {
+          case I_NOP:
+            break;
+          case I_RRMOVL:
+            if (d->ifun == C_YES) {
+                emit_rr(j, 0x89, rB, rA);
+                break;
+            }
+            xcc = flags_op >= 0 ? host_jcc(flags_op, d->ifun) : -1;
+            if (xcc < 0) {
+                xcc = emit_cond_test(j, d->ifun);
+                flags_op = -1;
+            }
+            /* cmovcc rB, rA */
+            emit_rex(j, 0, rB, rA);
+            emit8(j, 0x0F); emit8(j, 0x40 | xcc);
+            emit8(j, 0xC0 | ((rB & 7) << 3) | (rA & 7));
+            break;
+          case I_IRMOVL:
+            emit_mov_ri(j, rB, d->valC);
+            break;
+          case I_RMMOVL:
+          case I_MRMOVL:
+            emit_lea_eax(j, rB, d->valC);
+            PAGE_WALK(d->icode == I_RMMOVL);
+            emit_mem(j, d->icode == I_MRMOVL ? 0x8B : 0x89, rA);
+            break;
+          case I_ALU: {
+            static const int alu_op[] = { 0x01, 0x29, 0x21, 0x31 };
+            if (d->ifun == A_XOR && cc_live[i]) {
+                /* compute_cc() sets OF when both operands are negative */
+                emit_rr(j, 0x89, H_RAX, rA);
+                emit_rr(j, 0x21, H_RAX, rB);
+                emit8(j, 0xC1); emit8(j, 0xE8); emit8(j, 31);  /* shr eax, 31 */
+            }
+            emit_rr(j, alu_op[d->ifun], rB, rA);
+            if (cc_live[i])
+                emit_cc(j, d->ifun);
+            flags_op = d->ifun;
+            pc = d->next_pc;
+            continue;
+          }
+          case I_JMP: {
+            byte_t *rel;
+            if (d->ifun != C_YES) {
+                xcc = flags_op >= 0 ? host_jcc(flags_op, d->ifun) : -1;
+                if (xcc < 0)
+                    xcc = emit_cond_test(j, d->ifun);
+                rel = emit_jump(j, xcc);
+                stubs[nstub++] = (jit_stub_t){ rel, d->valC, EXIT_BRANCH, 0 };
+                rel = emit_jump(j, -1);
+                stubs[nstub++] = (jit_stub_t){ rel, d->next_pc, EXIT_BRANCH, 0 };
+            } else {
+                rel = emit_jump(j, -1);
+                stubs[nstub++] = (jit_stub_t){ rel, d->valC, EXIT_BRANCH, 0 };
+            }
+            break;
+          }
+          case I_CALL:
+          case I_PUSHL:
+            emit_lea_eax(j, H_GUEST(REG_ESP), -4);
+            PAGE_WALK(TRUE);
+            if (d->icode == I_PUSHL) {
+                emit_mem(j, 0x89, rA);
+            } else {
+                /* mov dword [rcx + rax], next_pc */
+                emit8(j, 0xC7); emit8(j, 0x04); emit8(j, 0x01);
+                emit32(j, d->next_pc);
+            }
+            emit_alu_ri(j, 5, H_GUEST(REG_ESP), 4);
+            if (d->icode == I_CALL)
+                stubs[nstub++] = (jit_stub_t){ emit_jump(j, -1), d->valC, EXIT_BRANCH, 0 };
+            break;
+          case I_POPL:
+          case I_RET:
+            emit_rr(j, 0x89, H_RAX, H_GUEST(REG_ESP));
+            PAGE_WALK(FALSE);
+            emit_mem(j, 0x8B, H_RDX);
+            emit_alu_ri(j, 0, H_GUEST(REG_ESP), 4);
+            if (d->icode == I_POPL) {
+                emit_rr(j, 0x89, rA, H_RDX);
+            } else {
+                /* indirect exit: mov [rdi+exit_pc], edx */
+                emit_ctx(j, 0x89, H_RDX, CTX_OFF(exit_pc));
+                emit_ctx_imm(j, CTX_OFF(exit_reason), EXIT_BRANCH);
+                emit8(j, 0x48); emit8(j, 0xC7); emit8(j, 0x47);    /* mov qword [rdi+patch], 0 */
+                emit8(j, CTX_OFF(exit_patch)); emit32(j, 0);
+                patch_rel32(emit_jump(j, -1), j->leave);
+            }
+            break;
+          default:
+            break;
+        }
+#undef PAGE_WALK
+        /* every case but ALU may clobber the host flags */
+        if (d->icode != I_NOP && d->icode != I_IRMOVL && d->icode != I_RRMOVL)
+            flags_op = -1;
+        pc = d->next_pc;
+    }
+
+    /* fall through to the next block */
+    if (ins[n-1]->icode != I_JMP && ins[n-1]->icode != I_CALL
+        && ins[n-1]->icode != I_RET)
+        stubs[nstub++] = (jit_stub_t){ emit_jump(j, -1), pc, EXIT_BRANCH, 0 };
+
+    /* out-of-line exit stubs */
+    for (i = 0; i < nstub; i++) {
+        jit_stub_t *s = &stubs[i];
+        patch_rel32(s->rel, j->ptr);
+        if (s->refund)
+            emit_alu_ri(j, 0, H_RBX, s->refund);
+        else if (s->reason == EXIT_FALLBACK)
+            emit_alu_ri(j, 0, H_RBX, n);    /* budget check failed */
+        emit_ctx_imm(j, CTX_OFF(exit_pc), s->pc);
+        emit_ctx_imm(j, CTX_OFF(exit_reason), s->reason);
+        /* mov rax, rel; mov [rdi+exit_patch], rax */
+        emit8(j, 0x48); emit8(j, 0xB8);
+        emit64(j, s->reason == EXIT_BRANCH ? (uint64_t)(uintptr_t)s->rel : 0);
+        emit8(j, 0x48); emit8(j, 0x89); emit8(j, 0x47); emit8(j, CTX_OFF(exit_patch));
+        patch_rel32(emit_jump(j, -1), j->leave);
+    }
+
+    return 1;
+}
+
+/*
+ * run_jit: execute with the basic-block JIT, interpreting cold code and
+ * everything the translated blocks can't handle with nexti().
+ */
+stat_t run_jit(y86sim_t *sim, int max_steps, int *steps)
+{
+    typedef int (*enter_fn)(jit_ctx_t *ctx, byte_t *entry);
+    jit_t *j = jit_new(sim->m);
+    jit_ctx_t *ctx;
+    enter_fn enter;
+    int step = 0;
+    stat_t e = STAT_AOK;
+
+    if (!j) {
+        sim_error(sim, "jit: out of memory, falling back to nexti()");
+        return run_switch(sim, max_steps, steps);
+    }
+    ctx = &j->ctx;
+    enter = (enter_fn)(uintptr_t)j->enter;
+    sim->m->watch_hit = FALSE;
+    sim->brk_hit = NULL;
+
+    while (step < max_steps && e == STAT_AOK && !sim->m->watch_hit) {
+        jit_block_t *b;
+        unsigned gen;
+
+        /* breakpoints don't stop the first instruction, to resume from them */
+        if (sim->brk && step > 0 && (sim->brk_hit = brk_hit(sim, sim->pc)))
+            break;
+        b = jit_lookup(j, sim->pc);
+        if (!b) {
+            jit_flush(j);
+            continue;
+        }
+        if (!b->entry && !b->nojit && ++b->count >= JIT_HOT) {
+            int ok = jit_compile(j, sim, b);
+            if (ok < 0) {
+                jit_flush(j);   /* out of code buffer */
+                continue;
+            }
+            b->nojit = !ok;
+        }
+
+        if (b->entry) {
+            int budget = max_steps - step;
+
+            memcpy(ctx->regs, sim->r, sizeof(ctx->regs));
+            ctx->cc = get_cc(sim);
+            ctx->budget = budget;
+            enter(ctx, b->entry);
+            memcpy(sim->r, ctx->regs, sizeof(ctx->regs));
+            sim->cc = ctx->cc;
+            sim->pc = ctx->exit_pc;
+            step += budget - ctx->budget;
+
+            if (ctx->exit_reason == EXIT_BRANCH) {
+                if (ctx->exit_patch) {
+                    jit_block_t *t = jit_lookup(j, sim->pc);
+                    if (t && t->entry && !brk_at(sim->m, sim->pc))
+                        patch_rel32(ctx->exit_patch, t->entry);
+                }
+                continue;
+            }
+            if (step >= max_steps)
+                break;
+        }
+
+        /* interpret a single instruction */
+        gen = sim->m->icache_gen;
+        e = nexti(sim);
+        step++;
+        if (gen != sim->m->icache_gen)
+            jit_flush(j);   /* translated code may be stale */
+    }
+
+    jit_free(j);
+    *steps = step;
+    return e;
+}
+#endif /* __x86_64__ */
+
+/*
+ * Profiler (-p): run with nexti() and count every executed instruction by
+ * PC and by opcode, the taken branches of every conditional jump and the
+ * instructions of every calling context. Calls and rets move through a
+ * calling context tree, so the inclusive call-graph profile and the
+ * collapsed stacks are exact. The counters are arrays indexed by the PC
+ * (allocated per page like the memory), so each step costs a few increments.
+ */
+
+#define PROF_MAX_DEPTH  1024    /* deeper calls stay in the deepest context */
+
+typedef struct prof_page {
+    uint64_t cnt[PG_SIZE];      /* executions by PC */
+    uint64_t taken[PG_SIZE];    /* taken conditional jumps by PC */
+} prof_page_t;
+
+/* calling context: a function entry reached through a chain of calls */
+typedef struct prof_node {
+    long_t func;                /* entry PC */
+    uint64_t self;              /* instructions executed in the context */
+    uint64_t calls;
+    struct prof_node *parent;
+    struct prof_node *child;
+    struct prof_node *sibling;
+} prof_node_t;
+
+struct prof {
+    int npages;
+    prof_page_t **page;
+    uint64_t op_cnt[I_POPL + 2];    /* by icode, the last one is invalid */
+    uint64_t fuse_cnt[FUSE_CNT];    /* superinstructions run_thread() runs */
+    fuse_t fuse;                /* the last step starts one of that kind */
+    uint64_t total;
+    prof_node_t root;
+    prof_node_t *cur;
+    int depth;                  /* of cur, beyond PROF_MAX_DEPTH: overflow */
+    int overflow;
+};
+
+/* per-function summary of the calling context tree */
+typedef struct prof_func {
+    long_t func;
+    uint64_t self;
+    uint64_t incl;
+    uint64_t calls;
+    int active;                 /* times on the current path (recursion) */
+} prof_func_t;
+
+typedef struct prof_edge {
+    long_t caller;
+    long_t callee;
+    uint64_t calls;
+} prof_edge_t;
+
+static char *op_names[] = { "halt", "nop", "rrmovl", "irmovl", "rmmovl",
+    "mrmovl", "OPl", "jXX", "call", "ret", "pushl", "popl", "invalid" };
+static char *cmov_names[] = { "rrmovl", "cmovle", "cmovl", "cmove",
+    "cmovne", "cmovge", "cmovg" };
+static char *alu_names[] = { "addl", "subl", "andl", "xorl" };
+static char *jmp_names[] = { "jmp", "jle", "jl", "je", "jne", "jge", "jg" };
+
+/* new_prof: empty counters for a run of 'm' from 'pc', NULL if out of memory */
+prof_t *new_prof(mem_t *m, long_t pc)
+{
+    prof_t *p = (prof_t *)mem_calloc(m, 1, sizeof(prof_t));
+    if (!p)
+        return NULL;
+    p->npages = m->npages;
+    p->page = (prof_page_t **)mem_calloc(m, m->npages, sizeof(prof_page_t *));
+    if (!p->page) {
+        free(p);
+        return NULL;
+    }
+    p->root.func = pc;
+    p->cur = &p->root;
+    return p;
+}
+
+static void free_prof_node(prof_node_t *n)
+{
+    while (n) {
+        prof_node_t *next = n->sibling;
+        free_prof_node(n->child);
+        free(n);
+        n = next;
+    }
+}
+
+void free_prof(prof_t *p)
+{
+    int i;
+    for (i = 0; i < p->npages; i++)
+        free(p->page[i]);
+    free(p->page);
+    free_prof_node(p->root.child);
+    free(p);
+}
+
+/*
+ * prof_call: enter the context of 'func' called from the current one,
+ * FALSE if out of memory for a new context
+ */
+static bool_t prof_call(prof_t *p, mem_t *m, long_t func)
+{
+    prof_node_t *n;
+
+    if (p->depth++ >= PROF_MAX_DEPTH) {
+        p->overflow++;
+        return TRUE;
+    }
+    for (n = p->cur->child; n && n->func != func; n = n->sibling)
+        ;
+    if (!n) {
+        if (!(n = (prof_node_t *)mem_calloc(m, 1, sizeof(prof_node_t)))) {
+            p->depth--;
+            return FALSE;
+        }
+        n->func = func;
+        n->parent = p->cur;
+        n->sibling = p->cur->child;
+        p->cur->child = n;
+    }
+    n->calls++;
+    p->cur = n;
+    return TRUE;
+}
+
+static void prof_ret(prof_t *p)
+{
+    if (p->depth == 0)
+        return;     /* ret without call: stay in the root */
+    if (p->depth-- > PROF_MAX_DEPTH)
+        return;
+    p->cur = p->cur->parent;
+}
+
+/* run_prof: run_switch() with the counters of 'p' */
+stat_t run_prof(y86sim_t *sim, prof_t *p, int max_steps, int *steps)
+{
+    int step;
+    stat_t e = STAT_AOK;
+
+    for (step = 0; step < max_steps && e == STAT_AOK; step++) {
+        long_t pc = sim->pc;
+        dinst_t *d = cached_inst(sim->m, pc);
+        itype_t icode;
+        cond_t cond;
+        long_t next_pc;
+        prof_page_t *pp;
+
+        if (!d && decode_inst(sim->m, pc, &d) != STAT_AOK) {
+            p->op_cnt[I_POPL + 1]++;
+            p->cur->self++;
+            p->total++;
+            e = nexti(sim);
+            continue;
+        }
+        icode = d->icode;
+        cond = d->ifun;
+        next_pc = d->next_pc;
+
+        /* pair the steps up the way run_thread() does */
+        if (p->fuse) {
+            p->fuse_cnt[p->fuse]++;
+            p->fuse = FUSE_NONE;
+        } else {
+            dinst_t *next = cached_inst(sim->m, next_pc);
+            if (icode == I_IRMOVL || icode == I_ALU || icode == I_MRMOVL)
+                if (next || decode_inst(sim->m, next_pc, &next) == STAT_AOK)
+                    p->fuse = fuse_kind(d, next);
+        }
+        e = nexti(sim);
+
+        pp = p->page[pc >> PG_BITS];
+        if (!pp && !(pp = p->page[pc >> PG_BITS] =
+                     (prof_page_t *)mem_calloc(sim->m, 1, sizeof(prof_page_t)))) {
+            e = STAT_ADR;
+            continue;
+        }
+        pp->cnt[pc & PG_MASK]++;
+        p->op_cnt[icode <= I_POPL ? icode : I_POPL + 1]++;
+        p->cur->self++;
+        p->total++;
+        if (e != STAT_AOK)
+            continue;
+        if (icode == I_JMP && cond != C_YES && sim->pc != next_pc)
+            pp->taken[pc & PG_MASK]++;
+        else if (icode == I_CALL && !prof_call(p, sim->m, sim->pc))
+            e = STAT_ADR;
+        else if (icode == I_RET)
+            prof_ret(p);
+    }
+
+    *steps = step;
+    return e;
+}
+
+/* inst_name: the mnemonic of the instruction at 'pc' */
+static char *inst_name(mem_t *m, long_t pc)
+{
+    dinst_t *d = cached_inst(m, pc);
+
+    if (!d && decode_inst(m, pc, &d) != STAT_AOK)
+        return "invalid";
+    switch (d->icode) {
+      case I_RRMOVL:
+        return d->ifun <= C_G ? cmov_names[d->ifun] : "invalid";
+      case I_ALU:
+        return d->ifun <= A_XOR ? alu_names[d->ifun] : "invalid";
+      case I_JMP:
+        return d->ifun <= C_G ? jmp_names[d->ifun] : "invalid";
+      default:
+        return d->icode <= I_POPL ? op_names[d->icode] : "invalid";
+    }
+}
+
+static prof_func_t *prof_func(prof_func_t **funcs, int *nfunc, long_t func)
+{
+    int i;
+    for (i = 0; i < *nfunc; i++)
+        if ((*funcs)[i].func == func)
+            return &(*funcs)[i];
+    *funcs = (prof_func_t *)realloc(*funcs, (*nfunc + 1) * sizeof(prof_func_t));
+    memset(&(*funcs)[*nfunc], 0, sizeof(prof_func_t));
+    (*funcs)[*nfunc].func = func;
+    return &(*funcs)[(*nfunc)++];
+}
+
+static void prof_edge(prof_edge_t **edges, int *nedge, long_t caller,
+                      long_t callee, uint64_t calls)
+{
+    int i;
+    for (i = 0; i < *nedge; i++)
+        if ((*edges)[i].caller == caller && (*edges)[i].callee == callee) {
+            (*edges)[i].calls += calls;
+            return;
+        }
+    *edges = (prof_edge_t *)realloc(*edges, (*nedge + 1) * sizeof(prof_edge_t));
+    (*edges)[*nedge].caller = caller;
+    (*edges)[*nedge].callee = callee;
+    (*edges)[(*nedge)++].calls = calls;
+}
+
+/*
+ * prof_walk: add the contexts under 'n' to the function summaries and the
+ * edges, return the instructions of the subtree
+ */
+static uint64_t prof_walk(prof_node_t *n, prof_func_t **funcs, int *nfunc,
+                          prof_edge_t **edges, int *nedge)
+{
+    uint64_t total = n->self;
+    prof_node_t *c;
+    prof_func_t *f = prof_func(funcs, nfunc, n->func);
+    int idx = f - *funcs;
+
+    f->self += n->self;
+    f->calls += n->calls;
+    f->active++;
+    for (c = n->child; c; c = c->sibling) {
+        prof_edge(edges, nedge, n->func, c->func, c->calls);
+        total += prof_walk(c, funcs, nfunc, edges, nedge);
+    }
+    f = &(*funcs)[idx];     /* may have moved */
+    if (--f->active == 0)
+        f->incl += total;   /* outermost activation only */
+    return total;
+}
+
+/* prof_fold: print the collapsed stacks under 'n', 'path' is its caller's */
+static void prof_fold(FILE *f, prof_node_t *n, char *path, size_t len)
+{
+    size_t n_len = len + snprintf(path + len, PROF_MAX_DEPTH * 16 - len,
+                                  "%s0x%.4x", len ? ";" : "", n->func);
+    prof_node_t *c;
+
+    if (n->self)
+        fprintf(f, "%s %llu\n", path, (unsigned long long)n->self);
+    for (c = n->child; c; c = c->sibling)
+        prof_fold(f, c, path, n_len);
+    path[len] = '\0';
+}
+
+static int cmp_count(const void *a, const void *b)
+{
+    uint64_t x = ((const uint64_t *)a)[1], y = ((const uint64_t *)b)[1];
+    if (x != y)
+        return x < y ? 1 : -1;
+    return ((const uint64_t *)a)[0] < ((const uint64_t *)b)[0] ? -1 : 1;
+}
+
+static int cmp_func(const void *a, const void *b)
+{
+    const prof_func_t *x = (const prof_func_t *)a, *y = (const prof_func_t *)b;
+    if (x->incl != y->incl)
+        return x->incl < y->incl ? 1 : -1;
+    return x->func < y->func ? -1 : 1;
+}
+
+/*
+ * write_prof: write the flat profile and the call graph to 'fname' and the
+ * collapsed stacks ("f1;f2;f3 count" lines, for flame graphs) to
+ * 'fname'.folded
+ */
+int write_prof(prof_t *p, y86sim_t *sim, char *fname)
+{
+    mem_t *m = sim->m;
+    char folded[FILENAME_MAX];
+    double total = p->total ? (double)p->total : 1.0;
+    uint64_t (*pcs)[2] = NULL;
+    prof_func_t *funcs = NULL;
+    prof_edge_t *edges = NULL;
+    int npc = 0, nfunc = 0, nedge = 0, i, k;
+    char *path;
+    FILE *f;
+
+    f = fopen(fname, "w");
+    if (!f) {
+        err_print(sim, "Can't open profile file '%s'", fname);
+        return -1;
+    }
+
+    fprintf(f, "Flat profile: %llu instructions\n\n",
+            (unsigned long long)p->total);
+    fprintf(f, "Opcode            count       %%\n");
+    for (i = 0; i <= I_POPL + 1; i++)
+        if (p->op_cnt[i])
+            fprintf(f, "%-8s %14llu %6.2f%%\n", op_names[i],
+                    (unsigned long long)p->op_cnt[i], 100.0 * p->op_cnt[i] / total);
+
+    /* a superinstruction covers two steps */
+    fprintf(f, "\nSuperinstruction  count  steps%%\n");
+    for (i = FUSE_NONE + 1; i < FUSE_CNT; i++)
+        fprintf(f, "%-14s %9llu %6.2f%%\n", fuse_names[i],
+                (unsigned long long)p->fuse_cnt[i], 200.0 * p->fuse_cnt[i] / total);
+
+    for (i = 0; i < p->npages; i++) {
+        if (!p->page[i])
+            continue;
+        for (k = 0; k < PG_SIZE; k++) {
+            if (!p->page[i]->cnt[k])
+                continue;
+            pcs = realloc(pcs, (npc + 1) * sizeof(*pcs));
+            pcs[npc][0] = ((uint64_t)i << PG_BITS) + k;
+            pcs[npc++][1] = p->page[i]->cnt[k];
+        }
+    }
+    qsort(pcs, npc, sizeof(*pcs), cmp_count);
+    fprintf(f, "\nPC                count       %%   cumul  instruction\n");
+    {
+        uint64_t cumul = 0;
+        for (i = 0; i < npc; i++) {
+            long_t pc = (long_t)pcs[i][0];
+            char *name = inst_name(m, pc);
+            cumul += pcs[i][1];
+            fprintf(f, "0x%.4x %14llu %6.2f%% %6.2f%%  %s", pc,
+                    (unsigned long long)pcs[i][1], 100.0 * pcs[i][1] / total,
+                    100.0 * cumul / total, name);
+            if (name[0] == 'j' && strcmp(name, "jmp")) {
+                uint64_t taken = p->page[pc >> PG_BITS]->taken[pc & PG_MASK];
+                fprintf(f, "  taken %llu, not taken %llu",
+                        (unsigned long long)taken,
+                        (unsigned long long)(pcs[i][1] - taken));
+            }
+            fprintf(f, "\n");
+        }
+    }
+
+    prof_walk(&p->root, &funcs, &nfunc, &edges, &nedge);
+    qsort(funcs, nfunc, sizeof(prof_func_t), cmp_func);
+    fprintf(f, "\nCall graph\nfunction          self       %%      inclusive       %%      calls\n");
+    for (i = 0; i < nfunc; i++)
+        fprintf(f, "0x%.4x %14llu %6.2f%% %14llu %6.2f%% %10llu\n", funcs[i].func,
+                (unsigned long long)funcs[i].self, 100.0 * funcs[i].self / total,
+                (unsigned long long)funcs[i].incl, 100.0 * funcs[i].incl / total,
+                (unsigned long long)funcs[i].calls);
+    fprintf(f, "\nCall edges\ncaller    callee            calls\n");
+    for (i = 0; i < nedge; i++)
+        fprintf(f, "0x%.4x -> 0x%.4x %14llu\n", edges[i].caller,
+                edges[i].callee, (unsigned long long)edges[i].calls);
+    if (p->overflow)
+        fprintf(f, "\n%d calls deeper than %d were merged into their caller\n",
+                p->overflow, PROF_MAX_DEPTH);
+    fclose(f);
+
+    snprintf(folded, sizeof(folded), "%s.folded", fname);
+    f = fopen(folded, "w");
+    if (!f) {
+        err_print(sim, "Can't open profile file '%s'", folded);
+        return -1;
+    }
+    path = (char *)malloc(PROF_MAX_DEPTH * 16 + 16);
+    path[0] = '\0';
+    prof_fold(f, &p->root, path, 0);
+    free(path);
+    fclose(f);
+
+    free(pcs);
+    free(funcs);
+    free(edges);
+    return 0;
+}
+
+/*
+ * Timing model (-T): estimate the cycles the PIPE processor of
+ * lab6/sim/pipe/pipe-std.hcl takes for the instruction stream. PIPE
+ * issues one instruction per cycle and loses cycles to bubbles:
+ *     load/use  mrmovl/popl whose dstM is a source of the next one: 1
+ *     jXX       predicted taken, so a not-taken one is mispredicted: 2
+ *     ret       fetch stalls until the return address is read: 3
+ * Like psim, cycles are counted from the first instruction reaching
+ * write-back, so cycles = instructions + bubbles.
+ */
+
+#define PIPE_LOAD_USE   1
+#define PIPE_MISPREDICT 2
+#define PIPE_RET        3
+
+/* pipe_srcs: d_srcA and d_srcB of pipe-std.hcl, REG_NONE if not used */
+static void pipe_srcs(dinst_t *d, regid_t *srcA, regid_t *srcB)
+{
+    *srcA = *srcB = REG_NONE;
+    switch (d->icode) {
+      case I_RRMOVL:
+        *srcA = d->rA;
+        break;
+      case I_RMMOVL:
+      case I_ALU:
+        *srcA = d->rA;
+        *srcB = d->rB;
+        break;
+      case I_MRMOVL:
+        *srcB = d->rB;
+        break;
+      case I_PUSHL:
+        *srcA = d->rA;
+        *srcB = REG_ESP;
+        break;
+      case I_POPL:
+      case I_RET:
+        *srcA = *srcB = REG_ESP;
+        break;
+      case I_CALL:
+        *srcB = REG_ESP;
+        break;
+      default:
+        break;
+    }
+}
+
+/* run_timing: execute with nexti() and charge the PIPE bubbles to 't' */
+stat_t run_timing(y86sim_t *sim, timing_t *t, int max_steps, int *steps)
+{
+    int step;
+    stat_t e = STAT_AOK;
+    bool_t load = FALSE;        /* the last instruction was mrmovl/popl */
+    regid_t dstM = REG_NONE;
+
+    for (step = 0; step < max_steps && e == STAT_AOK; step++) {
+        dinst_t *d = cached_inst(sim->m, sim->pc);
+        regid_t srcA, srcB;
+        itype_t icode;
+        bool_t taken = FALSE;
+
+        t->insts++;
+        if (!d && decode_inst(sim->m, sim->pc, &d) != STAT_AOK) {
+            e = nexti(sim);
+            continue;
+        }
+        /* as in the HCL, RNONE == RNONE stalls too */
+        pipe_srcs(d, &srcA, &srcB);
+        if (load && (dstM == srcA || dstM == srcB))
+            t->load_use++;
+
+        icode = d->icode;
+        load = icode == I_MRMOVL || icode == I_POPL;
+        dstM = d->rA;
+        if (icode == I_JMP && d->ifun != C_YES)
+            taken = cond_doit(get_cc(sim), d->ifun);
+        e = nexti(sim);
+        if (e != STAT_AOK)
+            continue;
+        if (icode == I_JMP && d->ifun != C_YES) {
+            t->jxx++;
+            t->mispredict += !taken;
+        } else if (icode == I_RET)
+            t->ret++;
+    }
+
+    *steps = step;
+    return e;
+}
+
+/* print_timing: the estimate in psim's format and where the bubbles are */
+void print_timing(FILE *out, timing_t *t)
+{
+    uint64_t lu = t->load_use * PIPE_LOAD_USE;
+    uint64_t mp = t->mispredict * PIPE_MISPREDICT;
+    uint64_t rt = t->ret * PIPE_RET;
+    uint64_t cycles = t->insts + lu + mp + rt;
+
+    fprintf(out, "\nPIPE estimate (pipe-std.hcl)\n");
+    fprintf(out, "CPI: %llu cycles/%llu instructions = %.2f\n",
+            (unsigned long long)cycles, (unsigned long long)t->insts,
+            t->insts ? (double)cycles / t->insts : 1.0);
+    fprintf(out, "Bubbles: load/use %llu (%llu hazards), jXX %llu (%llu of %llu"
+            " mispredicted), ret %llu (%llu rets)\n",
+            (unsigned long long)lu, (unsigned long long)t->load_use,
+            (unsigned long long)mp, (unsigned long long)t->mispredict,
+            (unsigned long long)t->jxx, (unsigned long long)rt,
+            (unsigned long long)t->ret);
+}
+
+/*
+ * inst_effects: the registers the instruction 'd' is about to write
+ * (REG_NONE if none) and the word it loads or stores ('mem' is
+ * TRACE_LOAD/TRACE_STORE, 0 if none)
+ */
+void inst_effects(y86sim_t *sim, dinst_t *d, regid_t *w1, regid_t *w2,
+                  long_t *addr, byte_t *mem)
+{
+    long_t *r = sim->r;
+
+    switch (d->icode) {
+      case I_RRMOVL:
+        if (cond_doit(get_cc(sim), d->ifun))
+            *w1 = d->rB;
+        break;
+      case I_IRMOVL:
+      case I_ALU:
+        *w1 = d->rB;
+        break;
+      case I_RMMOVL:
+      case I_MRMOVL:
+        *w1 = d->icode == I_MRMOVL ? d->rA : REG_NONE;
+        *addr = d->valC + get_reg_val(r, d->rB);
+        *mem = d->icode == I_MRMOVL ? TRACE_LOAD : TRACE_STORE;
+        break;
+      case I_PUSHL:
+      case I_CALL:
+        *w1 = REG_ESP;
+        *addr = r[REG_ESP] - 4;
+        *mem = TRACE_STORE;
+        break;
+      case I_POPL:
+        *w2 = d->rA;
+        /* fall through */
+      case I_RET:
+        *w1 = REG_ESP;
+        *addr = r[REG_ESP];
+        *mem = TRACE_LOAD;
+        break;
+      default:
+        break;
+    }
+}
+
+/*
+ * Execution trace (-t): run with nexti() and append a trace_rec_t per step
+ * to a buffer of TRACE_BUF records. Full buffers are written with fwrite(),
+ * or with -w handed to a writer thread while the other buffer fills up.
+ */
+
+#define TRACE_BUF   (1<<16)
+
+struct tracer {
+    y86sim_t *sim;          /* reports the errors */
+    FILE *f;
+    trace_rec_t *buf[2];
+    int cur;                /* the buffer being filled */
+    int n;                  /* records in it */
+    long_t next_pc;         /* what the next record's dpc is relative to */
+    bool_t err;
+    /* writer thread */
+    bool_t async;
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    trace_rec_t *pending;   /* full buffer for the writer, NULL if none */
+    int npending;
+    bool_t done;
+};
+
+static void *trace_writer(void *arg)
+{
+    tracer_t *t = (tracer_t *)arg;
+
+    pthread_mutex_lock(&t->lock);
+    for (;;) {
+        while (!t->pending && !t->done)
+            pthread_cond_wait(&t->cond, &t->lock);
+        if (!t->pending)
+            break;
+        pthread_mutex_unlock(&t->lock);
+        if (fwrite(t->pending, sizeof(trace_rec_t), t->npending, t->f)
+            != (size_t)t->npending)
+            t->err = TRUE;
+        pthread_mutex_lock(&t->lock);
+        t->pending = NULL;
+        pthread_cond_broadcast(&t->cond);
+    }
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+/* trace_flush: write out the filled buffer and switch to the other one */
+static void trace_flush(tracer_t *t)
+{
+    if (!t->async) {
+        if (fwrite(t->buf[t->cur], sizeof(trace_rec_t), t->n, t->f)
+            != (size_t)t->n)
+            t->err = TRUE;
+        t->n = 0;
+        return;
+    }
+    pthread_mutex_lock(&t->lock);
+    while (t->pending)
+        pthread_cond_wait(&t->cond, &t->lock);
+    t->pending = t->buf[t->cur];
+    t->npending = t->n;
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+    t->cur ^= 1;
+    t->n = 0;
+}
+
+/* new_tracer: start the trace of 'sim' from its PC */
+tracer_t *new_tracer(y86sim_t *sim, char *fname, bool_t async)
+{
+    tracer_t *t = (tracer_t *)mem_calloc(sim->m, 1, sizeof(tracer_t));
+    long_t pc = sim->pc;
+    trace_hdr_t hdr;
+
+    if (!t)
+        return NULL;
+    t->buf[0] = (trace_rec_t *)mem_calloc(sim->m, TRACE_BUF, sizeof(trace_rec_t));
+    t->buf[1] = (trace_rec_t *)mem_calloc(sim->m, TRACE_BUF, sizeof(trace_rec_t));
+    if (!t->buf[0] || !t->buf[1]) {
+        free(t->buf[0]);
+        free(t->buf[1]);
+        free(t);
+        return NULL;
+    }
+    t->f = fopen(fname, "wb");
+    if (!t->f) {
+        err_print(sim, "Can't open trace file '%s'", fname);
+        free(t->buf[0]);
+        free(t->buf[1]);
+        free(t);
+        return NULL;
+    }
+    memcpy(hdr.magic, TRACE_MAGIC, 4);
+    hdr.version = TRACE_VERSION;
+    hdr.rec_size = sizeof(trace_rec_t);
+    hdr.start_pc = pc;
+    if (fwrite(&hdr, sizeof(hdr), 1, t->f) != 1)
+        t->err = TRUE;
+    t->next_pc = pc;
+    t->sim = sim;
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->cond, NULL);
+    if (async && pthread_create(&t->tid, NULL, trace_writer, t) == 0)
+        t->async = TRUE;
+    return t;
+}
+
+/* free_tracer: write the rest of the trace, return -1 if anything failed */
+int free_tracer(tracer_t *t, char *fname)
+{
+    int ret;
+
+    trace_flush(t);
+    if (t->async) {
+        pthread_mutex_lock(&t->lock);
+        t->done = TRUE;
+        pthread_cond_broadcast(&t->cond);
+        pthread_mutex_unlock(&t->lock);
+        pthread_join(t->tid, NULL);
+    }
+    if (fclose(t->f) != 0)
+        t->err = TRUE;
+    if (t->err)
+        err_print(t->sim, "Failed to write trace file '%s'", fname);
+    ret = t->err ? -1 : 0;
+    pthread_mutex_destroy(&t->lock);
+    pthread_cond_destroy(&t->cond);
+    free(t->buf[0]);
+    free(t->buf[1]);
+    free(t);
+    return ret;
+}
+
+static inline trace_rec_t *trace_rec(tracer_t *t)
+{
+    if (t->n == TRACE_BUF)
+        trace_flush(t);
+    return &t->buf[t->cur][t->n++];
+}
+
+/* run_trace: run_switch() writing a trace record per step to 't' */
+stat_t run_trace(y86sim_t *sim, tracer_t *t, int max_steps, int *steps)
+{
+    int step;
+    stat_t e = STAT_AOK;
+
+    for (step = 0; step < max_steps && e == STAT_AOK; step++) {
+        long_t pc = sim->pc;
+        long_t *r = sim->r;
+        dinst_t *d = cached_inst(sim->m, pc);
+        regid_t w1 = REG_NONE, w2 = REG_NONE;
+        long_t addr = 0, next_pc = pc;
+        byte_t code = TRACE_NOINS, mem = 0;
+        trace_rec_t *rec;
+
+        if (d || decode_inst(sim->m, pc, &d) == STAT_AOK) {
+            code = HPACK(d->icode, d->ifun);
+            next_pc = d->next_pc;
+            inst_effects(sim, d, &w1, &w2, &addr, &mem);
+        }
+
+        e = nexti(sim);
+
+        /* a PC out of the reach of dpc needs a record of its own */
+        if (pc - t->next_pc < -32768 || pc - t->next_pc > 32767) {
+            rec = trace_rec(t);
+            memset(rec, 0, sizeof(trace_rec_t));
+            rec->code = TRACE_SETPC;
+            rec->regs = HPACK(REG_NONE, REG_NONE);
+            rec->addr = pc;
+            t->next_pc = pc;
+        }
+        rec = trace_rec(t);
+        rec->dpc = (short)(pc - t->next_pc);
+        rec->code = code;
+        rec->flags = e | (e == STAT_AOK ? mem : 0);
+        if (e != STAT_AOK)
+            w1 = w2 = REG_NONE;
+        rec->regs = HPACK(w1, w2);
+        rec->val[0] = get_reg_val(r, w1);
+        rec->val[1] = get_reg_val(r, w2);
+        rec->addr = addr;
+        t->next_pc = next_pc;
+    }
+
+    *steps = step;
+    return e;
+}
+
+/*
+ * Lockstep lanes (-e lanes): up to LANES images run one instruction stream
+ * together, with their registers and CC in GCC vectors (AVX2 code with
+ * -mavx2, SSE or scalar code otherwise). An instruction runs on all lanes
+ * at once only if it has the same bytes in every lane, takes the same
+ * path in every lane and can't fail in any. Otherwise the lanes write
+ * their state back before it and each one goes on alone with
+ * run_thread(). The lanes also part at breakpoint PCs and after a store
+ * into a watched byte, where only the lanes that hit them stop. Batch mode
+ * hands LANES images at a time to a worker; a single image is a group of
+ * one.
+ */
+
+typedef long_t vlong_t __attribute__((vector_size(LANES * sizeof(long_t))));
+
+typedef struct lanes {
+    int n;                      /* lanes in use */
+    y86sim_t **sim;
+    vlong_t r[REG_CNT];
+    vlong_t cc;
+    byte_t **same;              /* per page of lane 0: the instruction at
+                                   that offset is the same in all lanes */
+    bool_t brk;                 /* some lane has breakpoints */
+    bool_t watch_hit;           /* some lane wrote a watched byte */
+} lanes_t;
+
+/* compute_alu() and compute_cc() of every lane */
+#define ALU_V(_op, _a, _b) \
+    ((_op) == A_ADD ? (_b) + (_a) : (_op) == A_SUB ? (_b) - (_a) : \
+     (_op) == A_AND ? ((_b) & (_a)) : ((_b) ^ (_a)))
+
+#define CC_V(_op, _a, _b, _val) \
+    ((((_val) == 0) & 4) | (((_val) < 0) & 2) | ((((_a) < 0) == ((_b) < 0)) \
+     & (((_val) < 0) != ((_b) < 0)) & ((_op) == A_SUB ? 0 : 1)))
+
+/* cond_doit() of every lane as a mask: -1 to do it, 0 not to */
+#define COND_V(_cc, _cond) \
+    ((_cond) == C_YES ? (_cc) == (_cc) : \
+     (_cond) == C_LE ? (ZF_V(_cc) | (SF_V(_cc) ^ OF_V(_cc))) : \
+     (_cond) == C_L ? (SF_V(_cc) ^ OF_V(_cc)) : \
+     (_cond) == C_E ? ZF_V(_cc) : \
+     (_cond) == C_NE ? ~ZF_V(_cc) : \
+     (_cond) == C_GE ? ~(SF_V(_cc) ^ OF_V(_cc)) : \
+     (~(SF_V(_cc) ^ OF_V(_cc)) & ~ZF_V(_cc)))
+#define ZF_V(_cc) (((_cc) & 4) != 0)
+#define SF_V(_cc) (((_cc) & 2) != 0)
+#define OF_V(_cc) (((_cc) & 1) != 0)
+
+#define REG_V(_g, _id) ((unsigned)(_id) < REG_CNT ? (_g)->r[_id] : (vlong_t){ 0 })
+#define SET_REG_V(_g, _id, _v) do { \
+    if ((unsigned)(_id) < REG_CNT) \
+        (_g)->r[_id] = (_v); \
+} while (0)
+
+/* lanes_any: whether 'mask' is set in some lane in use */
+#define LANES_ANY(_g, _mask) lanes_any(_g, (vlong_t[]){ _mask })
+
+static inline bool_t lanes_any(lanes_t *g, const vlong_t *mask)
+{
+    int l;
+    for (l = 0; l < g->n; l++)
+        if ((*mask)[l])
+            return TRUE;
+    return FALSE;
+}
+
+/* lanes_fetch: lane 0's decoded instruction at 'pc', NULL if lanes differ */
+static dinst_t *lanes_fetch(lanes_t *g, long_t pc)
+{
+    mem_t *m0 = g->sim[0]->m;
+    dinst_t *d = cached_inst(m0, pc);
+    byte_t *same;
+    long_t a;
+    int l;
+
+    if (!d && decode_inst(m0, pc, &d) != STAT_AOK)
+        return NULL;
+    same = g->same[pc >> PG_BITS];
+    if (!same && !(same = g->same[pc >> PG_BITS] = (byte_t *)calloc(PG_SIZE, 1)))
+        return NULL;
+    if (same[pc & PG_MASK])
+        return d;
+    for (l = 1; l < g->n; l++)
+        for (a = pc; a < d->next_pc; a++) {
+            byte_t b0 = 0, b = 0;
+            get_byte_val(m0, a, &b0);
+            get_byte_val(g->sim[l]->m, a, &b);
+            if (b != b0)
+                return NULL;
+        }
+    same[pc & PG_MASK] = TRUE;
+    return d;
+}
+
+/*
+ * lanes_room: whether the page of every lane's word at (*addr)[l] is there,
+ * allocating it if needed; the lanes leave lockstep if some can't be, and
+ * the run_thread() of that lane reports it
+ */
+static bool_t lanes_room(lanes_t *g, const vlong_t *addr)
+{
+    int l;
+    long_t a;
+
+    for (l = 0; l < g->n; l++) {
+        mem_t *m = g->sim[l]->m;
+        if ((*addr)[l] < 0 || (*addr)[l] > m->len - 4)
+            continue;
+        for (a = (*addr)[l]; a < (*addr)[l] + 4; a += 3) {
+            page_t *p = &m->page[a >> PG_BITS];
+            if (!p->data && !(p->data = (byte_t *)calloc(PG_SIZE, 1)))
+                return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* lanes_store: store a word of lane 'l', forgetting checks of changed code */
+static void lanes_store(lanes_t *g, int l, long_t addr, long_t val)
+{
+    mem_t *m0 = g->sim[0]->m;
+    int i;
+
+    /* the bytes of every checked instruction are code of lane 0 */
+    if (code_at(m0, addr, 4))
+        for (i = 0; i < m0->npages; i++)
+            if (g->same[i])
+                memset(g->same[i], 0, PG_SIZE);
+    set_long_val(g->sim[l]->m, addr, val);
+    g->watch_hit |= g->sim[l]->m->watch_hit;
+}
+
+/* lanes_brk: whether some lane has a breakpoint at 'pc' */
+static bool_t lanes_brk(lanes_t *g, long_t pc)
+{
+    int l;
+    for (l = 0; l < g->n; l++)
+        if (brk_at(g->sim[l]->m, pc))
+            return TRUE;
+    return FALSE;
+}
+
+/* lanes_lockstep: run the lanes together while they agree */
+static stat_t lanes_lockstep(lanes_t *g, int max_steps, int *steps)
+{
+    long_t pc = g->sim[0]->pc;
+    long_t len = g->sim[0]->m->len;
+    vlong_t addr, val, valA, valB;
+    stat_t e = STAT_AOK;
+    int step = 0, l, id;
+
+    for (l = 1; l < g->n; l++)
+        if (g->sim[l]->pc != pc || g->sim[l]->m->len != len)
+            max_steps = 0;
+    for (l = 0; l < g->n; l++) {
+        for (id = REG_EAX; id < REG_CNT; id++)
+            g->r[id][l] = g->sim[l]->r[id];
+        g->cc[l] = get_cc(g->sim[l]);
+    }
+
+    while (step < max_steps && !g->watch_hit) {
+        dinst_t *d;
+        long_t next_pc;
+
+        /* run_lanes() checks the condition of the breakpoint in each lane */
+        if (g->brk && step > 0 && lanes_brk(g, pc))
+            break;
+        if (!(d = lanes_fetch(g, pc)))
+            break;
+        next_pc = d->next_pc;
+        switch (d->icode) {
+          case I_HALT:
+            e = STAT_HLT;
+            break;
+          case I_NOP:
+            break;
+          case I_RRMOVL:
+            if (d->ifun > C_G)
+                goto out;
+            val = COND_V(g->cc, d->ifun);
+            SET_REG_V(g, d->rB, (REG_V(g, d->rA) & val) | (REG_V(g, d->rB) & ~val));
+            break;
+          case I_IRMOVL:
+            SET_REG_V(g, d->rB, (vlong_t){ 0 } + d->valC);
+            break;
+          case I_RMMOVL:
+          case I_MRMOVL:
+            addr = REG_V(g, d->rB) + d->valC;
+            if (LANES_ANY(g, (addr > len) | (addr < 0)))
+                goto out;
+            if (d->icode == I_RMMOVL && !lanes_room(g, &addr))
+                goto out;
+            valA = REG_V(g, d->rA);
+            for (l = 0; l < g->n; l++) {
+                long_t v = valA[l];
+                if (d->icode == I_RMMOVL)
+                    lanes_store(g, l, addr[l], v);
+                else
+                    get_long_val(g->sim[l]->m, addr[l], &v);
+                valA[l] = v;
+            }
+            if (d->icode == I_MRMOVL)
+                SET_REG_V(g, d->rA, valA);
+            break;
+          case I_ALU:
+            if (d->ifun > A_XOR)
+                goto out;
+            valA = REG_V(g, d->rA);
+            valB = REG_V(g, d->rB);
+            val = ALU_V(d->ifun, valA, valB);
+            g->cc = CC_V(d->ifun, valA, valB, val);
+            SET_REG_V(g, d->rB, val);
+            break;
+          case I_JMP:
+            if (d->ifun > C_G)
+                goto out;
+            val = COND_V(g->cc, d->ifun);
+            if (!LANES_ANY(g, ~val))
+                next_pc = d->valC;
+            else if (LANES_ANY(g, val))
+                goto out;       /* the lanes part here */
+            break;
+          case I_CALL:
+            addr = g->r[REG_ESP] - 4;
+            if (d->valC > len || d->valC < 0
+                || LANES_ANY(g, (addr > len) | (addr < 0)) || !lanes_room(g, &addr))
+                goto out;
+            g->r[REG_ESP] = addr;
+            for (l = 0; l < g->n; l++)
+                lanes_store(g, l, addr[l], next_pc);
+            next_pc = d->valC;
+            break;
+          case I_RET:
+            addr = g->r[REG_ESP];
+            for (l = 0; l < g->n; l++) {
+                long_t v = 0;
+                get_long_val(g->sim[l]->m, addr[l], &v);
+                if (l && v != next_pc)
+                    goto out;   /* returning to different places */
+                next_pc = v;
+            }
+            g->r[REG_ESP] = addr + 4;
+            break;
+          case I_PUSHL:
+            valA = REG_V(g, d->rA);
+            addr = g->r[REG_ESP] - 4;
+            if (LANES_ANY(g, addr < 0) || !lanes_room(g, &addr))
+                goto out;
+            g->r[REG_ESP] = addr;
+            for (l = 0; l < g->n; l++)
+                lanes_store(g, l, addr[l], valA[l]);
+            break;
+          case I_POPL:
+            valA = REG_V(g, d->rA);
+            addr = g->r[REG_ESP];
+            for (l = 0; l < g->n; l++) {
+                long_t v = valA[l];
+                get_long_val(g->sim[l]->m, addr[l], &v);
+                valA[l] = v;
+            }
+            g->r[REG_ESP] = addr + 4;
+            SET_REG_V(g, d->rA, valA);
+            break;
+          default:
+            goto out;
+        }
+        step++;
+        if (e != STAT_AOK)
+            break;
+        pc = next_pc;
+    }
+
+out:
+    for (l = 0; l < g->n; l++) {
+        y86sim_t *sim = g->sim[l];
+        sim->pc = pc;
+        for (id = REG_EAX; id < REG_CNT; id++)
+            sim->r[id] = g->r[id][l];
+        sim->cc = g->cc[l];
+        sim->lazy_op = A_NONE;
+    }
+    *steps = step;
+    return e;
+}
+
+/*
+ * run_lanes: run 'n' (at most LANES) images in lockstep, then each alone;
+ * the results are in steps[] and e[]
+ */
+void run_lanes(y86sim_t **sims, int n, int *max_steps, int *steps, stat_t *e)
+{
+    lanes_t g;
+    stat_t ge;
+    int l, step, budget = max_steps[0];
+
+    for (l = 1; l < n; l++)
+        if (max_steps[l] < budget)
+            budget = max_steps[l];
+    g.n = n;
+    g.sim = sims;
+    g.same = (byte_t **)calloc(sims[0]->m->npages, sizeof(byte_t *));
+    if (!g.same)
+        budget = 0;     /* no lockstep, each runs alone */
+    g.brk = FALSE;
+    g.watch_hit = FALSE;
+    for (l = 0; l < n; l++) {
+        g.brk |= sims[l]->brk != NULL;
+        sims[l]->m->watch_hit = FALSE;
+        sims[l]->brk_hit = NULL;
+    }
+    ge = lanes_lockstep(&g, budget, &step);
+    for (l = 0; g.same && l < sims[0]->m->npages; l++)
+        free(g.same[l]);
+    free(g.same);
+
+    /* the lanes that stopped at a watch or breakpoint don't go on */
+    for (l = 0; l < n; l++) {
+        y86sim_t *sim = sims[l];
+        int k = 0;
+        e[l] = ge;
+        if (ge == STAT_AOK && step > 0 && !sim->m->watch_hit)
+            sim->brk_hit = brk_hit(sim, sim->pc);
+        if (ge == STAT_AOK && step < max_steps[l] && !sim->m->watch_hit
+            && !sim->brk_hit)
+            e[l] = run_thread(sim, max_steps[l] - step, &k);
+        steps[l] = step + k;
+    }
+}
+
+/* run_lanes1: a group of one, the engine interface of run_lanes() */
+stat_t run_lanes1(y86sim_t *sim, int max_steps, int *steps)
+{
+    stat_t e;
+    run_lanes(&sim, 1, &max_steps, steps, &e);
+    return e;
+}
+
+/* execution engines, selected with '-e' */
+engine_t engine_table[] = {
+    {"switch", run_switch},
+    {"thread", run_thread},
+    {"lanes", run_lanes1},
+#if defined(__x86_64__)
+    {"jit", run_jit},
+#endif
+    {NULL, NULL}
+};
+
+engine_t *find_engine(char *name)
+{
+    engine_t *eng;
+    for (eng = engine_table; eng->name != NULL; eng++)
+        if (!strcmp(eng->name, name))
+            return eng;
+    return NULL;
+}
+
+/* load_image: load the .bin file into the (empty) memory 'm' of 'sim' */
+int load_image(y86sim_t *sim, mem_t *m, char *fname)
+{
+    FILE *binfile;
+
+    binfile = fopen(fname, "rb");
+    if (!binfile) {
+        err_print(sim, "Can't open binary file '%s'", fname);
+        return -1;
+    }
+    if (load_binfile(sim, m, binfile) < 0) {
+        err_print(sim, "Failed to load binary file '%s'", fname);
+        fclose(binfile);
+        return -1;
+    }
+    fclose(binfile);
+    return 0;
+}
+
+/* load_y86sim: load the .bin file into the new image 'sim' */
+int load_y86sim(y86sim_t *sim, char *fname)
+{
+    return load_image(sim, sim->m, fname);
+}
+
+/* open_y86sim: a simulator of 'fname' reporting its errors to 'out' */
+y86sim_t *open_y86sim(char *fname, int mem_size, FILE *out)
+{
+    y86sim_t *sim = new_y86sim(mem_size);
+
+    if (!sim) {
+        err_to_file(out, "Out of memory");
+        return NULL;
+    }
+    set_err_fn(sim, err_to_file, out);
+    if (load_y86sim(sim, fname) < 0) {
+        free_y86sim(sim);
+        return NULL;
+    }
+    return sim;
+}
+
+/*
+ * reload_mem: the initial memory of 'sim' loaded from 'fname' once more;
+ * unlike dup_mem() it maps the image again instead of copying it
+ */
+mem_t *reload_mem(y86sim_t *sim, char *fname)
+{
+    mem_t *m = init_mem(sim->m->len);
+
+    if (!m) {
+        sim_error(sim, "Out of memory");
+        return NULL;
+    }
+    m->sim = sim;
+    if (load_image(sim, m, fname) < 0) {
+        free_mem(m);
+        return NULL;
+    }
+    return m;
+}
+
+/*
+ * Checkpoint file: the magic "Y86C" followed by little-endian 32-bit words:
+ * version, the length and checksum of the image file it was taken from,
+ * steps, PC, CC, the registers, the memory length and then every non-zero
+ * page as its index and PG_SIZE bytes, ended by the index -1.
+ */
+#define CKPT_MAGIC "Y86C"
+#define CKPT_VERSION 2
+
+/* the .bin file a checkpoint belongs to: its length and FNV-1a checksum */
+typedef struct ckpt_id {
+    long_t len;
+    long_t sum;
+} ckpt_id_t;
+
+static bool_t put_word(FILE *f, long_t val)
+{
+    byte_t b[4];
+    int i;
+    for (i = 0; i < 4; i++)
+        b[i] = (val >> (8*i)) & 0xFF;
+    return fwrite(b, 1, 4, f) == 4;
+}
+
+static bool_t get_word(FILE *f, long_t *val)
+{
+    byte_t b[4];
+    int i;
+    if (fread(b, 1, 4, f) != 4)
+        return FALSE;
+    *val = 0;
+    for (i = 0; i < 4; i++)
+        *val |= b[i] << (8*i);
+    return TRUE;
+}
+
+static bool_t zero_page(byte_t *data)
+{
+    int i;
+    for (i = 0; i < PG_SIZE; i++)
+        if (data[i])
+            return FALSE;
+    return TRUE;
+}
+
+/* image_id: identify the image file 'image', -1 if it can't be read */
+static int image_id(y86sim_t *sim, char *image, ckpt_id_t *id)
+{
+    FILE *f = fopen(image, "rb");
+    byte_t buf[PG_SIZE];
+    uint32_t sum = 2166136261u;
+    size_t n, i;
+    long len = 0;
+
+    if (!f) {
+        err_print(sim, "Can't open image '%s'", image);
+        return -1;
+    }
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        for (i = 0; i < n; i++)
+            sum = (sum ^ buf[i]) * 16777619u;
+        len += n;
+    }
+    if (ferror(f)) {
+        err_print(sim, "fread() failed on image '%s'", image);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    id->len = (long_t)len;
+    id->sum = (long_t)sum;
+    return 0;
+}
+
+/* write_checkpoint: save_checkpoint() with the image already identified */
+static int write_checkpoint(y86sim_t *sim, ckpt_id_t *id, int steps, char *fname)
+{
+    mem_t *m = sim->m;
+    bool_t ok = TRUE;
+    FILE *f;
+    int i;
+
+    f = fopen(fname, "wb");
+    if (!f) {
+        err_print(sim, "Can't open checkpoint file '%s'", fname);
+        return -1;
+    }
+    ok &= fwrite(CKPT_MAGIC, 1, 4, f) == 4;
+    ok &= put_word(f, CKPT_VERSION);
+    ok &= put_word(f, id->len);
+    ok &= put_word(f, id->sum);
+    ok &= put_word(f, steps);
+    ok &= put_word(f, sim->pc);
+    ok &= put_word(f, get_cc(sim));
+    for (i = 0; i < REG_CNT; i++)
+        ok &= put_word(f, sim->r[i]);
+    ok &= put_word(f, m->len);
+    for (i = 0; i < m->npages; i++) {
+        byte_t *data = m->page[i].data;
+        if (!data || zero_page(data))
+            continue;
+        ok &= put_word(f, i);
+        ok &= fwrite(data, 1, PG_SIZE, f) == PG_SIZE;
+    }
+    ok &= put_word(f, -1);
+    ok &= fclose(f) == 0;
+    if (!ok) {
+        err_print(sim, "Failed to write checkpoint file '%s'", fname);
+        return -1;
+    }
+    return 0;
+}
+
+/* save_checkpoint: write the state of 'sim', loaded from 'image', after 'steps' steps */
+int save_checkpoint(y86sim_t *sim, int steps, char *image, char *fname)
+{
+    ckpt_id_t id;
+
+    if (image_id(sim, image, &id) < 0)
+        return -1;
+    return write_checkpoint(sim, &id, steps, fname);
+}
+
+/*
+ * load_checkpoint: restore 'sim', loaded from 'image', and the steps it had
+ * run from 'fname'. The whole file is read and checked first, so on failure
+ * 'sim' is left as it was.
+ */
+int load_checkpoint(y86sim_t *sim, int *steps, char *image, char *fname)
+{
+    mem_t *m = sim->m;
+    char magic[4];
+    long_t val, len, sum, step, pc, cc, r[REG_CNT];
+    byte_t **pages = NULL;
+    ckpt_id_t id;
+    FILE *f;
+    int i, ret = -1;
+
+    if (image_id(sim, image, &id) < 0)
+        return -1;
+    f = fopen(fname, "rb");
+    if (!f) {
+        err_print(sim, "Can't open checkpoint file '%s'", fname);
+        return -1;
+    }
+    if (fread(magic, 1, 4, f) != 4 || memcmp(magic, CKPT_MAGIC, 4)
+        || !get_word(f, &val) || val != CKPT_VERSION)
+        goto bad;
+    if (!get_word(f, &len) || !get_word(f, &sum))
+        goto bad;
+    if (len != id.len || sum != id.sum) {
+        err_print(sim, "Checkpoint '%s' wasn't taken from '%s'", fname, image);
+        goto out;
+    }
+    if (!get_word(f, &step) || !get_word(f, &pc) || !get_word(f, &cc))
+        goto bad;
+    for (i = 0; i < REG_CNT; i++)
+        if (!get_word(f, &r[i]))
+            goto bad;
+    if (!get_word(f, &len) || (unsigned)cc > 7 || step < 0)
+        goto bad;
+    if (len != m->len) {
+        err_print(sim, "Checkpoint memory size 0x%x doesn't match 0x%x", len, m->len);
+        goto out;
+    }
+
+    /* the pages go to a scratch table until the end of the file is seen */
+    if (!(pages = (byte_t **)mem_calloc(m, m->npages, sizeof(byte_t *))))
+        goto out;
+    while (get_word(f, &val) && val != -1) {
+        if (val < 0 || val >= m->npages || pages[val])
+            goto bad;
+        if (!(pages[val] = (byte_t *)mem_calloc(m, PG_SIZE, 1)))
+            goto out;
+        if (fread(pages[val], 1, PG_SIZE, f) != PG_SIZE)
+            goto bad;
+    }
+    if (val != -1)
+        goto bad;
+
+    clear_mem(m);
+    for (i = 0; i < m->npages; i++)
+        m->page[i].data = pages[i];
+    free(pages);
+    pages = NULL;
+    memcpy(sim->r, r, sizeof(r));
+    sim->pc = pc;
+    sim->cc = cc;
+    sim->lazy_op = A_NONE;
+    *steps = step;
+    ret = 0;
+    goto out;
+
+bad:
+    err_print(sim, "Invalid checkpoint file '%s'", fname);
+out:
+    for (i = 0; pages && i < m->npages; i++)
+        free(pages[i]);
+    free(pages);
+    fclose(f);
+    return ret;
+}
+
+/*
+ * run_ckpt: run until 'max_steps' steps in total ('*steps' are done), and
+ * save 'fname' without ".bin" plus ".<steps>.ckpt" every 'every' steps;
+ * stops early (still STAT_AOK) at a breakpoint or watch, or if 'fname'
+ * can't be read or a checkpoint written
+ */
+stat_t run_ckpt(engine_t *eng, y86sim_t *sim, char *fname, int every,
+                int max_steps, int *steps)
+{
+    char ckpt[FILENAME_MAX];
+    stat_t e = STAT_AOK;
+    int start = *steps;
+    ckpt_id_t id;
+
+    if (image_id(sim, fname, &id) < 0)
+        return STAT_AOK;
+    while (e == STAT_AOK && *steps < max_steps) {
+        int next = (*steps / every + 1) * every;
+        int n = 0;
+
+        /* the engines don't stop at a breakpoint they start from */
+        if (*steps > start && (sim->brk_hit = brk_hit(sim, sim->pc)))
+            break;
+        if (next > max_steps)
+            next = max_steps;
+        e = eng->run(sim, next - *steps, &n);
+        *steps += n;
+        if (e == STAT_AOK && *steps % every == 0) {
+            snprintf(ckpt, sizeof(ckpt), "%.*s.%d.ckpt",
+                     (int)strlen(fname) - 4, fname, *steps);
+            if (write_checkpoint(sim, &id, *steps, ckpt) < 0)
+                break;
+        }
+        if (sim->brk_hit || sim->m->watch_hit)
+            break;
+    }
+    return e;
+}
+
+/*
+ * Reverse debugging (y86sim -d): undo_step() runs nexti() and logs what
+ * every step overwrites (PC, CC, registers, memory word) into a ring of
+ * UNDO_CAP records, so undo_back() undoes steps one by one. Every UNDO_SNAP
+ * steps it also keeps a full snapshot (the last UNDO_NSNAP ones and the
+ * initial state): going back beyond the log, or further than replaying
+ * from a snapshot would take, restores the snapshot and runs forward.
+ * undo_run() runs any engine between the snapshots without logging, so
+ * long runs in the debugger go at the engine's speed and only going back
+ * into them pays for the replay. Runs outside the debugger keep neither:
+ * nothing can go back in them, and one that may need a second look can
+ * save checkpoints (-c) to debug from (-r with -d).
+ */
+
+#define UNDO_CAP    (1<<18)
+#define UNDO_SNAP   (1<<16)
+#define UNDO_NSNAP  16
+
+typedef struct undo_rec {
+    long_t pc;
+    long_t reg_old[2];      /* old values of HIGH(regs), LOW(regs) */
+    long_t addr;
+    long_t mem_old;         /* old word at 'addr' if 'mem' */
+    byte_t regs;
+    cc_t cc;
+    byte_t mem;
+} undo_rec_t;
+
+typedef struct snap {
+    int step;
+    long_t pc;
+    long_t r[REG_CNT];
+    cc_t cc;
+    mem_t *m;
+} snap_t;
+
+struct undo {
+    undo_rec_t *log;        /* the record of step s is log[s % UNDO_CAP] */
+    int nlog;               /* records of the steps just before 'step' */
+    int step;               /* steps done */
+    snap_t snap[UNDO_NSNAP + 1];    /* by step, snap[0] is the initial state */
+    int nsnap;
+};
+
+/* take_snap: FALSE if out of memory */
+static bool_t take_snap(snap_t *s, y86sim_t *sim, int step)
+{
+    s->step = step;
+    s->pc = sim->pc;
+    memcpy(s->r, sim->r, sizeof(s->r));
+    s->cc = get_cc(sim);
+    s->m = dup_mem(sim->m);
+    return s->m != NULL;
+}
+
+static bool_t restore_snap(snap_t *s, y86sim_t *sim)
+{
+    sim->pc = s->pc;
+    memcpy(sim->r, s->r, sizeof(s->r));
+    sim->cc = s->cc;
+    sim->lazy_op = A_NONE;
+    return copy_mem(sim->m, s->m);
+}
+
+/* new_undo: an empty log of 'sim', which has run 'step' steps (NULL if out of memory) */
+undo_t *new_undo(y86sim_t *sim, int step)
+{
+    undo_t *u = (undo_t *)mem_calloc(sim->m, 1, sizeof(undo_t));
+    if (!u)
+        return NULL;
+    u->log = (undo_rec_t *)mem_calloc(sim->m, UNDO_CAP, sizeof(undo_rec_t));
+    if (!u->log || !take_snap(&u->snap[0], sim, step)) {
+        free(u->log);
+        free(u);
+        return NULL;
+    }
+    u->step = step;
+    u->nsnap = 1;
+    return u;
+}
+
+void free_undo(undo_t *u)
+{
+    int i;
+    for (i = 0; i < u->nsnap; i++)
+        free_mem(u->snap[i].m);
+    free(u->log);
+    free(u);
+}
+
+/* undo_snap: take the snapshot of the step 'sim' is at, if one is due */
+static void undo_snap(undo_t *u, y86sim_t *sim)
+{
+    if (u->step % UNDO_SNAP == 0 && u->step > u->snap[u->nsnap-1].step) {
+        if (u->nsnap == UNDO_NSNAP + 1) {
+            free_mem(u->snap[1].m);
+            memmove(&u->snap[1], &u->snap[2], (UNDO_NSNAP - 1) * sizeof(snap_t));
+            u->nsnap--;
+        }
+        /* out of memory, going back replays from an older one */
+        if (take_snap(&u->snap[u->nsnap], sim, u->step))
+            u->nsnap++;
+    }
+}
+
+/* undo_step: run one step, logging what it overwrites */
+stat_t undo_step(undo_t *u, y86sim_t *sim)
+{
+    undo_rec_t *rec = &u->log[u->step % UNDO_CAP];
+    dinst_t *d = cached_inst(sim->m, sim->pc);
+    regid_t w1 = REG_NONE, w2 = REG_NONE;
+    long_t addr = 0;
+    byte_t mem = 0;
+
+    undo_snap(u, sim);
+    if (d || decode_inst(sim->m, sim->pc, &d) == STAT_AOK)
+        inst_effects(sim, d, &w1, &w2, &addr, &mem);
+    rec->pc = sim->pc;
+    rec->cc = get_cc(sim);
+    rec->regs = HPACK(w1, w2);
+    rec->reg_old[0] = get_reg_val(sim->r, w1);
+    rec->reg_old[1] = get_reg_val(sim->r, w2);
+    rec->addr = addr;
+    rec->mem = mem == TRACE_STORE && get_long_val(sim->m, addr, &rec->mem_old);
+
+    u->step++;
+    if (u->nlog < UNDO_CAP)
+        u->nlog++;
+    return nexti(sim);
+}
+
+/*
+ * undo_run: run up to 'n' steps with 'eng', a slice between two snapshots
+ * at a time and logging nothing, so undo_back() into them replays from a
+ * snapshot; stops at breakpoints and watches like eng->run()
+ */
+stat_t undo_run(undo_t *u, y86sim_t *sim, engine_t *eng, int n)
+{
+    stat_t e = STAT_AOK;
+    int start = u->step, end = u->step + n;
+
+    clear_hits(sim);
+    while (e == STAT_AOK && u->step < end) {
+        int next = (u->step / UNDO_SNAP + 1) * UNDO_SNAP, k = 0;
+
+        /* the engines don't stop at a breakpoint they start from */
+        if (u->step > start && (sim->brk_hit = brk_hit(sim, sim->pc)))
+            break;
+        undo_snap(u, sim);
+        if (next > end)
+            next = end;
+        e = eng->run(sim, next - u->step, &k);
+        u->step += k;
+        if (k > 0)
+            u->nlog = 0;
+        if (sim->brk_hit || sim->m->watch_hit)
+            break;
+    }
+    return e;
+}
+
+/*
+ * undo_back: go back to the state before step 'target'; FALSE if out of
+ * memory restoring a snapshot, which leaves the state of 'sim' undefined
+ */
+bool_t undo_back(undo_t *u, y86sim_t *sim, int target)
+{
+    int i = u->nsnap - 1;
+
+    if (target < u->snap[0].step)
+        target = u->snap[0].step;
+    while (u->snap[i].step > target)
+        i--;
+
+    if (u->step - target <= u->nlog && u->step - target <= target - u->snap[i].step) {
+        /* undo the steps in reverse order */
+        for (; u->step > target; u->step--, u->nlog--) {
+            undo_rec_t *rec = &u->log[(u->step - 1) % UNDO_CAP];
+            if (rec->mem)
+                set_long_val(sim->m, rec->addr, rec->mem_old);
+            set_reg_val(sim->r, LOW(rec->regs), rec->reg_old[1]);
+            set_reg_val(sim->r, HIGH(rec->regs), rec->reg_old[0]);
+            sim->cc = rec->cc;
+            sim->lazy_op = A_NONE;
+            sim->pc = rec->pc;
+        }
+    } else {
+        /* restore the snapshot and replay the steps after it */
+        if (!restore_snap(&u->snap[i], sim))
+            return FALSE;
+        u->step = u->snap[i].step;
+        u->nlog = 0;
+        while (u->step < target)
+            undo_step(u, sim);
+    }
+
+    /* the snapshots ahead are taken again when running forward */
+    while (u->nsnap > 1 && u->snap[u->nsnap-1].step > target)
+        free_mem(u->snap[--u->nsnap].m);
+    return TRUE;
+}
+
+/*
+ * replay_find_write: replay the steps [s->step, end) from the snapshot 's'
+ * on a scratch simulator, the last of them that wrote the byte 'addr'
+ * (-1 if none)
+ */
+static int replay_find_write(snap_t *s, y86sim_t *sim, int end, long_t addr)
+{
+    y86sim_t *t = new_y86sim(s->m->len);
+    stat_t e = STAT_AOK;
+    int step, found = -1;
+
+    if (!t || !copy_mem(t->m, s->m)) {
+        sim_error(sim, "Out of memory");
+        if (t)
+            free_y86sim(t);
+        return -1;
+    }
+    t->pc = s->pc;
+    memcpy(t->r, s->r, sizeof(t->r));
+    t->cc = s->cc;
+    for (step = s->step; step < end && e == STAT_AOK; step++) {
+        dinst_t *d = cached_inst(t->m, t->pc);
+        regid_t w1 = REG_NONE, w2 = REG_NONE;
+        long_t a = 0;
+        byte_t mem = 0;
+
+        if (d || decode_inst(t->m, t->pc, &d) == STAT_AOK)
+            inst_effects(t, d, &w1, &w2, &a, &mem);
+        if (mem == TRACE_STORE && addr >= a && addr - a < 4)
+            found = step;
+        e = nexti(t);
+    }
+    free_y86sim(t);
+    return found;
+}
+
+/*
+ * undo_find_write: the last step that wrote the byte 'addr', -1 if none
+ * since the undo log began. The log is searched first, then the steps
+ * before it are replayed from the snapshots, the latest first.
+ */
+int undo_find_write(undo_t *u, y86sim_t *sim, long_t addr)
+{
+    int i, end = u->step - u->nlog, found;
+
+    for (i = 1; i <= u->nlog; i++) {
+        undo_rec_t *rec = &u->log[(u->step - i) % UNDO_CAP];
+        if (rec->mem && addr >= rec->addr && addr - rec->addr < 4)
+            return u->step - i;
+    }
+    for (i = u->nsnap - 1; i >= 0; i--) {
+        if (u->snap[i].step >= end)
+            continue;
+        if ((found = replay_find_write(&u->snap[i], sim, end, addr)) >= 0)
+            return found;
+        end = u->snap[i].step;
+    }
+    return -1;
+}
+
+/* undo_steps: the steps done, as undo_step() and undo_back() leave them */
+int undo_steps(undo_t *u)
+{
+    return u->step;
+}
+
+/* undo_first: the earliest step undo_back() can go back to */
+int undo_first(undo_t *u)
+{
+    return u->snap[0].step;
+}
+
+/* report: print the final state and the changes since 'saver'/'savem' */
+void report(FILE *out, y86sim_t *sim, long_t *saver, mem_t *savem,
+            stat_t e, int step)
+{
+    fprintf(out, "Stopped in %d steps at PC = 0x%x.  Status '%s', CC %s\n",
+            step, sim->pc, stat_name(e), cc_name(get_cc(sim)));
+
+    fprintf(out, "Changes to registers:\n");
+    diff_reg(saver, sim->r, out);
+
+    fprintf(out, "\nChanges to memory:\n");
+    diff_mem(savem, sim->m, out);
+}
+
+/*
+ * Batch runs (y86sim -l): simulate many images on a pool of threads, one
+ * y86sim_t per image. The report() of file.bin goes to file.sim; if the
+ * job has an 'expect' file, file.sim is compared with it in-process.
+ */
+/* a job while it runs */
+typedef struct job_run {
+    y86sim_t *sim;      /* NULL if the image couldn't be loaded */
+    long_t *saver;
+    mem_t *savem;
+    FILE *out;
+    char *buf;
+    size_t len;
+} job_run_t;
+
+typedef struct batch {
+    job_t *jobs;
+    int njobs;
+    int next;           /* the next job to take */
+    pthread_mutex_t lock;
+    engine_t *eng;
+    int mem_size;
+} batch_t;
+
+/* read_file: the whole content of 'fname' in a malloc'd buffer */
+static char *read_file(char *fname, size_t *len)
+{
+    FILE *f = fopen(fname, "rb");
+    char *buf;
+    long size;
+
+    if (!f)
+        return NULL;
+    if (fseek(f, 0, SEEK_END) < 0 || (size = ftell(f)) < 0
+        || fseek(f, 0, SEEK_SET) < 0) {
+        fclose(f);
+        return NULL;
+    }
+    buf = (char *)malloc(size + 1);
+    if (!buf) {
+        fclose(f);
+        return NULL;
+    }
+    *len = fread(buf, 1, size, f);
+    fclose(f);
+    return buf;
+}
+
+/* first_diff: the first line (from 1) where a and b differ, 0 if none */
+static int first_diff(char *a, size_t alen, char *b, size_t blen)
+{
+    size_t i;
+    int line = 1;
+
+    for (i = 0; i < alen && i < blen; i++) {
+        if (a[i] != b[i])
+            return line;
+        if (a[i] == '\n')
+            line++;
+    }
+    return alen == blen ? 0 : line;
+}
+
+/* job_start: load the image of 'job', FALSE if it can't run */
+static bool_t job_start(batch_t *b, job_t *job, job_run_t *run)
+{
+    run->buf = NULL;
+    run->len = 0;
+    run->sim = NULL;
+    run->out = open_memstream(&run->buf, &run->len);
+    if (!run->out) {
+        job->res = JOB_ERR;
+        return FALSE;
+    }
+    run->sim = open_y86sim(job->bin, b->mem_size, run->out);
+    run->savem = run->sim ? reload_mem(run->sim, job->bin) : NULL;
+    if (run->sim && !run->savem) {
+        free_y86sim(run->sim);
+        run->sim = NULL;
+    }
+    if (run->sim)
+        run->saver = dup_reg(run->sim->r);
+    return run->sim != NULL;
+}
+
+/* job_finish: report the run of 'job' and check it */
+static void job_finish(job_t *job, job_run_t *run, stat_t e, int step)
+{
+    char sim_name[FILENAME_MAX];
+    char *expect;
+    size_t elen = 0;
+    FILE *f;
+
+    if (!run->out)
+        return;
+    if (run->sim) {
+        report(run->out, run->sim, run->saver, run->savem, e, step);
+        free_reg(run->saver);
+        free_mem(run->savem);
+        free_y86sim(run->sim);
+    }
+    fclose(run->out);
+
+    snprintf(sim_name, sizeof(sim_name), "%.*s.sim",
+             (int)strlen(job->bin) - 4, job->bin);
+    f = fopen(sim_name, "wb");
+    if (!f || fwrite(run->buf, 1, run->len, f) != run->len || fclose(f) != 0
+        || !run->sim) {
+        job->res = JOB_ERR;
+    } else if (!job->expect) {
+        job->res = JOB_DONE;
+    } else if (!(expect = read_file(job->expect, &elen))) {
+        job->res = JOB_ERR;
+    } else {
+        job->diff_line = first_diff(expect, elen, run->buf, run->len);
+        job->res = job->diff_line ? JOB_FAIL : JOB_PASS;
+        free(expect);
+    }
+    free(run->buf);
+}
+
+static void run_job(batch_t *b, job_t *job)
+{
+    job_run_t run;
+    int step = 0;
+    stat_t e = STAT_AOK;
+
+    if (job_start(b, job, &run))
+        e = b->eng->run(run.sim, job->max_steps, &step);
+    job_finish(job, &run, e, step);
+}
+
+/* run_group: run jobs [first, first+n) in lockstep lanes */
+static void run_group(batch_t *b, int first, int n)
+{
+    job_run_t runs[LANES];
+    y86sim_t *sims[LANES];
+    int max_steps[LANES], steps[LANES], idx[LANES];
+    stat_t e[LANES];
+    int i, cnt, k = 0;
+
+    for (i = first; i < first + n; i++) {
+        job_t *job = &b->jobs[i];
+        if (!job_start(b, job, &runs[i - first]))
+            continue;
+        sims[k] = runs[i - first].sim;
+        max_steps[k] = job->max_steps;
+        idx[k++] = i;
+    }
+    if (k > 0)
+        run_lanes(sims, k, max_steps, steps, e);
+    for (i = first, cnt = k, k = 0; i < first + n; i++) {
+        job_t *job = &b->jobs[i];
+        if (k < cnt && idx[k] == i) {
+            job_finish(job, &runs[i - first], e[k], steps[k]);
+            k++;
+        } else {
+            job_finish(job, &runs[i - first], STAT_AOK, 0);
+        }
+    }
+}
+
+static void *batch_worker(void *arg)
+{
+    batch_t *b = (batch_t *)arg;
+    int n = b->eng->run == run_lanes1 ? LANES : 1;    /* jobs at a time */
+    int i;
+
+    for (;;) {
+        pthread_mutex_lock(&b->lock);
+        i = b->next;
+        b->next += n;
+        pthread_mutex_unlock(&b->lock);
+        if (i >= b->njobs)
+            break;
+        if (n > 1)
+            run_group(b, i, i + n < b->njobs ? n : b->njobs - i);
+        else
+            run_job(b, &b->jobs[i]);
+    }
+    return NULL;
+}
+
+/* run_batch: run 'jobs' on 'nthreads' threads (0: one per core), set 'res' */
+void run_batch(job_t *jobs, int njobs, engine_t *eng, int mem_size,
+               int nthreads)
+{
+    int group = eng->run == run_lanes1 ? LANES : 1;
+    pthread_t *tids;
+    batch_t b;
+    int i;
+
+    memset(&b, 0, sizeof(b));
+    b.jobs = jobs;
+    b.njobs = njobs;
+    b.eng = eng;
+    b.mem_size = mem_size;
+    pthread_mutex_init(&b.lock, NULL);
+
+    if (nthreads <= 0)
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > (njobs + group - 1) / group)
+        nthreads = (njobs + group - 1) / group;
+    if (nthreads < 1)
+        nthreads = 1;
+    tids = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+    for (i = 0; tids && i < nthreads; i++)
+        if (pthread_create(&tids[i], NULL, batch_worker, &b) != 0)
+            break;
+    if (i == 0)
+        batch_worker(&b);   /* no thread at all: run them here */
+    while (i-- > 0)
+        pthread_join(tids[i], NULL);
+
+    free(tids);
+    pthread_mutex_destroy(&b.lock);
+}
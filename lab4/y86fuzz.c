@@ -0,0 +1,323 @@
+/* The fuzzer of y86sim (-f), see y86fuzz.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+/* it looks at decoded instructions, so it needs the insides of liby86sim */
+#include "y86sim_int.h"
+#include "y86fuzz.h"
+
+#define err_print(_s, _a ...) \
+    fprintf(stdout, _s"\n", _a);
+
+static double wall_secs(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+/*
+ * Fuzzing (-f): run random Y86 programs with nexti() and keep the ones
+ * that reach new coverage in a corpus directory. The coverage map counts
+ * opcodes, (icode, status) pairs and the outcomes of jXX/cmovXX under
+ * every CC. Runs share one y86sim_t; between them only the words the
+ * previous program stored and the program itself are rewritten.
+ */
+
+#define FUZZ_LEN    256     /* bytes of a program, loaded at address 0 */
+#define FUZZ_STEPS  256     /* steps of a run */
+#define FUZZ_CORPUS 4096    /* programs kept in memory for mutation */
+
+/* coverage map: opcode byte, (icode, status), (jXX or cmovXX, cond, CC) */
+#define COV_OP      0
+#define COV_STAT    (COV_OP + 256)
+#define COV_BR      (COV_STAT + 16*4)
+#define COV_SIZE    (COV_BR + 2*8*8)
+
+typedef struct fuzz {
+    y86sim_t *sim;
+    uint64_t seed;
+    byte_t cov[COV_SIZE];
+    int ncov;
+    byte_t (*corpus)[FUZZ_LEN];
+    int ncorpus;
+    long_t dirty[FUZZ_STEPS];   /* addresses stored to by the last run */
+    int ndirty;
+    char *dir;
+    int nsaved;             /* next file name to try */
+    int nkept;              /* files written */
+    long long runs;
+    long long steps;
+} fuzz_t;
+
+/* fuzz_rand: xorshift64*, a number in [0, n) */
+static int fuzz_rand(fuzz_t *f, int n)
+{
+    f->seed ^= f->seed >> 12;
+    f->seed ^= f->seed << 25;
+    f->seed ^= f->seed >> 27;
+    return (int)((f->seed * 0x2545F4914F6CDD1DULL >> 32) % (unsigned)n);
+}
+
+/* fuzz_valc: an immediate, biased towards addresses that make sense */
+static long_t fuzz_valc(fuzz_t *f, int plen)
+{
+    int len = f->sim->m->len;
+
+    switch (fuzz_rand(f, 5)) {
+      case 0:
+        return fuzz_rand(f, plen);                  /* into the program */
+      case 1:
+        return fuzz_rand(f, len) & ~3;              /* data or stack */
+      case 2:
+        return len - fuzz_rand(f, 8);               /* the end of memory */
+      case 3:
+        return fuzz_rand(f, 64) - 32;               /* small offsets */
+      default:
+        return (long_t)(fuzz_rand(f, 1<<16) << 16 | fuzz_rand(f, 1<<16));
+    }
+}
+
+/* fuzz_inst: write a random instruction (1 in 8 broken), its length */
+static int fuzz_inst(fuzz_t *f, byte_t *buf, int room, int plen)
+{
+    byte_t ins[MAX_INSBYTES];
+    int icode = fuzz_rand(f, I_POPL + 1), ifun = 0, n = 0;
+    int rA = fuzz_rand(f, REG_CNT), rB = fuzz_rand(f, REG_CNT);
+    long_t valC = fuzz_valc(f, plen);
+
+    if (icode == I_RRMOVL || icode == I_JMP)
+        ifun = fuzz_rand(f, C_G + 1);
+    else if (icode == I_ALU)
+        ifun = fuzz_rand(f, A_XOR + 1);
+    if (icode == I_IRMOVL)
+        rA = REG_NONE;
+    if (icode == I_PUSHL || icode == I_POPL)
+        rB = REG_NONE;
+    if (!fuzz_rand(f, 8)) {
+        switch (fuzz_rand(f, 3)) {
+          case 0:
+            icode = fuzz_rand(f, 16);
+            break;
+          case 1:
+            ifun = fuzz_rand(f, 16);
+            break;
+          default:
+            rA = fuzz_rand(f, 16);
+            break;
+        }
+    }
+
+    /* the same layout decode_inst() expects */
+    ins[n++] = HPACK(icode, ifun);
+    if ((icode >= I_RRMOVL && icode <= I_ALU) || icode >= I_PUSHL)
+        ins[n++] = HPACK(rA, rB);
+    if (icode >= I_IRMOVL && icode <= I_CALL && icode != I_ALU) {
+        ins[n++] = valC & 0xFF;
+        ins[n++] = valC >> 8 & 0xFF;
+        ins[n++] = valC >> 16 & 0xFF;
+        ins[n++] = valC >> 24 & 0xFF;
+    }
+    if (n > room)
+        n = room;
+    memcpy(buf, ins, n);
+    return n;
+}
+
+/* fuzz_gen: a new program, or a mutation of one in the corpus */
+static void fuzz_gen(fuzz_t *f, byte_t *buf)
+{
+    int plen, pos, k;
+
+    if (!f->ncorpus || fuzz_rand(f, 4) == 0) {
+        plen = 1 + fuzz_rand(f, FUZZ_LEN);
+        memset(buf, 0, FUZZ_LEN);
+        for (pos = 0; pos < plen; )
+            pos += fuzz_inst(f, buf + pos, FUZZ_LEN - pos, plen);
+        return;
+    }
+
+    memcpy(buf, f->corpus[fuzz_rand(f, f->ncorpus)], FUZZ_LEN);
+    for (k = 1 + fuzz_rand(f, 4); k > 0; k--) {
+        pos = fuzz_rand(f, FUZZ_LEN);
+        switch (fuzz_rand(f, 4)) {
+          case 0:
+            buf[pos] ^= 1 << fuzz_rand(f, 8);
+            break;
+          case 1:
+            buf[pos] = fuzz_rand(f, 256);
+            break;
+          case 2:
+            fuzz_inst(f, buf + pos, FUZZ_LEN - pos, FUZZ_LEN);
+            break;
+          default:  /* splice the tail of another one */
+            memcpy(buf + pos, f->corpus[fuzz_rand(f, f->ncorpus)] + pos,
+                   FUZZ_LEN - pos);
+            break;
+        }
+    }
+}
+
+static inline int fuzz_cover(fuzz_t *f, int idx)
+{
+    if (f->cov[idx])
+        return 0;
+    f->cov[idx] = 1;
+    f->ncov++;
+    return 1;
+}
+
+/* fuzz_run: run 'buf' from the reset state, TRUE if it reached new coverage */
+static bool_t fuzz_run(fuzz_t *f, byte_t *buf)
+{
+    y86sim_t *sim = f->sim;
+    mem_t *m = sim->m;
+    stat_t e = STAT_AOK;
+    int i, step, fresh = 0;
+
+    /* undo the stores of the last run and load this program */
+    for (i = 0; i < f->ndirty; i++)
+        set_long_val(m, f->dirty[i], 0);
+    f->ndirty = 0;
+    for (i = 0; i < FUZZ_LEN; i += 4)
+        set_long_val(m, i, buf[i] | buf[i+1] << 8 | buf[i+2] << 16 | buf[i+3] << 24);
+    sim->pc = 0;
+    memset(sim->r, 0, sizeof(sim->r));
+    sim->cc = DEFAULT_CC;
+    sim->lazy_op = A_NONE;
+
+    for (step = 0; step < FUZZ_STEPS && e == STAT_AOK; step++) {
+        dinst_t *d = cached_inst(m, sim->pc);
+        int icode = I_HALT;     /* (halt, ADR) stands for a failed fetch */
+
+        if (d || decode_inst(m, sim->pc, &d) == STAT_AOK) {
+            icode = d->icode;
+            fresh += fuzz_cover(f, COV_OP + HPACK(d->icode, d->ifun));
+            if ((icode == I_JMP || icode == I_RRMOVL) && d->ifun <= C_G)
+                fresh += fuzz_cover(f, COV_BR + (icode == I_JMP) * 64
+                                    + d->ifun * 8 + get_cc(sim));
+            if (icode == I_RMMOVL || icode == I_CALL || icode == I_PUSHL) {
+                regid_t w1 = REG_NONE, w2 = REG_NONE;
+                byte_t mem = 0;
+                inst_effects(sim, d, &w1, &w2, &f->dirty[f->ndirty++], &mem);
+            }
+        }
+        e = nexti(sim);
+        fresh += fuzz_cover(f, COV_STAT + icode * 4 + e);
+    }
+    f->runs++;
+    f->steps += step;
+    return fresh > 0;
+}
+
+/* fuzz_keep: add 'buf' to the corpus and save it, trailing halts dropped */
+static void fuzz_keep(fuzz_t *f, byte_t *buf, bool_t save)
+{
+    char path[FILENAME_MAX];
+    FILE *out;
+    int len = FUZZ_LEN;
+
+    if (f->ncorpus < FUZZ_CORPUS)
+        memcpy(f->corpus[f->ncorpus++], buf, FUZZ_LEN);
+    if (!save)
+        return;
+    while (len > 1 && !buf[len-1])
+        len--;
+    do {
+        snprintf(path, sizeof(path), "%s/cov-%06d.bin", f->dir, f->nsaved++);
+    } while (access(path, F_OK) == 0);
+    out = fopen(path, "wb");
+    if (!out) {
+        err_print("Can't write '%s'", path);
+        return;
+    }
+    fwrite(buf, 1, len, out);
+    fclose(out);
+    f->nkept++;
+}
+
+/* fuzz_seed: run the .bin files already in the corpus directory */
+static void fuzz_seed(fuzz_t *f)
+{
+    char path[FILENAME_MAX];
+    struct dirent *ent;
+    DIR *dir = opendir(f->dir);
+
+    if (!dir)
+        return;
+    while ((ent = readdir(dir)) != NULL) {
+        size_t n = strlen(ent->d_name);
+        byte_t buf[FUZZ_LEN];
+        FILE *in;
+
+        if (n < 4 || strcmp(ent->d_name + n - 4, ".bin"))
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", f->dir, ent->d_name);
+        in = fopen(path, "rb");
+        if (!in)
+            continue;
+        memset(buf, 0, FUZZ_LEN);
+        fread(buf, 1, FUZZ_LEN, in);
+        fclose(in);
+        fuzz_run(f, buf);
+        fuzz_keep(f, buf, FALSE);
+    }
+    closedir(dir);
+}
+
+/* fuzz: run 'runs' random programs, keeping new coverage in 'dir' */
+int fuzz(char *dir, int mem_size, long long runs, unsigned seed)
+{
+    byte_t buf[FUZZ_LEN];
+    fuzz_t f;
+    double t;
+    int i, cov, ncov[3] = { 0, 0, 0 };
+
+    if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
+        err_print("Can't create corpus directory '%s'", dir);
+        return -1;
+    }
+    if (mem_size < FUZZ_LEN)
+        mem_size = FUZZ_LEN;
+    memset(&f, 0, sizeof(f));
+    f.sim = new_y86sim(mem_size);
+    f.corpus = malloc(FUZZ_CORPUS * sizeof(*f.corpus));
+    if (!f.sim || !f.corpus) {
+        printf("Out of memory\n");
+        if (f.sim)
+            free_y86sim(f.sim);
+        free(f.corpus);
+        return -1;
+    }
+    f.seed = (uint64_t)seed << 1 | 1;
+    f.dir = dir;
+    /* the errors of nexti() are expected here: f.sim has no sink */
+
+    t = wall_secs();
+    fuzz_seed(&f);
+    cov = f.ncov;
+    while (f.runs < runs) {
+        fuzz_gen(&f, buf);
+        if (fuzz_run(&f, buf))
+            fuzz_keep(&f, buf, TRUE);
+    }
+    t = wall_secs() - t;
+
+    for (i = 0; i < COV_SIZE; i++)
+        ncov[(i >= COV_STAT) + (i >= COV_BR)] += f.cov[i];
+    printf("%lld runs, %lld steps in %.3f s (%.0f runs/s)\n",
+           f.runs, f.steps, t, t > 0 ? f.runs / t : 0.0);
+    printf("Coverage: %d opcodes, %d (icode, status), %d/%d branch outcomes"
+           " (%d from seeds)\n", ncov[0], ncov[1], ncov[2], COV_SIZE - COV_BR, cov);
+    printf("Corpus: %d programs, %d new in '%s'\n", f.ncorpus, f.nkept, dir);
+    free(f.corpus);
+    free_y86sim(f.sim);
+    return 0;
+}
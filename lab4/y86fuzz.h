@@ -0,0 +1,13 @@
+#ifndef _Y86_FUZZ_
+#define _Y86_FUZZ_
+
+/*
+ * Fuzzing (y86sim -f): random Y86 programs run with nexti(), the ones
+ * reaching new coverage kept in a corpus directory. In a file of its own
+ * because it looks at decoded instructions, which y86sim.h doesn't show.
+ */
+
+/* fuzz: run 'runs' random programs, keeping new coverage in 'dir' */
+int fuzz(char *dir, int mem_size, long long runs, unsigned seed);
+
+#endif
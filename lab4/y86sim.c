@@ -1,573 +1,735 @@
-/* Instruction set simulator for Y86 Architecture */
+/* Instruction set simulator for Y86 Architecture, the command line of liby86sim */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/time.h>
 
 #include "y86sim.h"
-
+#include "y86fuzz.h"
+#ifdef COSIM
+/* co-simulation copies pages and looks at decoded instructions */
+#include "y86sim_int.h"
+#include "y86yis.h"
+#endif
+
+/* errors of the command line itself, the simulators have their own sinks */
 #define err_print(_s, _a ...) \
     fprintf(stdout, _s"\n", _a);
 
-
-typedef enum {STAT_AOK, STAT_HLT, STAT_ADR, STAT_INS} stat_t;
-
-char *stat_names[] = { "AOK", "HLT", "ADR", "INS" };
-
-char *stat_name(stat_t e)
+static void dbg_help(void)
 {
-    if (e < STAT_AOK || e > STAT_INS)
-        return "Invalid Status";
-    return stat_names[e];
+    printf("step [n]          run n (1) steps\n");
+    printf("run               run until the program stops, with the -e engine\n");
+    printf("back [n]          go back n (1) steps\n");
+    printf("back-write addr   go back to the last write to the byte at addr\n");
+    printf("regs              print PC, CC and registers\n");
+    printf("mem addr [n]      print n (1) words at addr\n");
+    printf("break pc [reg v]  stop before the instruction at pc (if reg is v)\n");
+    printf("watch addr [n]    stop after a write to the n (4) bytes at addr\n");
+    printf("delete            delete every breakpoint and watch\n");
+    printf("quit              stop debugging\n");
 }
 
-char *cc_names[8] = {
-    "Z=0 S=0 O=0",
-    "Z=0 S=0 O=1",
-    "Z=0 S=1 O=0",
-    "Z=0 S=1 O=1",
-    "Z=1 S=0 O=0",
-    "Z=1 S=0 O=1",
-    "Z=1 S=1 O=0",
-    "Z=1 S=1 O=1" };
-
-char *cc_name(cc_t c)
+static void dbg_where(y86sim_t *sim, int step, stat_t e)
 {
-    int ci = c;
-    if (ci < 0 || ci > 7)
-        return "???????????";
-    else
-        return cc_names[c];
+    printf("Step %d, PC = 0x%x.  Status '%s'\n", step, sim->pc, stat_name(e));
 }
 
-bool_t get_byte_val(mem_t *m, long_t addr, byte_t *dest)
+/*
+ * debugger: run the commands read from stdin on 'sim', stepping forward
+ * no further than 'max_steps' steps in total ('*steps' are done); 'run'
+ * goes with the engine 'eng', 'step' one logged instruction at a time
+ */
+static stat_t debugger(y86sim_t *sim, engine_t *eng, int max_steps, int *steps)
 {
-    if (addr < 0 || addr >= m->len)
-        return FALSE;
-    *dest = m->data[addr];
-    return TRUE;
-}
+    undo_t *u = new_undo(sim, *steps);
+    char line[256], cmd[32];
+    stat_t e = STAT_AOK;
+    bool_t tty = isatty(0);
 
-bool_t get_long_val(mem_t *m, long_t addr, long_t *dest)
-{
-    int i;
-    long_t val;
-    if (addr < 0 || addr + 4 > m->len)
-	    return FALSE;
-    val = 0;
-    for (i = 0; i < 4; i++)
-	    val = val | m->data[addr+i]<<(8*i);
-    *dest = val;
-    return TRUE;
-}
+    if (!u)
+        return STAT_ADR;
 
-bool_t set_byte_val(mem_t *m, long_t addr, byte_t val)
-{
-    if (addr < 0 || addr >= m->len)
-	    return FALSE;
-    m->data[addr] = val;
-    return TRUE;
-}
+    for (;;) {
+        long_t arg = 1, arg2 = 1;
+        char reg[16];
+        int nargs, i;
 
-bool_t set_long_val(mem_t *m, long_t addr, long_t val)
-{
-    int i;
-    if (addr < 0 || addr + 4 > m->len)
-	    return FALSE;
-    for (i = 0; i < 4; i++) {
-    	m->data[addr+i] = val & 0xFF;
-    	val >>= 8;
+        if (tty) {
+            printf("(y86) ");
+            fflush(stdout);
+        }
+        if (!fgets(line, sizeof(line), stdin))
+            break;
+        nargs = sscanf(line, "%31s %i %i", cmd, &arg, &arg2);
+        if (nargs < 1)
+            continue;
+
+        if (!strcmp(cmd, "run")) {
+            clear_hits(sim);
+            if (e == STAT_AOK)
+                e = undo_run(u, sim, eng, max_steps - undo_steps(u));
+            print_stop(stdout, sim);
+            dbg_where(sim, undo_steps(u), e);
+        } else if (!strcmp(cmd, "step") || !strcmp(cmd, "s")) {
+            clear_hits(sim);
+            for (i = 0; i < arg && undo_steps(u) < max_steps && e == STAT_AOK;
+                 i++) {
+                if (i > 0 && (sim->brk_hit = brk_hit(sim, sim->pc)))
+                    break;
+                e = undo_step(u, sim);
+                if (watch_hit(sim, NULL))
+                    break;
+            }
+            print_stop(stdout, sim);
+            dbg_where(sim, undo_steps(u), e);
+        } else if (!strcmp(cmd, "back") || !strcmp(cmd, "b")) {
+            e = undo_back(u, sim, undo_steps(u) - (arg > 0 ? arg : 0))
+                ? STAT_AOK : STAT_ADR;
+            dbg_where(sim, undo_steps(u), e);
+        } else if (!strcmp(cmd, "back-write") && nargs > 1) {
+            int s = undo_find_write(u, sim, arg);
+            if (s < 0) {
+                printf("No write to 0x%x since step %d\n", arg, undo_first(u));
+                continue;
+            }
+            e = undo_back(u, sim, s) ? STAT_AOK : STAT_ADR;
+            dbg_where(sim, undo_steps(u), e);
+        } else if (!strcmp(cmd, "regs")) {
+            int id;
+            printf("PC = 0x%x, CC %s\n", sim->pc, cc_name(get_cc(sim)));
+            for (id = REG_EAX; id < REG_CNT; id++)
+                printf("%s:\t0x%.8x\n", reg_table[id].name, sim->r[id]);
+        } else if (!strcmp(cmd, "mem") && nargs > 1) {
+            for (; arg2 > 0; arg2--, arg += 4) {
+                long_t val;
+                if (get_long_val(sim->m, arg, &val))
+                    printf("0x%.4x:\t0x%.8x\n", arg, val);
+                else
+                    printf("0x%.4x:\tout of memory\n", arg);
+            }
+        } else if (!strcmp(cmd, "break") && nargs > 1) {
+            regid_t id = REG_NONE;
+            if (sscanf(line, "%*s %*i %15s %i", reg, &arg2) == 2
+                && (id = find_reg(reg)) == REG_ERR) {
+                printf("Invalid register '%s'\n", reg);
+                continue;
+            }
+            if (!set_brk(sim, arg, id, arg2))
+                printf("Invalid address 0x%x\n", arg);
+        } else if (!strcmp(cmd, "watch") && nargs > 1) {
+            if (!watch_mem(sim->m, arg, nargs > 2 ? arg2 : 4))
+                printf("Invalid address 0x%x\n", arg);
+        } else if (!strcmp(cmd, "delete")) {
+            clear_brk(sim);
+        } else if (!strcmp(cmd, "quit") || !strcmp(cmd, "q")) {
+            break;
+        } else {
+            dbg_help();
+        }
     }
-    return TRUE;
-}
 
-mem_t *init_mem(int len)
-{
-    mem_t *m = (mem_t *)malloc(sizeof(mem_t));
-    len = ((len+BLK_SIZE-1)/BLK_SIZE)*BLK_SIZE;
-    m->len = len;
-    m->data = (byte_t *)calloc(len, 1);
-
-    return m;
+    *steps = undo_steps(u);
+    free_undo(u);
+    return e;
 }
 
-void free_mem(mem_t *m)
+#ifdef COSIM
+/*
+ * Lockstep co-simulation (-x, only in y86sim-cosim): run nexti() and the
+ * step_state() of lab6 on the same image and after every instruction
+ * compare the PC, status, CC, registers and the memory word the
+ * instruction stored (the only memory an instruction dirties). Stop at
+ * the first divergence and report it; the pages the run touched are
+ * compared once more at the end.
+ */
+
+static void cosim_row(char *name, long_t a, long_t b)
 {
-    free((void *) m->data);
-    free((void *) m);
+    printf("%-10s0x%.8x    0x%.8x\n", name, a, b);
 }
 
-mem_t *dup_mem(mem_t *oldm)
+static bool_t cosim_mem(y86sim_t *sim, yis_t *y, long_t addr, bool_t print)
 {
-    mem_t *newm = init_mem(oldm->len);
-    memcpy(newm->data, oldm->data, oldm->len);
-    return newm;
+    long_t a = 0, b = 0;
+    char name[16];
+
+    get_long_val(sim->m, addr, &a);
+    yis_get_word(y, addr, &b);
+    if (a == b)
+        return FALSE;
+    if (print) {
+        snprintf(name, sizeof(name), "0x%.4x", addr);
+        cosim_row(name, a, b);
+    }
+    return TRUE;
 }
 
-bool_t diff_mem(mem_t *oldm, mem_t *newm, FILE *outfile)
+/* cosim_diff: compare the two states, printing the differences if 'print' */
+static bool_t cosim_diff(y86sim_t *sim, stat_t e, yis_t *y, int ye,
+                         long_t addr, bool_t store, bool_t print)
 {
-    long_t pos;
-    int len = oldm->len;
     bool_t diff = FALSE;
-    
-    if (newm->len < len)
-	    len = newm->len;
-    
-    for (pos = 0; (!diff || outfile) && pos < len; pos += 4) {
-        long_t ov = 0;  long_t nv = 0;
-        get_long_val(oldm, pos, &ov);
-        get_long_val(newm, pos, &nv);
-        if (nv != ov) {
+    int id;
+
+    if (sim->pc != yis_pc(y)) {
+        diff = TRUE;
+        if (print)
+            cosim_row("PC", sim->pc, yis_pc(y));
+    }
+    if ((int)e != ye) {
+        diff = TRUE;
+        if (print)
+            printf("%-10s%-14s%s\n", "Status", stat_name(e), stat_name(ye));
+    }
+    if (get_cc(sim) != yis_cc(y)) {
+        diff = TRUE;
+        if (print)
+            printf("%-10s%-14s%s\n", "CC", cc_name(get_cc(sim)), cc_name(yis_cc(y)));
+    }
+    for (id = REG_EAX; id < REG_CNT; id++)
+        if (sim->r[id] != yis_reg(y, id)) {
             diff = TRUE;
-            if (outfile)
-                fprintf(outfile, "0x%.4x:\t0x%.8x\t0x%.8x\n", pos, ov, nv);
+            if (print)
+                cosim_row(reg_table[id].name, sim->r[id], yis_reg(y, id));
         }
-    }
+    if (store && cosim_mem(sim, y, addr, print))
+        diff = TRUE;
     return diff;
 }
 
+/* run_lockstep: run_switch() checked against lab6, '*diverged' if they differ */
+static stat_t run_lockstep(y86sim_t *sim, int max_steps, int *steps,
+                           bool_t *diverged)
+{
+    yis_t *y = yis_new(sim->m->len);
+    mem_t *m = sim->m;
+    int step, i, k;
+    stat_t e = STAT_AOK;
 
-reg_t reg_table[REG_CNT] = {
-    {"%eax", REG_EAX},
-    {"%ecx", REG_ECX},
-    {"%edx", REG_EDX},
-    {"%ebx", REG_EBX},
-    {"%esp", REG_ESP},
-    {"%ebp", REG_EBP},
-    {"%esi", REG_ESI},
-    {"%edi", REG_EDI},
-};
+    /* start lab6 from the same state */
+    yis_set_cpu(y, sim->pc, sim->r, get_cc(sim));
+    for (i = 0; i < m->npages; i++)
+        if (m->page[i].data)
+            for (k = 0; k < PG_SIZE && (i << PG_BITS) + k < m->len; k++)
+                yis_set_byte(y, (i << PG_BITS) + k, m->page[i].data[k]);
+
+    *diverged = FALSE;
+    for (step = 0; step < max_steps && e == STAT_AOK; step++) {
+        long_t pc = sim->pc, addr = 0;
+        dinst_t *d = cached_inst(m, pc);
+        regid_t w1 = REG_NONE, w2 = REG_NONE;
+        byte_t mem = 0;
+        int ye;
+
+        if (d || decode_inst(m, pc, &d) == STAT_AOK)
+            inst_effects(sim, d, &w1, &w2, &addr, &mem);
+        e = nexti(sim);
+        ye = yis_step(y);
+
+        if (cosim_diff(sim, e, y, ye, addr, mem == TRACE_STORE, FALSE)) {
+            byte_t b;
+            printf("Lockstep divergence at step %d, PC = 0x%x:", step + 1, pc);
+            for (k = 0; k < (d ? d->next_pc - pc : 1); k++)
+                if (get_byte_val(m, pc + k, &b))
+                    printf(" %.2x", b);
+            printf("\n%-10s%-14s%s\n", "", "y86sim", "yis");
+            cosim_diff(sim, e, y, ye, addr, mem == TRACE_STORE, TRUE);
+            *diverged = TRUE;
+            step++;
+            break;
+        }
+    }
 
-long_t get_reg_val(mem_t *r, regid_t id)
-{
-    long_t val = 0;
-    if (id >= REG_NONE)
-        return 0;
-    get_long_val(r, id*4, &val);
-    return val;
+    /* the pages y86sim touched, in case a store was missed */
+    for (i = 0; !*diverged && i < m->npages; i++)
+        for (k = 0; m->page[i].data && k < PG_SIZE && (i << PG_BITS) + k < m->len; k += 4)
+            if (cosim_mem(sim, y, (i << PG_BITS) + k, FALSE)) {
+                printf("Lockstep divergence in memory after %d steps\n", step);
+                printf("%-10s%-14s%s\n", "", "y86sim", "yis");
+                cosim_mem(sim, y, (i << PG_BITS) + k, TRUE);
+                *diverged = TRUE;
+                break;
+            }
+
+    yis_free(y);
+    *steps = step;
+    return e;
 }
+#endif /* COSIM */
 
-void set_reg_val(mem_t *r, regid_t id, long_t val)
+static double wall_secs(void)
 {
-    if (id < REG_NONE)
-        set_long_val(r, id*4, val);
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
 }
 
-mem_t *init_reg()
+/* bench: run the image with every engine and report MIPS */
+static int bench(char *fname, int mem_size, int max_steps)
 {
-    return init_mem(REG_SIZE);
+    engine_t *eng;
+
+    for (eng = engine_table; eng->name != NULL; eng++) {
+        y86sim_t *sim = open_y86sim(fname, mem_size, stdout);
+        int step = 0;
+        stat_t e;
+        double t;
+
+        if (!sim)
+            return -1;
+        t = wall_secs();
+        e = eng->run(sim, max_steps, &step);
+        t = wall_secs() - t;
+        printf("Engine %-8s %10d steps in %8.3f s, %8.2f MIPS.  Status '%s'\n",
+               eng->name, step, t, t > 0 ? step / t / 1e6 : 0.0, stat_name(e));
+        free_y86sim(sim);
+    }
+    return 0;
 }
 
-void free_reg(mem_t *r)
+/* parse_size: a byte count with an optional k/m suffix, -1 if invalid */
+static int parse_size(char *str)
 {
-    free_mem(r);
+    char *end;
+    long size = strtol(str, &end, 0);
+
+    if (*end == 'k' || *end == 'K')
+        size <<= 10, end++;
+    else if (*end == 'm' || *end == 'M')
+        size <<= 20, end++;
+    if (end == str || *end || size <= 0 || size > MAX_MEM_SIZE)
+        return -1;
+    return (int)size;
 }
 
-mem_t *dup_reg(mem_t *oldr)
+/* parse_stop: set the breakpoint 'pc[,reg=val]' (-B) or watch 'addr[,len]' (-W) */
+static bool_t parse_stop(y86sim_t *sim, int opt, char *str)
 {
-    return dup_mem(oldr);
-}
+    char *end, *eq, name[16];
+    long_t addr = (long_t)strtoul(str, &end, 0);
+    long_t val = 4;
+    regid_t id = REG_NONE;
 
-bool_t diff_reg(mem_t *oldr, mem_t *newr, FILE *outfile)
-{
-    long_t pos;
-    int len = oldr->len;
-    bool_t diff = FALSE;
-    
-    if (newr->len < len)
-	    len = newr->len;
-    
-    for (pos = 0; (!diff || outfile) && pos < len; pos += 4) {
-        long_t ov = 0;
-        long_t nv = 0;
-        get_long_val(oldr, pos, &ov);
-        get_long_val(newr, pos, &nv);
-        if (nv != ov) {
-            diff = TRUE;
-            if (outfile)
-                fprintf(outfile, "%s:\t0x%.8x\t0x%.8x\n",
-                        reg_table[pos/4].name, ov, nv);
-        }
+    if (end == str || (*end && *end != ','))
+        return FALSE;
+    if (*end && opt == 'W') {
+        str = end + 1;
+        val = (long_t)strtoul(str, &end, 0);
+        if (end == str || *end)
+            return FALSE;
+    } else if (*end) {
+        eq = strchr(end, '=');
+        if (!eq || eq - end - 1 >= (int)sizeof(name))
+            return FALSE;
+        memcpy(name, end + 1, eq - end - 1);
+        name[eq - end - 1] = '\0';
+        if ((id = find_reg(name)) == REG_ERR)
+            return FALSE;
+        val = (long_t)strtoul(eq + 1, &end, 0);
+        if (end == eq + 1 || *end)
+            return FALSE;
     }
-    return diff;
+    return opt == 'W' ? watch_mem(sim->m, addr, val) : set_brk(sim, addr, id, val);
 }
 
-/* create an y86 image with registers and memory */
-y86sim_t *new_y86sim(int slen)
+/*
+ * Batch mode (-l): the images of a list file, one per line as
+ *     file.bin [max_steps] [expected]
+ * run by run_batch() on a pool of threads
+ */
+/* read_list: parse the list file into '*jobs' */
+static int read_list(char *lname, job_t **jobs, int *njobs)
 {
-    y86sim_t *sim = (y86sim_t*)malloc(sizeof(y86sim_t));
-    sim->pc = 0;
-    sim->r = init_reg();
-    sim->m = init_mem(slen);
-    sim->cc = DEFAULT_CC;
-    return sim;
-}
+    FILE *f = strcmp(lname, "-") ? fopen(lname, "r") : stdin;
+    char line[3*FILENAME_MAX];
+    int cap = 0, lineno = 0;
 
-void free_y86sim(y86sim_t *sim)
-{
-    free_reg(sim->r);
-    free_mem(sim->m);
-    free((void *) sim);
+    if (!f) {
+        err_print("Can't open list file '%s'", lname);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char *tok = strtok(line, " \t\r\n"), *end;
+        job_t *job;
+
+        lineno++;
+        if (!tok || tok[0] == '#')
+            continue;
+        if (strlen(tok) < 4 || strcmp(tok + strlen(tok) - 4, ".bin")) {
+            err_print("%s:%d: not a .bin file '%s'", lname, lineno, tok);
+            continue;
+        }
+        if (*njobs == cap) {
+            cap = cap ? 2*cap : 64;
+            *jobs = (job_t *)realloc(*jobs, cap * sizeof(job_t));
+        }
+        job = &(*jobs)[(*njobs)++];
+        memset(job, 0, sizeof(job_t));
+        job->bin = strdup(tok);
+        job->max_steps = MAX_STEP;
+        while ((tok = strtok(NULL, " \t\r\n"))) {
+            long steps = strtol(tok, &end, 0);
+            if (!*end)
+                job->max_steps = (int)steps;
+            else
+                job->expect = strdup(tok);
+        }
+    }
+    if (f != stdin)
+        fclose(f);
+    return 0;
 }
 
-/* load binary code and data from file to memory image */
-int load_binfile(mem_t *m, FILE *f)
+/* batch: run the images of 'lname' on 'nthreads' threads (0: one per core) */
+static int batch(char *lname, engine_t *eng, int mem_size, int nthreads)
 {
-    int flen;
+    static const char *res_names[] = { "DONE", "PASS", "FAIL", "ERROR" };
+    job_t *jobs = NULL;
+    int i, njobs = 0, cnt[4] = { 0, 0, 0, 0 };
 
-    clearerr(f);
-    flen = fread(m->data, sizeof(byte_t), m->len, f);
-    if (ferror(f)) {
-        err_print("fread() failed (0x%x)", flen);
-        return -1;
-    }
-    if (!feof(f)) {
-        err_print("too large memory footprint (0x%x)", flen);
+    if (read_list(lname, &jobs, &njobs) < 0)
         return -1;
+    run_batch(jobs, njobs, eng, mem_size, nthreads);
+
+    for (i = 0; i < njobs; i++) {
+        job_t *job = &jobs[i];
+        cnt[job->res]++;
+        if (job->res == JOB_FAIL)
+            printf("%-40s %s (line %d)\n", job->bin, res_names[job->res],
+                   job->diff_line);
+        else
+            printf("%-40s %s\n", job->bin, res_names[job->res]);
+        free(job->bin);
+        free(job->expect);
     }
-    return 0;
+    printf("%d images: %d passed, %d failed, %d errors\n",
+           njobs, cnt[JOB_PASS], cnt[JOB_FAIL], cnt[JOB_ERR]);
+
+    free(jobs);
+    return cnt[JOB_FAIL] + cnt[JOB_ERR] ? 1 : 0;
 }
 
-/*
- * compute_alu: do ALU operations 
- * args
- *     op: operations (A_ADD, A_SUB, A_AND, A_XOR)
- *     argA: the first argument 
- *     argB: the second argument
- *
- * return
- *     val: the result of operation on argA and argB
- */
-long_t compute_alu(alu_t op, long_t argA, long_t argB)
+static void usage(char *pname)
 {
-    long_t val = 0;
-    switch(op){
-        case A_ADD:
-            val = argB + argA;
-            break;
-        case A_SUB:
-            val = argB - argA;
-            break;
-        case A_AND:
-            val = argB & argA;
-            break;
-        case A_XOR:
-            val = argB ^ argA;
-            break;
-        default:
-            break;
-    } 
-    return val;
+    engine_t *eng;
+
+    /* one mode at a time, see set_mode() */
+    printf("Usage: %s [-h] [-e engine] [-m size] [-r ckpt] [-c steps]\n"
+           "       [-B pc[,reg=val]] [-W addr[,len]] file.bin [max_steps]\n"
+           "       %s [-e engine] [-m size] [-r ckpt] [-B pc[,reg=val]]\n"
+           "       [-W addr[,len]] -d file.bin [max_steps]\n"
+           "       %s [-m size] [-r ckpt] -p prof | -T | -t trace [-w]\n"
+           "       file.bin [max_steps]\n"
+           "       %s [-m size] -b file.bin [max_steps]\n"
+           "       %s [-e engine] [-m size] [-j threads] -l list\n"
+           "       %s [-m size] -f corpus [runs [seed]]\n",
+           pname, pname, pname, pname, pname, pname);
+    printf("   -b         run every engine on file.bin and report MIPS\n");
+    /* only the engines built in, e.g. no jit in the -m32 build */
+    printf("   -e engine  execution engine:");
+    for (eng = engine_table; eng->name != NULL; eng++)
+        printf(" %s%s", eng->name, eng == engine_table ? " (default)," :
+               eng[1].name != NULL ? "," : ";\n");
+    printf("              lanes runs %d images of batch mode in lockstep\n", LANES);
+    printf("   -m size    address space size, e.g. 64k, 16m (default 8k, max 1024m)\n");
+    printf("   -c steps   save file.<steps>.ckpt every 'steps' steps\n");
+    printf("   -r ckpt    resume from the checkpoint 'ckpt' of file.bin\n");
+    printf("   -p prof    profile with nexti(), write the flat profile and call graph\n"
+           "              to 'prof' and the collapsed stacks to 'prof.folded'\n");
+    printf("   -T         estimate the cycles and CPI of the PIPE processor\n");
+    printf("   -t trace   write a binary execution trace (see y86trace)\n");
+    printf("   -w         write the trace from a background thread\n");
+    printf("   -d         debug with commands from stdin (step, back, back-write, ...)\n");
+    printf("   -B pc      stop before the instruction at pc (if reg holds val),\n"
+           "              may be repeated\n");
+    printf("   -W addr    stop after a write to the len (4) bytes at addr,\n"
+           "              may be repeated\n");
+#ifdef COSIM
+    printf("   -x         run in lockstep with lab6's step_state(), stop at the\n"
+           "              first divergence\n");
+#endif
+    printf("   -l list    batch mode: run every 'file.bin [max_steps] [expected]'\n"
+           "              line of 'list' (- for stdin) and write file.sim\n");
+    printf("   -j threads worker threads of batch mode (default: one per core)\n");
+    printf("   -f corpus  fuzz 'runs' random programs (default 1000000), keeping\n"
+           "              those reaching new coverage as corpus/cov-N.bin\n");
+    exit(0);
 }
 
 /*
- * compute_cc: modify condition codes according to operations 
- * args
- *     op: operations (A_ADD, A_SUB, A_AND, A_XOR)
- *     argA: the first argument 
- *     argB: the second argument
- *     val: the result of operation on argA and argB
- *
- * return
- *     PACK_CC: the final condition codes
+ * set_mode: make the option 'c' the mode of this run: -b, -c, -d, -p, -T,
+ * -t, -x, -l or -f, of which a run can only have one ('*mode' is 0 for a
+ * plain run)
  */
-cc_t compute_cc(alu_t op, long_t argA, long_t argB, long_t val)
+static void set_mode(int *mode, int c, char *pname)
 {
-    bool_t zero = FALSE;
-    bool_t sign = FALSE;
-    bool_t ovf = FALSE;
-
-    zero = (val == 0);
-    sign = (val < 0);
-    ovf = (((argA < 0) == (argB < 0))&&((val < 0) != (argB < 0)));
-    if(ovf == TRUE && op == A_SUB){
-        ovf = FALSE;
+    if (*mode && *mode != c) {
+        printf("Options -%c and -%c can't be used together\n", *mode, c);
+        usage(pname);
     }
-    return PACK_CC(zero,sign,ovf);
+    *mode = c;
 }
 
-/*
- * cond_doit: whether do (mov or jmp) it?  
- * args
- *     PACK_CC: the current condition codes
- *     cond: conditions (C_YES, C_LE, C_L, C_E, C_NE, C_GE, C_G)
- *
- * return
- *     TRUE: do it
- *     FALSE: not do it
- */
-bool_t cond_doit(cc_t cc, cond_t cond) 
+/* need_mode: reject the option 'opt' unless 'mode' is in 'modes' ('-': plain run) */
+static void need_mode(int opt, int mode, char *modes, char *pname)
+{
+    if (strchr(modes, mode ? mode : '-'))
+        return;
+    if (mode)
+        printf("Option -%c has no effect with -%c\n", opt, mode);
+    else
+        printf("Option -%c has no effect without -%c\n", opt, modes[0]);
+    usage(pname);
+}
+
+int main(int argc, char *argv[])
 {
-    bool_t doit = FALSE;
-    bool_t zero = (cc>>2)&0x1;
-    bool_t sign = (cc>>1)&0x1;
-    bool_t ovf = cc&0x1;
-
-    switch(cond){
-        case C_YES:
-            doit = TRUE; 
+    int max_steps = MAX_STEP;
+    int mem_size = MEM_SIZE;
+    y86sim_t *sim;
+    long_t *saver;
+    mem_t *savem;
+    engine_t *eng = &engine_table[0];
+    bool_t do_bench = FALSE;
+    int ckpt_every = 0;
+    char *resume = NULL;
+    char *list = NULL;
+    char *corpus = NULL;
+    char *prof_file = NULL;
+    timing_t *timing = NULL;
+    prof_t *prof = NULL;
+    char *trace_file = NULL;
+    bool_t trace_async = FALSE;
+    tracer_t *tracer = NULL;
+    bool_t debug = FALSE;
+    char **stops = (char **)calloc(argc, sizeof(char *));
+    char *stop_opt = (char *)calloc(argc, 1);
+    int nstops = 0, i;
+    bool_t diverged = FALSE;
+#ifdef COSIM
+    bool_t lockstep = FALSE;
+#endif
+    int nthreads = 0;
+    bool_t eng_set = FALSE, threads_set = FALSE;
+    int mode = 0;
+    char *fname;
+    int step = 0;
+    stat_t e = STAT_AOK;
+    int c;
+
+    while ((c = getopt(argc, argv, "+hbe:m:c:r:l:j:p:Tt:wdB:W:xf:")) != -1) {
+        if (c != 'h' && c != '?' && strchr("bcdpTtxlf", c))
+            set_mode(&mode, c, argv[0]);
+        switch (c) {
+          case 'b':
+            do_bench = TRUE;
             break;
-        case C_LE:
-            doit = (sign^ovf) | zero;
+          case 'e':
+            eng = find_engine(optarg);
+            if (!eng) {
+                printf("Invalid engine '%s'\n", optarg);
+                usage(argv[0]);
+            }
+            eng_set = TRUE;
             break;
-        case C_L:
-            doit = sign^ovf;
+          case 'm':
+            mem_size = parse_size(optarg);
+            if (mem_size < 0) {
+                printf("Invalid memory size '%s'\n", optarg);
+                usage(argv[0]);
+            }
             break;
-        case C_E:
-            doit = zero;
+          case 'c':
+            ckpt_every = atoi(optarg);
+            if (ckpt_every <= 0) {
+                printf("Invalid checkpoint interval '%s'\n", optarg);
+                usage(argv[0]);
+            }
             break;
-        case C_NE:
-            doit = !zero;
+          case 'r':
+            resume = optarg;
             break;
-        case C_GE:
-            doit = !(sign^ovf);
+          case 'p':
+            prof_file = optarg;
             break;
-        case C_G:
-            doit = (!(sign^ovf))&(!zero);
+          case 'T':
+            timing = (timing_t *)calloc(1, sizeof(timing_t));
             break;
-        default:
+          case 't':
+            trace_file = optarg;
             break;
-    }
-    return doit;
-}
-
-/* 
- * nexti: execute single instruction and return status.
- * args
- *     sim: the y86 image with PC, register and memory
- *
- * return
- *     STAT_AOK: continue
- *     STAT_HLT: halt
- *     STAT_ADR: invalid instruction address, data address, stack address, ...
- *     STAT_INS: invalid instruction, register id, ...
- */
-stat_t nexti(y86sim_t *sim)
-{
-    byte_t codefun = 0;
-    itype_t icode;
-    alu_t ifun;
-    long_t next_pc = sim->pc;
-
-    /* get code and function (1 byte) */
-    if (!get_byte_val(sim->m, next_pc, &codefun)) {
-        err_print("PC = 0x%x, Invalid instruction address", sim->pc);
-        return STAT_ADR;
-    }
-    icode = GET_ICODE(codefun);
-    ifun = GET_FUN(codefun);
-    next_pc++;
-
-    /* get registers if needed (1 byte) */
-    byte_t regSpecifier;
-    regid_t regA;
-    regid_t regB;
-    long_t valA;
-    long_t valB;
-    if((0x2<=icode&&icode<=0x6)||(0xA<=icode)){    
-        if(!get_byte_val(sim->m,next_pc,&regSpecifier)){
-            err_print("PC = 0x%x, Invalid instruction address", sim->pc);
-            return STAT_ADR;
-        }
-        regA = GET_REGA(regSpecifier);
-        regB = GET_REGB(regSpecifier);
-        valA = get_reg_val(sim->r,regA);
-        valB = get_reg_val(sim->r,regB);
-        next_pc++;
-    }
-    
-    /* get immediate if needed (4 bytes) */
-    long_t imm;
-    if((0x3<=icode&&icode<=0x8)&&icode != 0x6){
-        if(!get_long_val(sim->m,next_pc,&imm)){ 
-            err_print("PC = 0x%x, Invalid instruction address", sim->pc);
-            return STAT_ADR;
+          case 'w':
+            trace_async = TRUE;
+            break;
+          case 'd':
+            debug = TRUE;
+            break;
+          case 'B':
+          case 'W':
+            stop_opt[nstops] = c;
+            stops[nstops++] = optarg;
+            break;
+#ifdef COSIM
+          case 'x':
+            lockstep = TRUE;
+            break;
+#endif
+          case 'l':
+            list = optarg;
+            break;
+          case 'f':
+            corpus = optarg;
+            break;
+          case 'j':
+            nthreads = atoi(optarg);
+            threads_set = TRUE;
+            break;
+          case 'h':
+          default:
+            usage(argv[0]);
         }
-        next_pc += 4;
     }
 
-    /* execute the instruction */
-    switch (icode) {
-      case I_HALT: /* 0:0 */
-        return STAT_HLT;
-        break;
-      case I_NOP: /* 1:0 */
-        sim->pc = next_pc;
-        break;
-      case I_RRMOVL:{  /* 2:x regA:regB */
-        if(ifun>0x6){
-            err_print("PC = 0x%x, Invalid instruction address", sim->pc);
-            return STAT_INS;
-        }
-        if(cond_doit(sim->cc,ifun) == TRUE){
-            set_reg_val(sim->r,regB,valA);
-        }
-        sim->pc = next_pc;
-        break;
-        }
-      case I_IRMOVL: /* 3:0 F:regB imm */
-        set_reg_val(sim->r,regB,imm);
-        sim->pc = next_pc;
-        break;
-      case I_RMMOVL: {/* 4:0 regA:regB imm */
-        long_t addr = valB + imm;
-        if(addr>MEM_SIZE||addr<0){
-            err_print("PC = 0x%x, Invalid data address 0x%.2x", sim->pc, addr);
-            return STAT_ADR;
-        }
-        set_long_val(sim->m,addr,valA);
-        sim->pc = next_pc;
-        break;
-        }
-      case I_MRMOVL: {/* 5:0 regB:regA imm */
-        long_t addr = valB + imm;
-        if(addr>MEM_SIZE||addr<0){
-            err_print("PC = 0x%x, Invalid data address 0x%.2x", sim->pc, addr);
-            return STAT_ADR;
-        }
-        get_long_val(sim->m,addr,&valA);
-        set_reg_val(sim->r,regA,valA);
-        sim->pc = next_pc;
-        break;
-        }
-      case I_ALU: /* 6:x regA:regB */
-        if(ifun>0x3){
-            err_print("PC = 0x%x, Invalid instruction address", sim->pc);
-            return STAT_INS;
-        }
-        long_t val = compute_alu(ifun,valA,valB);
-        cc_t cc = compute_cc(ifun,valA,valB,val);
-        sim->cc = cc;
-        set_reg_val(sim->r,regB,val);
-        sim->pc = next_pc;
-        break;
-      case I_JMP: /* 7:x imm */
-        if(ifun>0x6){
-            err_print("PC = 0x%x, Invalid instruction address", sim->pc);
-            return STAT_INS;
-        }
-        if(cond_doit(sim->cc,ifun) == TRUE){
-            sim->pc = imm;
-        }else{
-            sim->pc = next_pc;
-        }
-        break;
-      case I_CALL: {/* 8:x imm */
-        long_t nextAddr = imm; 
-        long_t valS = get_reg_val(sim->r,REG_ESP) - 4;
-        set_reg_val(sim->r,REG_ESP,valS);
-        if(nextAddr>MEM_SIZE||nextAddr < 0){
-            err_print("PC = 0x%x, Invalid stack address 0x%.2x", sim->pc, nextAddr);
-            return STAT_ADR;
-        }
-        if(valS>MEM_SIZE||valS < 0){
-            err_print("PC = 0x%x, Invalid stack address 0x%.2x", sim->pc, valS);
-            return STAT_ADR;
-        }
-        long_t returnAddr = next_pc;
-        set_long_val(sim->m,valS,returnAddr);
-        sim->pc = imm;
-        break;
-        }
-      case I_RET: {/* 9:0 */
-        long_t valS = get_reg_val(sim->r,REG_ESP);
-        long_t retAddr;
-        get_long_val(sim->m,valS,&retAddr);
-        valS += 4;
-        set_reg_val(sim->r,REG_ESP,valS);
-        sim->pc = retAddr;
-        break;
-        }
-      case I_PUSHL:{ /* A:0 regA:F */
-        long_t valS = get_reg_val(sim->r,REG_ESP);
-        valS -= 4;
-        set_reg_val(sim->r,REG_ESP,valS);
-        if(valS < 0x0){
-            err_print("PC = 0x%x, Invalid stack address 0x%.2x", sim->pc, valS);
-            return STAT_ADR;
-        }
-        set_long_val(sim->m,valS,valA);
-        sim->pc = next_pc;
-        break;
-        }
-      case I_POPL:{ /* B:0 regA:F */
-        long_t valS = get_reg_val(sim->r,REG_ESP);
-        get_long_val(sim->m,valS,&valA);
-        valS += 4;
-        set_reg_val(sim->r,REG_ESP,valS);
-        set_reg_val(sim->r,regA,valA);
-        sim->pc = next_pc;
-        break;
-        }
-      default:
-        err_print("PC = 0x%x, Invalid instruction %.2x", sim->pc, codefun);
-        return STAT_INS;
+    /* the options the mode would ignore */
+    if (eng_set)
+        need_mode('e', mode, "-cdl", argv[0]);
+    if (nstops)
+        need_mode(stop_opt[0], mode, "-cd", argv[0]);
+    if (resume)
+        need_mode('r', mode, "-cdpTtx", argv[0]);
+    if (trace_async)
+        need_mode('w', mode, "t", argv[0]);
+    if (threads_set)
+        need_mode('j', mode, "l", argv[0]);
+
+    if (list) {
+        if (optind != argc)
+            usage(argv[0]);
+        return batch(list, eng, mem_size, nthreads) != 0;
     }
-    
-    return STAT_AOK;
-}
-
-void usage(char *pname)
-{
-    printf("Usage: %s file.bin [max_steps]\n", pname);
-    exit(0);
-}
 
-int main(int argc, char *argv[])
-{
-    FILE *binfile;
-    int max_steps = MAX_STEP;
-    y86sim_t *sim;
-    mem_t *saver, *savem;
-    int step = 0;
-    stat_t e = STAT_AOK;
+    if (corpus) {
+        if (optind < argc - 2)
+            usage(argv[0]);
+        return fuzz(corpus, mem_size,
+                    optind < argc ? atoll(argv[optind]) : 1000000,
+                    optind < argc - 1 ? atoi(argv[optind+1]) : 1) < 0;
+    }
 
-    if (argc < 2 || argc > 3)
+    if (optind >= argc || optind < argc - 2)
         usage(argv[0]);
+    fname = argv[optind];
 
     /* set max steps */
-    if (argc > 2)
-        max_steps = atoi(argv[2]);
+    if (optind < argc - 1)
+        max_steps = atoi(argv[optind+1]);
 
     /* load binary file to memory */
-    if (strcmp(argv[1]+(strlen(argv[1])-4), ".bin"))
+    if (strlen(fname) < 4 || strcmp(fname+(strlen(fname)-4), ".bin"))
         usage(argv[0]); /* only support *.bin file */
-    
-    binfile = fopen(argv[1], "rb");
-    if (!binfile) {
-        err_print("Can't open binary file '%s'", argv[1]);
-        exit(1);
-    }
 
-    sim = new_y86sim(MEM_SIZE);
-    if (load_binfile(sim->m, binfile) < 0) {
-        err_print("Failed to load binary file '%s'", argv[1]);
-        free_y86sim(sim);
+    if (do_bench)
+        return bench(fname, mem_size, max_steps) < 0;
+
+    sim = open_y86sim(fname, mem_size, stdout);
+    if (!sim)
         exit(1);
-    }
-    fclose(binfile);
 
     /* save initial register and memory stat */
     saver = dup_reg(sim->r);
-    savem = dup_mem(sim->m);
+    savem = reload_mem(sim, fname);
+    if (!savem)
+        exit(1);
 
-    /* execute binary code step-by-step */
-    for (step = 0; step < max_steps && e == STAT_AOK; step++)
-        e = nexti(sim);
+    /* continue from a checkpoint taken in an earlier run */
+    if (resume) {
+        int ok = load_checkpoint(sim, &step, fname, resume) == 0;
 
-    /* print final stat of y86sim */
-    printf("Stopped in %d steps at PC = 0x%x.  Status '%s', CC %s\n",
-            step, sim->pc, stat_name(e), cc_name(sim->cc));
+        if (ok && step > max_steps) {
+            printf("Checkpoint '%s' is at step %d, past max_steps %d\n",
+                   resume, step, max_steps);
+            ok = 0;
+        }
+        if (!ok) {
+            free_y86sim(sim);
+            free_reg(saver);
+            free_mem(savem);
+            exit(1);
+        }
+    }
 
-    printf("Changes to registers:\n");
-    diff_reg(saver, sim->r, stdout);
+    for (i = 0; i < nstops; i++) {
+        if (!parse_stop(sim, stop_opt[i], stops[i])) {
+            printf("Invalid -%c '%s'\n", stop_opt[i], stops[i]);
+            usage(argv[0]);
+        }
+    }
 
-    printf("\nChanges to memory:\n");
-    diff_mem(savem, sim->m, stdout);
+    /* execute binary code */
+    if (debug) {
+        e = debugger(sim, eng, max_steps, &step);
+#ifdef COSIM
+    } else if (lockstep) {
+        int n = 0;
+        if (step < max_steps)
+            e = run_lockstep(sim, max_steps - step, &n, &diverged);
+        step += n;
+#endif
+    } else if (trace_file) {
+        int n = 0;
+        tracer = new_tracer(sim, trace_file, trace_async);
+        if (!tracer)
+            exit(1);
+        if (step < max_steps)
+            e = run_trace(sim, tracer, max_steps - step, &n);
+        step += n;
+    } else if (timing) {
+        int n = 0;
+        if (step < max_steps)
+            e = run_timing(sim, timing, max_steps - step, &n);
+        step += n;
+    } else if (prof_file) {
+        int n = 0;
+        prof = new_prof(sim->m, sim->pc);
+        if (!prof)
+            exit(1);
+        if (step < max_steps)
+            e = run_prof(sim, prof, max_steps - step, &n);
+        step += n;
+    } else {
+        if (ckpt_every)
+            e = run_ckpt(eng, sim, fname, ckpt_every, max_steps, &step);
+        else if (step < max_steps) {
+            int n = 0;
+            e = eng->run(sim, max_steps - step, &n);
+            step += n;
+        }
+        if (nstops)
+            print_stop(stdout, sim);
+    }
+
+    /* print final stat of y86sim */
+    report(stdout, sim, saver, savem, e, step);
+
+    if (timing) {
+        print_timing(stdout, timing);
+        free(timing);
+    }
+    if (prof) {
+        write_prof(prof, sim, prof_file);
+        free_prof(prof);
+    }
+    if (tracer)
+        free_tracer(tracer, trace_file);
 
     free_y86sim(sim);
     free_reg(saver);
     free_mem(savem);
+    free(stops);
+    free(stop_opt);
 
-    return 0;
+    return diverged ? 1 : 0;
 }
-
@@ -4,13 +4,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <assert.h>
 
 #define MAX_STEP 10000
 
 #define BLK_SIZE 32
-#define MEM_SIZE (1<<13)
-#define REG_SIZE 32
+#define MEM_SIZE (1<<13)        /* default address space size */
+#define MAX_MEM_SIZE (1<<30)
 
 typedef unsigned char byte_t;
 typedef int long_t;
@@ -66,17 +67,215 @@ typedef enum { D_DATA, D_POS, D_ALIGN } dtv_t;
 #define GET_REGB(byte0) LOW(byte0)
 
 
-typedef struct mem {
-    int len;
-    byte_t *data;
-} mem_t;
+/* a simulator's memory, laid out in y86sim_int.h */
+typedef struct mem mem_t;
+
+/* Y86 status of a step or a run */
+typedef enum {STAT_AOK, STAT_HLT, STAT_ADR, STAT_INS} stat_t;
+
+/*
+ * Error messages ("PC = 0x10, Invalid instruction address") are kept in
+ * the y86sim_t they happen to and passed to its sink, so simulators on
+ * different threads don't share any output.
+ */
+#define ERR_LEN 128
+typedef void (*err_fn_t)(void *arg, const char *msg);
+
+/* breakpoint: stop before the instruction at 'pc' if 'reg' holds 'val' */
+typedef struct brkpt {
+    long_t pc;
+    regid_t reg;        /* REG_NONE for an unconditional breakpoint */
+    long_t val;
+    struct brkpt *next;
+} brkpt_t;
 
 typedef struct y86sim {
     long_t pc;
-    mem_t *r;
+    long_t r[REG_CNT];
     mem_t *m;
-    cc_t cc;
+    cc_t cc;            /* stale while lazy_op != A_NONE, see get_cc() */
+    alu_t lazy_op;      /* the last ALU op whose CC is not computed yet */
+    long_t lazy_argA;
+    long_t lazy_argB;
+    long_t lazy_val;
+    brkpt_t *brk;       /* breakpoints, marked in the pages' 'brk' bitmaps */
+    brkpt_t *brk_hit;   /* the breakpoint the last run stopped at */
+    char err[ERR_LEN];  /* the last error message, "" if none */
+    err_fn_t err_fn;    /* also gets every message if not NULL */
+    void *err_arg;
 } y86sim_t;
 
+/*
+ * Binary execution trace (y86sim -t): a trace_hdr_t and then one
+ * trace_rec_t per step, both in host byte order
+ */
+#define TRACE_MAGIC "Y86T"
+#define TRACE_VERSION 1
+
+typedef struct trace_hdr {
+    char magic[4];
+    int version;
+    int rec_size;       /* sizeof(trace_rec_t) */
+    long_t start_pc;
+} trace_hdr_t;
+
+/* trace_rec_t.code of a step that couldn't fetch an instruction */
+#define TRACE_NOINS 0xFF
+/* trace_rec_t.code of a record that only sets the PC of the next one */
+#define TRACE_SETPC 0xFE
+
+/* trace_rec_t.flags, the low 2 bits are the stat_t of the step */
+#define TRACE_STAT  0x03
+#define TRACE_LOAD  0x04    /* read the word at 'addr' */
+#define TRACE_STORE 0x08    /* wrote the word at 'addr' */
+
+typedef struct trace_rec {
+    short dpc;          /* PC - next PC (fall-through) of the previous step */
+    byte_t code;        /* HPACK(icode, ifun), TRACE_NOINS or TRACE_SETPC */
+    byte_t flags;
+    byte_t regs;        /* HPACK(first, second written register) */
+    byte_t pad[3];
+    long_t val[2];      /* the new values of the written registers */
+    long_t addr;        /* data address, the PC itself for TRACE_SETPC */
+} trace_rec_t;
+
+/*
+ * liby86sim: everything but the command line of y86sim. A y86sim_t owns
+ * all of its state, so any number of them may run in one process, on as
+ * many threads. Running out of host memory is an error of the simulator
+ * that needed it, and the call fails (NULL, FALSE, -1 or STAT_ADR). The
+ * usual life of one is
+ *     new_y86sim(), set_err_fn(), load_y86sim()      create and load
+ *         (or just open_y86sim())
+ *     nexti(), find_engine(name)->run()              step or run
+ *         (or undo_step()/undo_run() to go back later,
+ *          run_batch() for many images)
+ *     sim->pc, get_cc(), get_reg_val(), get_long_val(), report()  inspect
+ *     free_y86sim()
+ */
+
+/* lanes run_lanes() runs at once (-e lanes) */
+#ifndef LANES
+#define LANES 8
+#endif
+
+typedef stat_t (*run_fn)(y86sim_t *sim, int max_steps, int *steps);
+
+typedef struct engine {
+    char *name;
+    run_fn run;
+} engine_t;
+
+extern engine_t engine_table[];
+extern reg_t reg_table[REG_CNT];
+
+/* PIPE estimate of run_timing() */
+typedef struct timing {
+    uint64_t insts;
+    uint64_t load_use;          /* hazards, one bubble each */
+    uint64_t jxx;               /* conditional jumps */
+    uint64_t mispredict;
+    uint64_t ret;
+} timing_t;
+
+typedef struct prof prof_t;
+typedef struct tracer tracer_t;
+typedef struct undo undo_t;
+
+/* a batch image, see run_batch() */
+typedef enum { JOB_DONE, JOB_PASS, JOB_FAIL, JOB_ERR } job_res_t;
+
+typedef struct job {
+    char *bin;
+    char *expect;       /* NULL if there is nothing to compare */
+    int max_steps;
+    job_res_t res;
+    int diff_line;      /* first different line for JOB_FAIL */
+} job_t;
+
+/* errors */
+void sim_error(y86sim_t *sim, const char *fmt, ...);
+void set_err_fn(y86sim_t *sim, err_fn_t fn, void *arg);
+void err_to_file(void *arg, const char *msg);
+char *stat_name(stat_t e);
+char *cc_name(cc_t c);
+
+/* memory and registers */
+mem_t *init_mem(int len);
+void clear_mem(mem_t *m);
+void free_mem(mem_t *m);
+mem_t *dup_mem(mem_t *oldm);
+bool_t copy_mem(mem_t *dst, mem_t *src);
+bool_t diff_mem(mem_t *oldm, mem_t *newm, FILE *outfile);
+bool_t get_byte_val(mem_t *m, long_t addr, byte_t *dest);
+bool_t get_long_val(mem_t *m, long_t addr, long_t *dest);
+bool_t set_byte_val(mem_t *m, long_t addr, byte_t val);
+bool_t set_long_val(mem_t *m, long_t addr, long_t val);
+regid_t find_reg(char *name);
+long_t get_reg_val(long_t *r, regid_t id);
+void set_reg_val(long_t *r, regid_t id, long_t val);
+long_t *dup_reg(long_t *oldr);
+void free_reg(long_t *r);
+bool_t diff_reg(long_t *oldr, long_t *newr, FILE *outfile);
+
+/* simulators */
+y86sim_t *new_y86sim(int slen);
+void free_y86sim(y86sim_t *sim);
+int load_y86sim(y86sim_t *sim, char *fname);
+y86sim_t *open_y86sim(char *fname, int mem_size, FILE *out);
+int load_image(y86sim_t *sim, mem_t *m, char *fname);
+mem_t *reload_mem(y86sim_t *sim, char *fname);
+cc_t get_cc(y86sim_t *sim);
+void report(FILE *out, y86sim_t *sim, long_t *saver, mem_t *savem,
+            stat_t e, int step);
+
+/* breakpoints and watches */
+bool_t watch_mem(mem_t *m, long_t addr, int len);
+bool_t set_brk(y86sim_t *sim, long_t pc, regid_t reg, long_t val);
+void clear_brk(y86sim_t *sim);
+brkpt_t *brk_hit(y86sim_t *sim, long_t pc);
+bool_t watch_hit(y86sim_t *sim, long_t *addr);
+void clear_hits(y86sim_t *sim);
+void print_stop(FILE *out, y86sim_t *sim);
+
+/* execution */
+stat_t nexti(y86sim_t *sim);
+stat_t run_switch(y86sim_t *sim, int max_steps, int *steps);
+stat_t run_thread(y86sim_t *sim, int max_steps, int *steps);
+stat_t run_lanes1(y86sim_t *sim, int max_steps, int *steps);
+void run_lanes(y86sim_t **sims, int n, int *max_steps, int *steps, stat_t *e);
+engine_t *find_engine(char *name);
+
+/* instrumented runs */
+prof_t *new_prof(mem_t *m, long_t pc);
+void free_prof(prof_t *p);
+stat_t run_prof(y86sim_t *sim, prof_t *p, int max_steps, int *steps);
+int write_prof(prof_t *p, y86sim_t *sim, char *fname);
+stat_t run_timing(y86sim_t *sim, timing_t *t, int max_steps, int *steps);
+void print_timing(FILE *out, timing_t *t);
+tracer_t *new_tracer(y86sim_t *sim, char *fname, bool_t async);
+int free_tracer(tracer_t *t, char *fname);
+stat_t run_trace(y86sim_t *sim, tracer_t *t, int max_steps, int *steps);
+
+/* checkpoints */
+int save_checkpoint(y86sim_t *sim, int steps, char *image, char *fname);
+int load_checkpoint(y86sim_t *sim, int *steps, char *image, char *fname);
+stat_t run_ckpt(engine_t *eng, y86sim_t *sim, char *fname, int every,
+                int max_steps, int *steps);
+
+/* reverse debugging */
+undo_t *new_undo(y86sim_t *sim, int step);
+void free_undo(undo_t *u);
+stat_t undo_step(undo_t *u, y86sim_t *sim);
+stat_t undo_run(undo_t *u, y86sim_t *sim, engine_t *eng, int n);
+bool_t undo_back(undo_t *u, y86sim_t *sim, int target);
+int undo_find_write(undo_t *u, y86sim_t *sim, long_t addr);
+int undo_steps(undo_t *u);
+int undo_first(undo_t *u);
+
+/* batch runs */
+void run_batch(job_t *jobs, int njobs, engine_t *eng, int mem_size,
+               int nthreads);
+
 #endif
 
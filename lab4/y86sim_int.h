@@ -0,0 +1,72 @@
+#ifndef _Y86_SIM_INT_
+#define _Y86_SIM_INT_
+
+/*
+ * The insides of liby86sim shared with the command line of y86sim (the
+ * debugger, co-simulation and the fuzzer look at pages and decoded
+ * instructions); programs using the library only need y86sim.h
+ */
+#include "y86sim.h"
+
+/* Memory is split into pages allocated on first write */
+#define PG_BITS 12
+#define PG_SIZE (1<<PG_BITS)
+#define PG_MASK (PG_SIZE-1)
+
+/* Pre-decoded instruction (one record per instruction address) */
+typedef struct dinst {
+    byte_t valid;   /* record matches the current memory contents */
+    byte_t icode;
+    byte_t ifun;
+    byte_t rA;
+    byte_t rB;
+    long_t valC;
+    long_t next_pc;
+    const void *op; /* handler of the threaded engine, NULL if unknown */
+} dinst_t;
+
+#define MAX_INSBYTES 6
+
+typedef struct page {
+    byte_t *data;    /* NULL if never written, reads as zeros */
+    byte_t *code;    /* 1 for bytes covered by some decoded instruction */
+    dinst_t *icache; /* decoded instructions starting in this page */
+    byte_t *watch;   /* bitmap of watched bytes, NULL if none in the page */
+    byte_t *brk;     /* bitmap of PCs with a breakpoint, NULL if none */
+    byte_t dirty;    /* written since the image was loaded */
+} page_t;
+
+#define MAP_BIT(_map, _off) ((_map)[(_off) >> 3] >> ((_off) & 7) & 1)
+#define MAP_SET(_map, _off) ((_map)[(_off) >> 3] |= 1 << ((_off) & 7))
+
+struct mem {
+    int len;
+    int npages;
+    page_t *page;    /* page table, one entry per PG_SIZE bytes */
+    unsigned icache_gen; /* bumped whenever decoded code is overwritten */
+    byte_t *map;     /* private mapping of the image the first pages use */
+    size_t map_len;
+    bool_t all_dirty;   /* clear_mem() lost the image, every page may differ */
+    bool_t watch_hit;   /* a watched byte has been written */
+    long_t watch_addr;  /* the first one since watch_hit was cleared */
+    y86sim_t *sim;      /* whose sink hears of failed allocations, or NULL */
+};
+
+/* cached_inst: the decoded record at 'pc', NULL if not decoded yet */
+static inline dinst_t *cached_inst(mem_t *m, long_t pc)
+{
+    dinst_t *icache;
+    if (pc < 0 || pc >= m->len)
+        return NULL;
+    icache = m->page[pc >> PG_BITS].icache;
+    if (!icache || !icache[pc & PG_MASK].valid)
+        return NULL;
+    return &icache[pc & PG_MASK];
+}
+
+/* decoding */
+stat_t decode_inst(mem_t *m, long_t pc, dinst_t **dp);
+void inst_effects(y86sim_t *sim, dinst_t *d, regid_t *w1, regid_t *w2,
+                  long_t *addr, byte_t *mem);
+
+#endif
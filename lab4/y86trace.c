@@ -0,0 +1,127 @@
+/* Decoder of y86sim execution traces (y86sim -t) */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "y86sim.h"
+
+#define err_print(_s, _a ...) \
+    fprintf(stderr, _s"\n", _a);
+
+#define REC_BUF 4096
+
+/* instruction length by icode, as decoded by y86sim */
+int inst_len[16] = { 1, 1, 2, 6, 6, 6, 2, 5, 5, 1, 2, 2, 2, 2, 2, 2 };
+
+char *stat_names[] = { "AOK", "HLT", "ADR", "INS" };
+
+/*
+ * print_csim: print the memory accesses of a step in the 'csim' format
+ * ("I addr,size" for instruction fetches, " L/S addr,size" for data);
+ * Y86 has no read-modify-write instruction, so 'M' never shows up
+ */
+void print_csim(trace_rec_t *rec, long_t pc, bool_t fetch)
+{
+    int icode = HIGH(rec->code);
+
+    if (fetch && rec->code != TRACE_NOINS)
+        printf("I %x,%d\n", pc, inst_len[icode]);
+    if (rec->flags & TRACE_LOAD)
+        printf(" L %x,4\n", rec->addr);
+    if (rec->flags & TRACE_STORE)
+        printf(" S %x,4\n", rec->addr);
+}
+
+/* print_dump: print all fields of a step */
+void print_dump(trace_rec_t *rec, long_t pc, long long step)
+{
+    int i;
+
+    printf("%lld\t0x%.4x\t", step, pc);
+    if (rec->code == TRACE_NOINS)
+        printf("--");
+    else
+        printf("%.2x", rec->code);
+    printf("\t%s", stat_names[rec->flags & TRACE_STAT]);
+    for (i = 0; i < 2; i++) {
+        regid_t id = i ? LOW(rec->regs) : HIGH(rec->regs);
+        if (id != REG_NONE)
+            printf("\tr%d=0x%.8x", id, rec->val[i]);
+    }
+    if (rec->flags & TRACE_LOAD)
+        printf("\tL 0x%.4x", rec->addr);
+    if (rec->flags & TRACE_STORE)
+        printf("\tS 0x%.4x", rec->addr);
+    printf("\n");
+}
+
+void usage(char *pname)
+{
+    printf("Usage: %s [-h] [-i] [-d] file.trace\n", pname);
+    printf("   -i         also print instruction fetches ('I addr,size')\n");
+    printf("   -d         dump every step instead of the csim format\n");
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    trace_rec_t buf[REC_BUF];
+    trace_hdr_t hdr;
+    bool_t fetch = FALSE, dump = FALSE;
+    long long step = 0;
+    long_t pc;
+    FILE *f;
+    int c, n, i;
+
+    while ((c = getopt(argc, argv, "hid")) != -1) {
+        switch (c) {
+          case 'i':
+            fetch = TRUE;
+            break;
+          case 'd':
+            dump = TRUE;
+            break;
+          case 'h':
+          default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1)
+        usage(argv[0]);
+
+    f = fopen(argv[optind], "rb");
+    if (!f) {
+        err_print("Can't open trace file '%s'", argv[optind]);
+        exit(1);
+    }
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, TRACE_MAGIC, 4)
+        || hdr.version != TRACE_VERSION || hdr.rec_size != sizeof(trace_rec_t)) {
+        err_print("Invalid trace file '%s'", argv[optind]);
+        exit(1);
+    }
+
+    /* each PC is the previous fall-through PC plus dpc */
+    pc = hdr.start_pc;
+    while ((n = fread(buf, sizeof(trace_rec_t), REC_BUF, f)) > 0) {
+        for (i = 0; i < n; i++) {
+            trace_rec_t *rec = &buf[i];
+            int icode = HIGH(rec->code);
+
+            if (rec->code == TRACE_SETPC) {
+                pc = rec->addr;
+                continue;
+            }
+            pc += rec->dpc;
+            if (dump)
+                print_dump(rec, pc, step);
+            else
+                print_csim(rec, pc, fetch);
+            step++;
+            if (rec->code != TRACE_NOINS)
+                pc += inst_len[icode];
+        }
+    }
+    fclose(f);
+    return 0;
+}
@@ -0,0 +1,107 @@
+/* The lab6 ISA simulator renamed into the yis_ namespace (see y86yis.h) */
+
+#define alu_table       yis_alu_table
+#define bad_instr       yis_bad_instr
+#define cc_name         yis_cc_name
+#define cc_names        yis_cc_names
+#define clear_mem       yis_clear_mem
+#define compute_alu     yis_compute_alu
+#define compute_cc      yis_compute_cc
+#define cond_holds      yis_cond_holds
+#define copy_mem        yis_copy_mem
+#define copy_reg        yis_copy_reg
+#define copy_state      yis_copy_state
+#define diff_mem        yis_diff_mem
+#define diff_reg        yis_diff_reg
+#define diff_state      yis_diff_state
+#define dump_memory     yis_dump_memory
+#define dump_reg        yis_dump_reg
+#define find_instr      yis_find_instr
+#define find_register   yis_find_register
+#define free_mem        yis_free_mem
+#define free_reg        yis_free_reg
+#define free_state      yis_free_state
+#define get_byte_val    yis_get_byte_val
+#define get_reg_val     yis_get_reg_val
+#define get_word_val    yis_get_word_val
+#define gui_mode        yis_gui_mode
+#define hex2dig         yis_hex2dig
+#define iname           yis_iname
+#define init_mem        yis_init_mem
+#define init_reg        yis_init_reg
+#define instruction_set yis_instruction_set
+#define invalid_instr   yis_invalid_instr
+#define load_mem        yis_load_mem
+#define new_state       yis_new_state
+#define op_name         yis_op_name
+#define reg_name        yis_reg_name
+#define reg_table       yis_reg_table
+#define reg_valid       yis_reg_valid
+#define set_byte_val    yis_set_byte_val
+#define set_reg_val     yis_set_reg_val
+#define set_word_val    yis_set_word_val
+#define stat_name       yis_stat_name
+#define stat_names      yis_stat_names
+#define step_state      yis_step_state
+
+#include "../lab6/sim/misc/isa.c"
+#include "y86yis.h"
+
+int gui_mode = 0;
+
+struct yis {
+    state_ptr s;
+};
+
+yis_t *yis_new(int memlen)
+{
+    yis_t *y = (yis_t *)malloc(sizeof(yis_t));
+    y->s = new_state(memlen);
+    return y;
+}
+
+void yis_free(yis_t *y)
+{
+    free_state(y->s);
+    free(y);
+}
+
+void yis_set_cpu(yis_t *y, int pc, int *regs, unsigned char cc)
+{
+    int id;
+    y->s->pc = pc;
+    for (id = REG_EAX; id <= REG_EDI; id++)
+        set_reg_val(y->s->r, id, regs[id]);
+    y->s->cc = cc;
+}
+
+int yis_set_byte(yis_t *y, int addr, unsigned char val)
+{
+    return set_byte_val(y->s->m, addr, val);
+}
+
+int yis_get_word(yis_t *y, int addr, int *val)
+{
+    return get_word_val(y->s->m, addr, val);
+}
+
+/* lab6 numbers its statuses from STAT_BUB, y86sim from STAT_AOK */
+int yis_step(yis_t *y)
+{
+    return step_state(y->s, NULL) - STAT_AOK;
+}
+
+int yis_pc(yis_t *y)
+{
+    return y->s->pc;
+}
+
+int yis_reg(yis_t *y, int id)
+{
+    return get_reg_val(y->s->r, id);
+}
+
+unsigned char yis_cc(yis_t *y)
+{
+    return y->s->cc;
+}
@@ -0,0 +1,25 @@
+#ifndef _Y86_YIS_
+#define _Y86_YIS_
+
+/*
+ * The ISA simulator of lab6 (lab6/sim/misc/isa.c) with its symbols moved
+ * into the yis_ namespace by y86yis.c, so y86sim can run it side by side
+ * with nexti() in lockstep mode. Statuses are y86sim's stat_t values.
+ */
+typedef struct yis yis_t;
+
+yis_t *yis_new(int memlen);
+void yis_free(yis_t *y);
+
+void yis_set_cpu(yis_t *y, int pc, int *regs, unsigned char cc);
+int yis_set_byte(yis_t *y, int addr, unsigned char val);
+int yis_get_word(yis_t *y, int addr, int *val);
+
+/* execute one instruction with step_state() */
+int yis_step(yis_t *y);
+
+int yis_pc(yis_t *y);
+int yis_reg(yis_t *y, int id);
+unsigned char yis_cc(yis_t *y);
+
+#endif
@@ -2,21 +2,94 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 #include "y86asm.h"
 
-line_t *y86bin_listhead = NULL;   /* the head of y86 binary code line list*/
-line_t *y86bin_listtail = NULL;   /* the tail of y86 binary code line list*/
-int y86asm_lineno = 0; /* the current line number of y86 assemble code */
+/*
+ * The state of assembling one file is a 'session' (init() to finit());
+ * 'y86asm -c' runs one session per thread, so it is thread local.
+ */
+#define SESSION __thread
+
+SESSION line_t *y86bin_lines = NULL;   /* y86 binary code lines, in source order */
+SESSION int y86bin_nlines = 0;          /* number of lines in y86bin_lines */
+SESSION int y86bin_maxlines = 0;        /* allocated size of y86bin_lines */
+SESSION int y86asm_lineno = 0; /* the current line number of y86 assemble code */
+SESSION char *y86asm_fname = ""; /* prefix of err_print() with several files */
+
+/* whether print the readable output to screen or not ? */
+bool_t screen = FALSE; 
+
+/* whether generate object files (-c) instead of the .bin */
+bool_t objfile = FALSE;
 
 #define err_print(_s, _a ...) do { \
   if (y86asm_lineno < 0) \
-    fprintf(stderr, "[--]: "_s"\n", ## _a); \
+    fprintf(stderr, "%s[--]: "_s"\n", y86asm_fname, ## _a); \
   else \
-    fprintf(stderr, "[L%d]: "_s"\n", y86asm_lineno, ## _a); \
+    fprintf(stderr, "%s[L%d]: "_s"\n", y86asm_fname, y86asm_lineno, ## _a); \
 } while (0);
 
-int vmaddr = 0;    /* vm addr */
+SESSION int vmaddr = 0;    /* vm addr */
+
+/* arena of the session: symbols and relocations */
+SESSION arena_t arena;
+
+/*
+ * arena_alloc: bump-allocate 'size' bytes from the arena
+ * (chunks double in size, so a session holds only a few of them)
+ */
+void *arena_alloc(arena_t *a, size_t size)
+{
+    chunk_t *chunk = a->head;
+    void *p;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (chunk == NULL || chunk->used + size > chunk->size) {
+        size_t csize = chunk ? chunk->size * 2 : ARENA_CHUNK;
+        if (csize < size)
+            csize = size;
+        chunk = (chunk_t *)malloc(sizeof(chunk_t) + csize);
+        if (chunk == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        chunk->next = a->head;
+        chunk->size = csize;
+        chunk->used = 0;
+        a->head = chunk;
+    }
+    p = chunk->data + chunk->used;
+    chunk->used += size;
+    return p;
+}
+
+/* arena_strndup: copy 'len' chars of 's' to the arena, terminated */
+char *arena_strndup(arena_t *a, const char *s, int len)
+{
+    char *p = (char *)arena_alloc(a, len + 1);
+    memcpy(p, s, len);
+    p[len] = '\0';
+    return p;
+}
+
+/* arena_free: release all the chunks of the arena */
+void arena_free(arena_t *a)
+{
+    chunk_t *chunk = a->head;
+    while (chunk) {
+        chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    a->head = NULL;
+}
 
 /* register table */
 reg_t reg_table[REG_CNT] = {
@@ -30,14 +103,22 @@ reg_t reg_table[REG_CNT] = {
     {"%edi", REG_EDI},
 };
 
+/* perfect hash of '%exx' on its last two chars (collision free over reg_table) */
+#define REG_HASH(name) (((name)[2] + 3*(name)[3]) & 0xF)
+regid_t reg_hash_tab[16];
+
 regid_t find_register(char *name)
 {
-    for(regid_t regid = REG_EAX;regid < REG_CNT;regid++){
-        if(strncmp(reg_table[regid].name,name,SIZEOF_REG) == 0){
-            return regid;
-        }
+    regid_t regid;
+
+    if(name[0] != '%' || name[1] != 'e' || name[2] == '\0'){
+        return REG_ERR;
     }
-    return REG_ERR;
+    regid = reg_hash_tab[REG_HASH(name)];
+    if(regid == REG_ERR || strncmp(reg_table[regid].name,name,SIZEOF_REG) != 0){
+        return REG_ERR;
+    }
+    return regid;
 }
 
 /* instruction set */
@@ -77,117 +158,430 @@ instr_t instr_set[] = {
     {NULL, 1,    0   , 0 } //end
 };
 
-instr_t *find_instr(char *name)
+#define INSTR_CNT (sizeof(instr_set)/sizeof(instr_t) - 1)
+#define MAX_INSTR_NAME 6
+
+/*
+ * hash_name: FNV-1a hash of the first 'len' chars of 'name'
+ */
+static unsigned hash_name(const char *name, int len, unsigned seed)
 {
-    instr_t *inst = instr_set;
-    while(inst->name != NULL){
-        if(strncmp(name,inst->name,inst->len) == 0){
-            break;
-        }
-        inst++;
+    unsigned hash = seed;
+    int i;
+
+    for(i = 0; i < len; i++){
+        hash = (hash ^ (byte_t)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/* perfect hash of the mnemonics: the seed is chosen so that no two collide */
+#define INSTR_HASH_BITS 6
+#define INSTR_HASH_SEED 0x112b9
+#define INSTR_HASH(name,len) \
+    (hash_name(name, len, INSTR_HASH_SEED) >> (32 - INSTR_HASH_BITS))
+int instr_hash_tab[1 << INSTR_HASH_BITS];
+
+/*
+ * find_instr: look up a mnemonic
+ * (the whole [a-z.] token has to match, e.g. 'jlx' is not 'jl')
+ * args
+ *     name: the [a-z.] token (not necessarily terminated)
+ *     len: the length of token
+ *
+ * return
+ *     instr_t: the entry in instr_set, the {NULL} one if not exist
+ */
+instr_t *find_instr(char *name, int len)
+{
+    instr_t *inst;
+
+    if(len == 0 || len > MAX_INSTR_NAME){
+        return &instr_set[INSTR_CNT];
+    }
+    inst = &instr_set[instr_hash_tab[INSTR_HASH(name, len)]];
+    if(inst->name == NULL || inst->len != len || strncmp(inst->name,name,len) != 0){
+        return &instr_set[INSTR_CNT];
     }
     return inst;
 }
 
+/* output image, written while parsing (don't forget to init and finit it) */
+SESSION byte_t *image = NULL;
+SESSION int image_size = 0;   /* allocated bytes of image */
+SESSION int image_len = 0;    /* end of the last emitted code, the .bin length */
+
+/*
+ * sections of the object file (-c), their data are packed in the image:
+ * only the last one is being written, at the end of the image
+ */
+SESSION obj_sect_t *sects = NULL;
+SESSION int nsects = 0;
+SESSION int maxsects = 0;
+SESSION int sect_offset = 0;  /* image offset of the last section */
+
+/* every reference to a symbol with -c, the linker patches them all */
+SESSION obj_reloc_t *obj_relocs = NULL;
+SESSION int obj_nrelocs = 0;
+SESSION int obj_maxrelocs = 0;
+
+/* the line and symbol of each of obj_relocs, to fill the -v listing */
+typedef struct lst_reloc {
+    int line;
+    symbol_t *sym;
+} lst_reloc_t;
+SESSION lst_reloc_t *lst_relocs = NULL;
+
+/*
+ * new_sect: start a section at 'addr' (the current one ends at vmaddr)
+ */
+void new_sect(int addr, int flags)
+{
+    if (nsects > 0) {
+        obj_sect_t *cur = &sects[nsects-1];
+        cur->size = vmaddr - cur->addr;
+        sect_offset += cur->len;
+    }
+    if (nsects == maxsects) {
+        maxsects = maxsects ? maxsects * 2 : 8;
+        sects = (obj_sect_t *)realloc(sects, maxsects * sizeof(obj_sect_t)); // free in finit
+        if (sects == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    sects[nsects].addr = addr;
+    sects[nsects].size = 0;
+    sects[nsects].len = 0;
+    sects[nsects].align = 1;
+    sects[nsects].flags = flags;
+    nsects++;
+}
+
+/*
+ * emit: copy the code of an instruction to the image
+ * (with -c, to the data of the current section)
+ *
+ * return
+ *     0: success
+ *     -1: error, the address is invalid
+ */
+int emit(bin_t *bin)
+{
+    int start = bin->addr;
+    int end;
+
+    if (bin->bytes == 0)
+        return 0;
+    if (objfile) {
+        obj_sect_t *cur = &sects[nsects-1];
+        cur->len = bin->addr + bin->bytes - cur->addr;
+        start = sect_offset + bin->addr - cur->addr;
+    }
+    end = start + bin->bytes;
+    if (start < 0) {
+        err_print("Invalid address 0x%x", bin->addr);
+        return -1;
+    }
+    if (end > image_size) {
+        int size = image_size ? image_size : 4096;
+        while (size < end)
+            size *= 2;
+        image = (byte_t *)realloc(image, size); // free in finit
+        if (image == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        memset(image + image_size, 0, size - image_size);
+        image_size = size;
+    }
+    memcpy(image + start, bin->codes, bin->bytes);
+    image_len = end;
+    return 0;
+}
+
+/* put_long: store a little-endian long_t value */
+static void put_long(byte_t *dest, int value, int bytes)
+{
+    int i;
+    for (i = 0; i < bytes; i++)
+        dest[i] = (value >> 8*i) & 0xFF;
+}
+
 /* symbol table (don't forget to init and finit it) */
-symbol_t *symtab = NULL;
+SESSION symtab_t symtab;
+
+#define SYMTAB_INIT 256
+#define SYMBOL_SEED 2166136261u
+
+/*
+ * find_slot: probe symtab for the slot of a name
+ *
+ * return
+ *     the slot holding the 'name' symbol, or the empty slot to put it in
+ */
+static symbol_t **find_slot(symbol_t **slot, int size, char *name, int len, unsigned hash)
+{
+    int i = hash & (size - 1);
+
+    while(slot[i] != NULL){
+        if(slot[i]->hash == hash && slot[i]->len == len
+           && memcmp(slot[i]->name,name,len) == 0){
+            break;
+        }
+        i = (i + 1) & (size - 1);
+    }
+    return &slot[i];
+}
 
 /*
- * find_symbol: scan table to find the symbol
+ * grow_symtab: double the slots of symtab and rehash all the symbols
+ */
+static void grow_symtab(void)
+{
+    int size = symtab.size * 2;
+    symbol_t **slot = (symbol_t **)calloc(size, sizeof(symbol_t *));
+    int i;
+
+    for(i = 0; i < symtab.size; i++){
+        symbol_t *sym = symtab.slot[i];
+        if(sym != NULL){
+            *find_slot(slot, size, sym->name, sym->len, sym->hash) = sym;
+        }
+    }
+    free(symtab.slot);
+    symtab.slot = slot;
+    symtab.size = size;
+}
+
+/*
+ * find_symbol: look up the symbol in the hash table (exact match)
  * args
- *     name: the name of symbol
+ *     name: the name of symbol (not necessarily terminated)
+ *     len: the length of name
  *
  * return
  *     symbol_t: the 'name' symbol
  *     NULL: not exist
  */
-symbol_t *find_symbol(char *name)
+symbol_t *find_symbol(char *name, int len)
 {
-    symbol_t *current = symtab->next;
-    while(current != NULL){
-        if(strncmp(current->name,name,strlen(current->name)) == 0){
-            return current;
-        }
-        current = current->next;
+    unsigned hash = hash_name(name, len, SYMBOL_SEED);
+    return *find_slot(symtab.slot, symtab.size, name, len, hash);
+}
+
+/*
+ * intern_symbol: get the one symbol_t of a name, create an undefined
+ * one on the first reference
+ * args
+ *     name: the name of symbol (not necessarily terminated)
+ *     len: the length of name
+ *
+ * return
+ *     symbol_t: the 'name' symbol
+ */
+symbol_t *intern_symbol(char *name, int len)
+{
+    unsigned hash = hash_name(name, len, SYMBOL_SEED);
+    symbol_t **slot = find_slot(symtab.slot, symtab.size, name, len, hash);
+    symbol_t *new;
+
+    if(*slot != NULL){
+        return *slot;
     }
-    return NULL;
+
+    /* create new symbol_t in the arena */
+    new = (symbol_t *)arena_alloc(&arena, sizeof(symbol_t));
+    new->name = arena_strndup(&arena, name, len);
+    new->len = len;
+    new->hash = hash;
+    new->addr = 0;
+    new->defined = FALSE;
+    new->pending = NULL;
+    new->first_ref = 0;
+    new->index = symtab.cnt;
+    new->sect = SYM_UNDEF;
+    *slot = new;
+
+    /* keep the load factor under 3/4 */
+    if(++symtab.cnt * 4 > symtab.size * 3){
+        grow_symtab();
+    }
+    return new;
 }
 
+/* patched relocations, reused by add_reloc */
+SESSION reloc_t *reloc_free = NULL;
+SESSION int reloc_cnt = 0;     /* number of references added to the chains */
+
 /*
- * add_symbol: add a new symbol to the symbol table
+ * add_symbol: define a symbol at the current address, and backpatch
+ * the references waiting for it
  * args
- *     name: the name of symbol
+ *     symbol: the interned symbol
  *
  * return
  *     0: success
  *     -1: error, the symbol has exist
  */
-int add_symbol(char *name)
-{    
-    /* check duplicate */ 
-    symbol_t *current = symtab;
-    if(find_symbol(name)){
+int add_symbol(symbol_t *symbol)
+{
+    reloc_t *rtmp;
+
+    /* check duplicate */
+    if(symbol->defined){
         return -1;
     }
 
-    /* create new symbol_t (don't forget to free it)*/
-    symbol_t *new = (symbol_t *)malloc(sizeof(symbol_t));
-    new->name = name;
-    new->addr = vmaddr;
-    new->next = NULL;
+    symbol->addr = vmaddr;
+    symbol->defined = TRUE;
+    if(objfile){
+        symbol->sect = nsects - 1;
+    }
 
-    /* add the new symbol_t to symbol table */
-    while(current->next){
-        current = current->next;
+    /* the fields were emitted to the image already */
+    while((rtmp = symbol->pending) != NULL){
+        put_long(image + rtmp->addr, vmaddr, rtmp->bytes);
+        if(rtmp->line >= 0){
+            bin_t *bin = &y86bin_lines[rtmp->line].y86bin;
+            put_long(bin->codes + (rtmp->addr - bin->addr), vmaddr, 4);
+        }
+        symbol->pending = rtmp->next;
+        rtmp->next = reloc_free;
+        reloc_free = rtmp;
     }
-    current->next = new;
-    
     return 0;
 }
 
-/* relocation table (don't forget to init and finit it) */
-reloc_t *reltab = NULL;
-
 /*
- * add_reloc: add a new relocation to the relocation table
+ * add_reloc: fill the symbol address into the binary code, or add it to
+ * the backpatch chain of the symbol if not defined yet
  * args
- *     name: the name of symbol
- *
- * return
- *     0: success
- *     -1: error, the symbol has exist
+ *     symbol: the interned symbol
+ *     line: the line with the binary code (its bin_t has addr and codes[0])
  */
-void add_reloc(char *name, bin_t *bin)
+void add_reloc(symbol_t *symbol, line_t *line)
 {
-    reloc_t *current = reltab;
-    while(current->next != NULL){
-        current = current->next;
+    bin_t *bin = &line->y86bin;
+    reloc_t *new;
+    int off;
+
+    /* offset of the address field according itype */
+    switch(HIGH(bin->codes[0])){
+        case I_IRMOVL:
+            off = 2;
+            break;
+        case I_JMP:
+        case I_CALL:
+            off = 1;
+            break;
+        default:
+            off = 0;
+            break;
+    }
+
+    /* with -c the linker fills the field, even for a local symbol */
+    if(objfile){
+        obj_reloc_t *rel;
+        if(obj_nrelocs == obj_maxrelocs){
+            obj_maxrelocs = obj_maxrelocs ? obj_maxrelocs * 2 : 256;
+            obj_relocs = (obj_reloc_t *)realloc(obj_relocs,
+                                                obj_maxrelocs * sizeof(obj_reloc_t)); // free in finit
+            if(screen)
+                lst_relocs = (lst_reloc_t *)realloc(lst_relocs,
+                                                    obj_maxrelocs * sizeof(lst_reloc_t)); // free in finit
+            if(obj_relocs == NULL || (screen && lst_relocs == NULL)){
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+            }
+        }
+        rel = &obj_relocs[obj_nrelocs++];
+        rel->sect = nsects - 1;
+        rel->addr = bin->addr + off - sects[nsects-1].addr;
+        rel->bytes = bin->bytes - off < 4 ? bin->bytes - off : 4;
+        rel->sym = symbol->index;
+        if(screen){
+            lst_relocs[obj_nrelocs-1].line = line - y86bin_lines;
+            lst_relocs[obj_nrelocs-1].sym = symbol;
+        }
+        return;
     }
 
-    /* create new reloc_t (don't forget to free it)*/
-    reloc_t *new = (reloc_t*)malloc(sizeof(reloc_t));
-    new->y86bin = bin;
-    new->name = name;
-    new->next = NULL;
+    if(symbol->defined){
+        put_long(bin->codes + off, symbol->addr, 4);
+        return;
+    }
+
+    /* create new reloc_t, in the arena unless one was patched already */
+    if(reloc_free != NULL){
+        new = reloc_free;
+        reloc_free = new->next;
+    } else {
+        new = (reloc_t*)arena_alloc(&arena, sizeof(reloc_t));
+    }
+    new->addr = bin->addr + off;
+    new->bytes = bin->bytes - off < 4 ? bin->bytes - off : 4;
+    new->line = screen ? line - y86bin_lines : -1;
 
-    /* add the new reloc_t to relocation table */
-    current->next = new;
+    /* add the new reloc_t to the chain of the symbol */
+    if(symbol->pending == NULL){
+        symbol->first_ref = reloc_cnt;
+    }
+    new->next = symbol->pending;
+    symbol->pending = new;
+    reloc_cnt++;
 }
 
 
-/* macro for parsing y86 assembly code */
-#define IS_DIGIT(s) ((*(s)>='0' && *(s)<='9') || *(s)=='-' || *(s)=='+')
-#define IS_LETTER(s) ((*(s)>='a' && *(s)<='z') || (*(s)>='A' && *(s)<='Z'))
+/* character classes of the tokenizer (filled by init_char_class()) */
+#define CC_BLANK   0x01 /* ' ' '\t' */
+#define CC_DIGIT   0x02 /* starts a digit: 0-9 + - */
+#define CC_LETTER  0x04 /* a-z A-Z */
+#define CC_INSTR   0x08 /* in a mnemonic: a-z . */
+#define CC_SYMEND  0x10 /* ends a symbol: ' ' '\t' , # */
+byte_t char_class[256];
+
+/* value of a digit in base <= 16, 16 if not a digit */
+byte_t digit_value[256];
+
+static void init_char_class(void)
+{
+    int c;
+
+    for (c = 0; c < 256; c++) {
+        char_class[c] = 0;
+        digit_value[c] = 16;
+    }
+    char_class[' '] = char_class['\t'] = CC_BLANK | CC_SYMEND;
+    char_class[','] = char_class['#'] = CC_SYMEND;
+    char_class['+'] = char_class['-'] = CC_DIGIT;
+    char_class['.'] = CC_INSTR;
+    for (c = '0'; c <= '9'; c++) {
+        char_class[c] = CC_DIGIT;
+        digit_value[c] = c - '0';
+    }
+    for (c = 'a'; c <= 'z'; c++) {
+        char_class[c] = CC_LETTER | CC_INSTR;
+        char_class[c - 'a' + 'A'] = CC_LETTER;
+    }
+    for (c = 'a'; c <= 'f'; c++)
+        digit_value[c] = digit_value[c - 'a' + 'A'] = c - 'a' + 10;
+}
+
+/* macro for parsing y86 assembly code, a line is the slice up to 'end' */
+#define CHAR_IS(s,cc) (char_class[(byte_t)*(s)] & (cc))
+#define IS_DIGIT(s) CHAR_IS(s, CC_DIGIT)
+#define IS_LETTER(s) CHAR_IS(s, CC_LETTER)
 #define IS_COMMENT(s) (*(s)=='#')
 #define IS_REG(s) (*(s)=='%')
 #define IS_IMM(s) (*(s)=='$')
 #define IS_DELIM(s,c) (*(s)== c)
 
-#define IS_BLANK(s) (*(s)==' ' || *(s)=='\t')
-#define IS_END(s) (*(s)=='\0')
+#define IS_BLANK(s) CHAR_IS(s, CC_BLANK)
+#define IS_END(s,end) ((s) >= (end))
 
-#define SKIP_BLANK(s) do {  \
-  while(!IS_END(s) && IS_BLANK(s))  \
+#define SKIP_BLANK(s,end) do {  \
+  while(!IS_END(s,end) && IS_BLANK(s))  \
     (s)++;    \
 } while(0);
 
@@ -199,6 +593,7 @@ typedef enum { PARSE_ERR=-1, PARSE_REG, PARSE_DIGIT, PARSE_SYMBOL,
  * parse_instr: parse an expected data token (e.g., 'rrmovl')
  * args
  *     ptr: point to the start of string
+ *     end: point to the end of line
  *     inst: point to the inst_t within instr_set
  *
  * return
@@ -206,19 +601,23 @@ typedef enum { PARSE_ERR=-1, PARSE_REG, PARSE_DIGIT, PARSE_SYMBOL,
  *                            and store the pointer of the instruction to 'inst'
  *     PARSE_ERR: error, the value of 'ptr' and 'inst' are undefined
  */
-parse_t parse_instr(char **ptr, instr_t **inst)
+parse_t parse_instr(char **ptr, char *end, instr_t **inst)
 {
     instr_t *inst_tmp;
     char *current = *ptr;
+    int len = 0;
 
     /* skip the blank */
-    SKIP_BLANK(current);
-    if(IS_END(current)){
+    SKIP_BLANK(current,end);
+    if(IS_END(current,end)){
         return PARSE_ERR;
     }
 
     /* find_instr and check end */
-    inst_tmp = find_instr(current);
+    while(!IS_END(current+len,end) && CHAR_IS(current+len,CC_INSTR)){
+        len++;
+    }
+    inst_tmp = find_instr(current,len);
     if(inst_tmp->name == NULL){
         return PARSE_ERR;
     }
@@ -233,18 +632,19 @@ parse_t parse_instr(char **ptr, instr_t **inst)
  * parse_delim: parse an expected delimiter token (e.g., ',')
  * args
  *     ptr: point to the start of string
+ *     end: point to the end of line
  *
  * return
  *     PARSE_DELIM: success, move 'ptr' to the first char after token
  *     PARSE_ERR: error, the value of 'ptr' and 'delim' are undefined
  */
-parse_t parse_delim(char **ptr, char delim)
+parse_t parse_delim(char **ptr, char *end, char delim)
 {
     char *current = *ptr;
 
     /* skip the blank and check */
-    SKIP_BLANK(current);
-    if(IS_END(current) || (*current) != delim){
+    SKIP_BLANK(current,end);
+    if(IS_END(current,end) || (*current) != delim){
         err_print("Invalid '%c'",delim);
         return PARSE_ERR;
     }
@@ -259,6 +659,7 @@ parse_t parse_delim(char **ptr, char delim)
  * parse_reg: parse an expected register token (e.g., '%eax')
  * args
  *     ptr: point to the start of string
+ *     end: point to the end of line
  *     regid: point to the regid of register
  *
  * return
@@ -266,20 +667,20 @@ parse_t parse_delim(char **ptr, char delim)
  *                         and store the regid to 'regid'
  *     PARSE_ERR: error, the value of 'ptr' and 'regid' are undefined
  */
-parse_t parse_reg(char **ptr, regid_t *regid)
+parse_t parse_reg(char **ptr, char *end, regid_t *regid)
 {
     char *current = *ptr;
     regid_t regid_tmp;
 
     /* skip the blank and check */
-    SKIP_BLANK(current);
-    if(IS_END(current)){
+    SKIP_BLANK(current,end);
+    if(IS_END(current,end)){
         err_print("Invalid REG");
         return PARSE_ERR;
     }
 
     /* find register */
-    regid_tmp = find_register(current);
+    regid_tmp = end - current < SIZEOF_REG ? REG_ERR : find_register(current);
     if(regid_tmp == REG_ERR){
         err_print("Invalid REG");
         return PARSE_ERR;
@@ -296,25 +697,27 @@ parse_t parse_reg(char **ptr, regid_t *regid)
  * parse_symbol: parse an expected symbol token (e.g., 'Main')
  * args
  *     ptr: point to the start of string
- *     name: point to the name of symbol (should be allocated in this function)
+ *     end: point to the end of line
+ *     symbol: point to the interned symbol
  *
  * return
  *     PARSE_SYMBOL: success, move 'ptr' to the first char after token,
- *                               and allocate and store name to 'name'
- *     PARSE_ERR: error, the value of 'ptr' and 'name' are undefined
+ *                               and store the interned symbol to 'symbol'
+ *     PARSE_ERR: error, the value of 'ptr' and 'symbol' are undefined
  */
-parse_t parse_symbol(char **ptr, char **name)
+parse_t parse_symbol(char **ptr, char *end, symbol_t **symbol)
 {
     char *current = *ptr;
     int len = 0;
 
     /* skip the blank and check */
-    SKIP_BLANK(current);
-    if(IS_END(current)){
+    SKIP_BLANK(current,end);
+    if(IS_END(current,end)){
         return PARSE_ERR;
     }
 
-    while(!(IS_BLANK(current+len) || IS_END(current+len) || IS_DELIM(current+len,','))){
+    /* a trailing comment is not part of the name, e.g. 'jmp Loop#back' */
+    while(!IS_END(current+len,end) && !CHAR_IS(current+len,CC_SYMEND)){
         len++;
     }
 
@@ -322,21 +725,64 @@ parse_t parse_symbol(char **ptr, char **name)
         return PARSE_ERR;
     }
 
-    /* allocate name and copy to it */
-    *name = (char*) malloc(len*sizeof(char));
-    memset(*name,'\0',len*sizeof(char));
-    strncpy(*name,current,len);
-
-    /* set 'ptr' and 'name' */
+    /* set 'ptr' and 'symbol' */
+    *symbol = intern_symbol(current,len);
     *ptr = current + len;
 
     return PARSE_SYMBOL;
 }
 
+/*
+ * scan_digit: strtoll(s, endp, 0) on a slice, which isn't terminated
+ */
+static long long scan_digit(char *s, char *end, char **endp)
+{
+    char *p = s;
+    unsigned long long value = 0, limit = LLONG_MAX;
+    bool_t neg = FALSE, over = FALSE;
+    int base = 10;
+    char *digits;
+
+    if(!IS_END(p,end) && (*p == '+' || *p == '-')){
+        neg = (*p == '-');
+        limit += neg;
+        p++;
+    }
+    if(!IS_END(p,end) && *p == '0'){
+        base = 8;
+        if(end - p > 2 && (p[1] == 'x' || p[1] == 'X')
+           && digit_value[(byte_t)p[2]] < 16){
+            base = 16;
+            p += 2;
+        }
+    }
+
+    for(digits = p; !IS_END(p,end) && digit_value[(byte_t)*p] < base; p++){
+        int d = digit_value[(byte_t)*p];
+        if(value > (limit - d) / base){
+            over = TRUE;
+        } else {
+            value = value * base + d;
+        }
+    }
+
+    /* no digit: nothing is consumed */
+    if(p == digits){
+        *endp = s;
+        return 0;
+    }
+    *endp = p;
+    if(over){
+        return neg ? LLONG_MIN : LLONG_MAX;
+    }
+    return neg ? -(long long)(value - 1) - 1 : (long long)value;
+}
+
 /*
  * parse_digit: parse an expected digit token (e.g., '0x100')
  * args
  *     ptr: point to the start of string
+ *     end: point to the end of line
  *     value: point to the value of digit
  *
  * return
@@ -344,19 +790,19 @@ parse_t parse_symbol(char **ptr, char **name)
  *                            and store the value of digit to 'value'
  *     PARSE_ERR: error, the value of 'ptr' and 'value' are undefined
  */
-parse_t parse_digit(char **ptr, long *value)
+parse_t parse_digit(char **ptr, char *end, long *value)
 {
     char *current = *ptr;
     long value_tmp = 0;
 
     /* skip the blank and check */
-    SKIP_BLANK(current);
-    if(IS_END(current)){
+    SKIP_BLANK(current,end);
+    if(IS_END(current,end)){
         return PARSE_ERR;
     }
 
-    /* calculate the digit, (NOTE: see strtoll()) */
-    value_tmp = strtoll(current,&current,0);
+    /* calculate the digit, (NOTE: the same as strtoll() with base 0) */
+    value_tmp = scan_digit(current,end,&current);
 
     /* set 'ptr' and 'value' */
     *ptr = current;
@@ -369,7 +815,8 @@ parse_t parse_digit(char **ptr, long *value)
  * parse_imm: parse an expected immediate token (e.g., '$0x100' or 'STACK')
  * args
  *     ptr: point to the start of string
- *     name: point to the name of symbol (should be allocated in this function)
+ *     end: point to the end of line
+ *     symbol: point to the interned symbol
  *     value: point to the value of digit
  *
  * return
@@ -378,40 +825,40 @@ parse_t parse_digit(char **ptr, long *value)
  *                            and store the value of digit to 'value'
  *     PARSE_SYMBOL: success, the immediate token is a symbol,
  *                            move 'ptr' to the first char after token,
- *                            and allocate and store name to 'name' 
- *     PARSE_ERR: error, the value of 'ptr', 'name' and 'value' are undefined
+ *                            and store the interned symbol to 'symbol'
+ *     PARSE_ERR: error, the value of 'ptr', 'symbol' and 'value' are undefined
  */
-parse_t parse_imm(char **ptr, char **name, long *value)
+parse_t parse_imm(char **ptr, char *end, symbol_t **symbol, long *value)
 {
     char *current = *ptr;
-    char *symbol = NULL;
+    symbol_t *symbol_tmp = NULL;
     long value_tmp = 0;
     parse_t ret_t = PARSE_ERR;
  
     /* skip the blank and check */
-    SKIP_BLANK(current);
-    if(IS_END(current)){
+    SKIP_BLANK(current,end);
+    if(IS_END(current,end)){
         return PARSE_ERR;
     }
 
     /* if IS_IMM, then parse the digit */
     if(IS_IMM(current)){
         current++;
-        if(!IS_DIGIT(current)){
+        if(IS_END(current,end) || !IS_DIGIT(current)){
             err_print("Invalid Immediate");
             return PARSE_ERR;
         }
-        ret_t = parse_digit(&current,&value_tmp);
+        ret_t = parse_digit(&current,end,&value_tmp);
     }
 
     /* if IS_LETTER, then parse the symbol */
     else{
-        ret_t = parse_symbol(&current,&symbol);
+        ret_t = parse_symbol(&current,end,&symbol_tmp);
     }
 
-    /* set 'ptr' and 'name' or 'value' */
+    /* set 'ptr' and 'symbol' or 'value' */
     *ptr = current;
-    *name = symbol;
+    *symbol = symbol_tmp;
     *value = value_tmp;
 
     return ret_t;
@@ -421,6 +868,7 @@ parse_t parse_imm(char **ptr, char **name, long *value)
  * parse_mem: parse an expected memory token (e.g., '8(%ebp)')
  * args
  *     ptr: point to the start of string
+ *     end: point to the end of line
  *     value: point to the value of digit
  *     regid: point to the regid of register
  *
@@ -430,36 +878,36 @@ parse_t parse_imm(char **ptr, char **name, long *value)
  *                          and store the regid to 'regid'
  *     PARSE_ERR: error, the value of 'ptr', 'value' and 'regid' are undefined
  */
-parse_t parse_mem(char **ptr, long *value, regid_t *regid)
+parse_t parse_mem(char **ptr, char *end, long *value, regid_t *regid)
 {
     char *current = *ptr;
     long value_tmp = 0;
     regid_t regid_tmp;
 
     /* skip the blank and check */
-    SKIP_BLANK(current);
-    if(IS_END(current)){
+    SKIP_BLANK(current,end);
+    if(IS_END(current,end)){
         return PARSE_ERR;
     }
 
     /* calculate the digit and register, (ex: (%ebp) or 8(%ebp)) */
-    if(parse_digit(&current,&value_tmp) == PARSE_ERR){
+    if(parse_digit(&current,end,&value_tmp) == PARSE_ERR){
         return PARSE_ERR;
     }
 
-    SKIP_BLANK(current);
-    if(!IS_DELIM(current,'(')){
+    SKIP_BLANK(current,end);
+    if(IS_END(current,end) || !IS_DELIM(current,'(')){
         err_print("Invalid MEM");
         return PARSE_ERR;
     }
     current += SIZEOF_DELIM;
    
-    if(parse_reg(&current,&regid_tmp) == PARSE_ERR){
+    if(parse_reg(&current,end,&regid_tmp) == PARSE_ERR){
         return PARSE_ERR;    
     }
 
-    SKIP_BLANK(current);
-    if(!IS_DELIM(current,')')){
+    SKIP_BLANK(current,end);
+    if(IS_END(current,end) || !IS_DELIM(current,')')){
         err_print("Invalid MEM");
         return PARSE_ERR;
     }
@@ -477,7 +925,8 @@ parse_t parse_mem(char **ptr, long *value, regid_t *regid)
  * parse_data: parse an expected data token (e.g., '0x100' or 'array')
  * args
  *     ptr: point to the start of string
- *     name: point to the name of symbol (should be allocated in this function)
+ *     end: point to the end of line
+ *     symbol: point to the interned symbol
  *     value: point to the value of digit
  *
  * return
@@ -486,35 +935,35 @@ parse_t parse_mem(char **ptr, long *value, regid_t *regid)
  *                            and store the value of digit to 'value'
  *     PARSE_SYMBOL: success, data token is a symbol,
  *                            and move 'ptr' to the first char after token,
- *                            and allocate and store name to 'name' 
- *     PARSE_ERR: error, the value of 'ptr', 'name' and 'value' are undefined
+ *                            and store the interned symbol to 'symbol'
+ *     PARSE_ERR: error, the value of 'ptr', 'symbol' and 'value' are undefined
  */
-parse_t parse_data(char **ptr, char **name, long *value)
+parse_t parse_data(char **ptr, char *end, symbol_t **symbol, long *value)
 {
     char *current = *ptr;
-    char *name_tmp = *name;
+    symbol_t *symbol_tmp = *symbol;
     long value_tmp;
     parse_t ret_t = PARSE_ERR;
 
     /* skip the blank and check */
-    SKIP_BLANK(current);
-    if(IS_END(current)){
+    SKIP_BLANK(current,end);
+    if(IS_END(current,end)){
         return PARSE_ERR;
     }
    
     /* if IS_DIGIT, then parse the digit */
     if(IS_DIGIT(current)){
-        ret_t = parse_digit(&current,&value_tmp);
+        ret_t = parse_digit(&current,end,&value_tmp);
     }
 
     /* if IS_LETTER, then parse the symbol */
-    if(IS_LETTER(current)){
-        ret_t = parse_symbol(&current,&name_tmp);
+    if(!IS_END(current,end) && IS_LETTER(current)){
+        ret_t = parse_symbol(&current,end,&symbol_tmp);
     }
 
-    /* set 'ptr', 'name' and 'value' */
+    /* set 'ptr', 'symbol' and 'value' */
     *ptr = current;
-    *name = name_tmp;
+    *symbol = symbol_tmp;
     *value = value_tmp;
 
     return ret_t;
@@ -524,42 +973,39 @@ parse_t parse_data(char **ptr, char **name, long *value)
  * parse_label: parse an expected label token (e.g., 'Loop:')
  * args
  *     ptr: point to the start of string
- *     name: point to the name of symbol (should be allocated in this function)
+ *     end: point to the end of line
+ *     symbol: point to the interned symbol
  *
  * return
  *     PARSE_LABEL: success, move 'ptr' to the first char after token
- *                            and allocate and store name to 'name'
+ *                            and store the interned symbol to 'symbol'
  *     PARSE_ERR: error, the value of 'ptr' is undefined
  */
-parse_t parse_label(char **ptr, char **name)
+parse_t parse_label(char **ptr, char *end, symbol_t **symbol)
 {
     char *current = *ptr;
     int len = 0;
 
 
     /* skip the blank and check */
-    SKIP_BLANK(current);
-    if(IS_END(current)){
+    SKIP_BLANK(current,end);
+    if(IS_END(current,end)){
         return PARSE_ERR;
     }
 
-    while(!IS_DELIM(current+len,':')){
-        if(IS_BLANK(current+len) || IS_END(current+len)){
+    while(!IS_END(current+len,end) && !IS_DELIM(current+len,':')){
+        if(IS_BLANK(current+len)){
             return PARSE_ERR;
         }
         len++;
     }
 
-    if(len == 0){
+    if(len == 0 || IS_END(current+len,end)){
         return PARSE_ERR;
     }
     
-    /* allocate name and copy to it */
-    *name = (char*) malloc(len*sizeof(char));
-    memset(*name,'\0',len*sizeof(char));
-    strncpy(*name,current,len);
-
-    /* set 'ptr' and 'name' */
+    /* set 'ptr' and 'symbol' */
+    *symbol = intern_symbol(current,len);
     *ptr = current + len + SIZEOF_DELIM;
     return PARSE_LABEL;
 }
@@ -576,15 +1022,14 @@ parse_t parse_label(char **ptr, char **name)
  */
 type_t parse_line(line_t *line)
 {
-    char *y86asm = (char*)malloc(sizeof(char)*(strlen(line->y86asm)+1));
-    strcpy(y86asm,line->y86asm);
-    char *current = y86asm;
+    char *current = line->y86asm; /* a slice of the input, not terminated */
+    char *end = line->y86asm + line->len;
     instr_t *inst;
-    char *label;
+    symbol_t *label;
     bin_t *bin = &(line->y86bin);
     regid_t regAid;
     regid_t regBid;
-    char *symbol;
+    symbol_t *symbol;
     long value;
     parse_t ret_t;
 /* when finish parse an instruction or lable, we still need to continue check 
@@ -593,8 +1038,8 @@ type_t parse_line(line_t *line)
 *           call SUM  #invoke SUM function */
 cont:
     /* skip blank and check IS_END */
-    SKIP_BLANK(current);
-    if(IS_END(current)){
+    SKIP_BLANK(current,end);
+    if(IS_END(current,end)){
         return line->type;
     }
     
@@ -604,10 +1049,10 @@ cont:
     }
 
     /* is a label ? */
-    if(parse_label(&current,&label) == PARSE_LABEL){
+    if(parse_label(&current,end,&label) == PARSE_LABEL){
         if(add_symbol(label)<0){
             line->type = TYPE_ERR;
-            err_print("Dup symbol:%s",label);
+            err_print("Dup symbol:%s",label->name);
             return line->type;
         }
 
@@ -616,8 +1061,8 @@ cont:
         goto cont;
     }
     /* is an instruction ? */
-    if(parse_instr(&current,&inst) == PARSE_ERR){
-        err_print("Invalid REG2\t%s",current);
+    if(parse_instr(&current,end,&inst) == PARSE_ERR){
+        err_print("Invalid REG2\t%.*s",(int)(end - current),current);
         line->type = TYPE_ERR;
         return line->type;
     }
@@ -643,15 +1088,15 @@ cont:
         case I_RET:
             break;
         case I_RRMOVL:
-            if(parse_reg(&current,&regAid) == PARSE_ERR){
+            if(parse_reg(&current,end,&regAid) == PARSE_ERR){
                 line->type = TYPE_ERR;
                 return line->type;
             }
-            if(parse_delim(&current,',') == PARSE_ERR){
+            if(parse_delim(&current,end,',') == PARSE_ERR){
                 line->type = TYPE_ERR;
                 return line->type;
             }
-            if(parse_reg(&current,&regBid) == PARSE_ERR){
+            if(parse_reg(&current,end,&regBid) == PARSE_ERR){
                 line->type = TYPE_ERR;
                 return line->type;
             }
@@ -659,17 +1104,17 @@ cont:
             bin->codes[1] = HPACK(regAid,regBid);
             break;
         case I_IRMOVL:
-            ret_t =  parse_imm(&current,&symbol,&value); 
+            ret_t =  parse_imm(&current,end,&symbol,&value); 
             if(ret_t == PARSE_ERR){
                 line->type = TYPE_ERR;
                 return line->type;
             }
 
-            if(parse_delim(&current,',') == PARSE_ERR){
+            if(parse_delim(&current,end,',') == PARSE_ERR){
                 line->type = TYPE_ERR;
                 return line->type;
             }
-            if(parse_reg(&current,&regBid) == PARSE_ERR){
+            if(parse_reg(&current,end,&regBid) == PARSE_ERR){
                 line->type = TYPE_ERR;
                 return line->type;
             }
@@ -683,7 +1128,7 @@ cont:
                     bin->codes[5] = (value>>24)&0xFF;
                     break;
                 case PARSE_SYMBOL:
-                    add_reloc(symbol,bin);
+                    add_reloc(symbol,line);
                     break;
                 default:
                     break;
@@ -691,17 +1136,17 @@ cont:
             }
             break;
         case I_RMMOVL:
-            if(parse_reg(&current,&regAid) == PARSE_ERR){
+            if(parse_reg(&current,end,&regAid) == PARSE_ERR){
                 line->type = TYPE_ERR;
                 return line->type;
             }
 
-            if(parse_delim(&current,',') == PARSE_ERR){
+            if(parse_delim(&current,end,',') == PARSE_ERR){
                 line->type = TYPE_ERR;
                 return line->type;
             }
             
-            if(parse_mem(&current,&value,&regBid) == PARSE_ERR){
+            if(parse_mem(&current,end,&value,&regBid) == PARSE_ERR){
                 line->type = TYPE_ERR;
                 return line->type;
             }
@@ -714,18 +1159,18 @@ cont:
            
             break;
         case I_MRMOVL:
-            if(parse_mem(&current,&value,&regBid) == PARSE_ERR){
+            if(parse_mem(&current,end,&value,&regBid) == PARSE_ERR){
                 line->type = TYPE_ERR;
                 return line->type;
             }
 
 
-            if(parse_delim(&current,',') == PARSE_ERR){
+            if(parse_delim(&current,end,',') == PARSE_ERR){
                 line->type = TYPE_ERR;
                 return line->type;
             }
             
-            if(parse_reg(&current,&regAid) == PARSE_ERR){
+            if(parse_reg(&current,end,&regAid) == PARSE_ERR){
                 line->type = TYPE_ERR;
                 return line->type;
             }
@@ -739,15 +1184,15 @@ cont:
           
             break;
         case I_ALU:
-            if(parse_reg(&current,&regAid) == PARSE_ERR){
+            if(parse_reg(&current,end,&regAid) == PARSE_ERR){
                 line->type = TYPE_ERR;
                 return line->type;
             }
-            if(parse_delim(&current,',') == PARSE_ERR){
+            if(parse_delim(&current,end,',') == PARSE_ERR){
                 line->type = TYPE_ERR;
                 return line->type;
             }
-            if(parse_reg(&current,&regBid) == PARSE_ERR){
+            if(parse_reg(&current,end,&regBid) == PARSE_ERR){
                 line->type = TYPE_ERR;
                 return line->type;
             }
@@ -756,7 +1201,7 @@ cont:
             break;
         case I_JMP:
         case I_CALL:
-            ret_t = parse_data(&current,&symbol,&value);
+            ret_t = parse_data(&current,end,&symbol,&value);
             switch(ret_t){
                 case PARSE_DIGIT:
                     err_print("Invalid DEST");
@@ -764,7 +1209,7 @@ cont:
                     return line->type;
                     break;
                 case PARSE_SYMBOL:
-                    add_reloc(symbol,bin);
+                    add_reloc(symbol,line);
                     break;
                 default:
                     line->type = TYPE_ERR;
@@ -774,7 +1219,7 @@ cont:
             break;
         case I_PUSHL:
         case I_POPL:
-            if(parse_reg(&current,&regAid) == PARSE_ERR){
+            if(parse_reg(&current,end,&regAid) == PARSE_ERR){
                 line->type = TYPE_ERR;
                 return line->type;
             }
@@ -783,7 +1228,7 @@ cont:
         case I_DIRECTIVE:
             switch(ifun){
                 case D_DATA:
-                    ret_t = parse_data(&current,&symbol,&value);
+                    ret_t = parse_data(&current,end,&symbol,&value);
                     switch(ret_t){
                         case PARSE_DIGIT:
                             bin->codes[0] = value&0xFF;
@@ -792,7 +1237,7 @@ cont:
                             bin->codes[3] = (value>>24)&0xFF;
                             break;
                         case PARSE_SYMBOL:
-                            add_reloc(symbol,bin);
+                            add_reloc(symbol,line);
                             break;
                         default:
                             line->type = TYPE_ERR;
@@ -801,18 +1246,28 @@ cont:
                     }
                     break;
                 case D_POS:
-                    if(parse_digit(&current,&value) == PARSE_ERR){
+                    if(parse_digit(&current,end,&value) == PARSE_ERR){
                         line->type = TYPE_ERR;
                         return line->type;
                     }
+                    if(objfile){
+                        new_sect(value, SECT_ABS);
+                    }
                     vmaddr = value;
                     bin->addr = vmaddr;
                     break;
                 case D_ALIGN:
-                    if(parse_digit(&current,&value) == PARSE_ERR){
+                    if(parse_digit(&current,end,&value) == PARSE_ERR){
                         line->type = TYPE_ERR;
                         return line->type;
                     }
+                    if(objfile && value > 0 && !(sects[nsects-1].flags & SECT_ABS)){
+                        /* the address is only known once linked, so
+                         * the linker aligns a new section */
+                        new_sect(0, 0);
+                        sects[nsects-1].align = value;
+                        vmaddr = 0;
+                    }
                     if(vmaddr % value != 0){
                         vmaddr += (value - (vmaddr % value));
                     }
@@ -830,48 +1285,131 @@ cont:
 }
 
 /*
- * assemble: assemble an y86 file (e.g., 'asum.ys')
- * args
- *     in: point to input file (an y86 assembly file)
+ * new_line: append an empty line to the line array (kept for -v only)
  *
  * return
- *     0: success, assmble the y86 file to a list of line_t
- *     -1: error, try to print err information (e.g., instr type and line number)
+ *     line_t: the new line (only valid until the next new_line)
  */
-int assemble(FILE *in)
+line_t *new_line(void)
 {
-    static char asm_buf[MAX_INSLEN]; /* the current line of asm code */
     line_t *line;
-    int slen;
-    char *y86asm;
-
-    /* read y86 code line-by-line, and parse them to generate raw y86 binary code list */
-    while (fgets(asm_buf, MAX_INSLEN, in) != NULL) {
-        slen  = strlen(asm_buf);
-        if ((asm_buf[slen-1] == '\n') || (asm_buf[slen-1] == '\r')) { 
-            asm_buf[--slen] = '\0'; /* replace terminator */
+
+    if (y86bin_nlines == y86bin_maxlines) {
+        y86bin_maxlines = y86bin_maxlines ? y86bin_maxlines * 2 : 1024;
+        y86bin_lines = (line_t *)realloc(y86bin_lines,
+                                         y86bin_maxlines * sizeof(line_t)); // free in finit
+        if (y86bin_lines == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
         }
+    }
+    line = &y86bin_lines[y86bin_nlines++];
+    memset(line, '\0', sizeof(line_t));
+    return line;
+}
 
-        /* store y86 assembly code */
-        y86asm = (char *)malloc(sizeof(char) * (slen + 1)); // free in finit
-        strcpy(y86asm, asm_buf);
+/* input file, mapped (or read, if it can't be) until finit() */
+SESSION char *src_buf = NULL;
+SESSION size_t src_size = 0;
+SESSION bool_t src_mapped = FALSE;
 
-        line = (line_t *)malloc(sizeof(line_t)); // free in finit
-        memset(line, '\0', sizeof(line_t));
+/*
+ * map_input: map the y86 assembly file into memory
+ * args
+ *     fname: the name of input file
+ *
+ * return
+ *     0: success, the file is in 'src_buf' and 'src_size'
+ *     -1: error, the file can't be opened or read
+ */
+int map_input(char *fname)
+{
+    struct stat st;
+    size_t size = 0, max = 0;
+    ssize_t n;
+    int fd;
 
-        /* set defualt */
-        line->type = TYPE_COMM;
-        line->y86asm = y86asm;
-        line->next = NULL;
+    fd = open(fname, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        src_buf = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (src_buf != MAP_FAILED) {
+            madvise(src_buf, st.st_size, MADV_SEQUENTIAL);
+            src_size = st.st_size;
+            src_mapped = TRUE;
+            close(fd);
+            return 0;
+        }
+        src_buf = NULL;
+    }
+
+    /* not a regular file (e.g., a pipe): read it all */
+    do {
+        if (size == max) {
+            max = max ? max * 2 : 65536;
+            src_buf = (char *)realloc(src_buf, max); // free in finit
+            if (src_buf == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+            }
+        }
+        n = read(fd, src_buf + size, max - size);
+        if (n > 0)
+            size += n;
+    } while (n > 0);
+    close(fd);
+    src_size = size;
+    return n < 0 ? -1 : 0;
+}
+
+/*
+ * assemble: assemble an y86 file (e.g., 'asum.ys') in a single pass,
+ * emitting each line to the image as soon as it is parsed
+ * args
+ *     src: point to the y86 assembly code (not terminated)
+ *     size: the size of y86 assembly code
+ *
+ * return
+ *     0: success, assmble the y86 file to the image
+ *        (and to the array of line_t if 'screen')
+ *     -1: error, try to print err information (e.g., instr type and line number)
+ */
+int assemble(char *src, size_t size)
+{
+    char *src_end = src + size;
+    char *eol;
+    line_t tmp_line; /* the current line if not kept for the listing */
+    line_t *line;
 
-        /* add to y86 binary code list */
-        y86bin_listtail->next = line;
-        y86bin_listtail = line;
+    /* tokenize y86 code line-by-line in place, and parse them to generate raw y86 binary code */
+    while (src < src_end) {
+        eol = (char *)memchr(src, '\n', src_end - src);
+        if (eol == NULL) {
+            eol = src_end;
+            if (eol > src && eol[-1] == '\r')
+                eol--; /* drop terminator */
+        }
+
+        /* add to y86 binary code array if the listing needs it later */
+        if (screen) {
+            line = new_line();
+        } else {
+            line = &tmp_line;
+            memset(line, '\0', sizeof(line_t));
+        }
+        line->type = TYPE_COMM;
+        line->y86asm = src;
+        line->len = eol - src;
         y86asm_lineno ++;
+        src = eol < src_end ? eol + 1 : src_end;
 
-        /* parse */
+        /* parse and emit */
         if (parse_line(line) == TYPE_ERR)
             return -1;
+        if (line->type == TYPE_INS && emit(&line->y86bin) < 0)
+            return -1;
     }
     /* skip line number information in err_print() */
     y86asm_lineno = -1;
@@ -879,7 +1417,7 @@ int assemble(FILE *in)
 }
 
 /*
- * relocate: relocate the raw y86 binary code with symbol address
+ * relocate: check that all the references got backpatched
  *
  * return
  *     0: success
@@ -887,49 +1425,19 @@ int assemble(FILE *in)
  */
 int relocate(void)
 {
-    reloc_t *rtmp = reltab->next;
-    symbol_t *symbol;
-    bin_t *bin;
-    int addr;
-    itype_t icode;
-
-    while (rtmp) {
-        /* find symbol */
-        symbol = find_symbol(rtmp->name);
-        if(symbol == NULL){
-            err_print("Unknown symbol:'%s'",rtmp->name);
-            return -1;
-        }
-        /* relocate y86bin according itype */
-        bin = rtmp->y86bin;
-        addr = symbol->addr;
-        icode = HIGH(bin->codes[0]);
-        switch(icode){
-            case I_IRMOVL:
-                bin->codes[2] = addr&0xFF;
-                bin->codes[3] = (addr>>8)&0xFF;
-                bin->codes[4] = (addr>>16)&0xFF;
-                bin->codes[5] = (addr>>24)&0xFF;
-                break;
-            case I_JMP:
-            case I_CALL:
-                bin->codes[1] = addr&0xFF;
-                bin->codes[2] = (addr>>8)&0xFF;
-                bin->codes[3] = (addr>>16)&0xFF;
-                bin->codes[4] = (addr>>24)&0xFF;
-                break;
-            case I_DIRECTIVE:
-                bin->codes[0] = addr&0xFF;
-                bin->codes[1] = (addr>>8)&0xFF;
-                bin->codes[2] = (addr>>16)&0xFF;
-                bin->codes[3] = (addr>>24)&0xFF;
-                break;
-            default:
-                break;
-        }
+    symbol_t *symbol = NULL;
+    int i;
 
-        /* next */
-        rtmp = rtmp->next;
+    /* report the undefined symbol referenced first */
+    for (i = 0; i < symtab.size; i++) {
+        symbol_t *stmp = symtab.slot[i];
+        if (stmp && stmp->pending
+            && (symbol == NULL || stmp->first_ref < symbol->first_ref))
+            symbol = stmp;
+    }
+    if (symbol) {
+        err_print("Unknown symbol:'%s'",symbol->name);
+        return -1;
     }
     return 0;
 }
@@ -945,47 +1453,69 @@ int relocate(void)
  */
 int binfile(FILE *out)
 {
-    if(y86bin_listhead == NULL){
-        return 0;
-    }
-    line_t *current = y86bin_listhead;
-    bin_t *y86bin;
-    int inst_addr;
-    int bytes_total = 0;
-    char *codes;
-    char *image;
-    char *position;
-
-    /* prepare image with y86 binary code */
-    image = (char *)malloc(vmaddr*sizeof(char));
-    memset(image,HPACK(0,0),vmaddr*sizeof(char));
-    while(current->next != NULL){
-        current = current->next;
-        if(current->type == TYPE_INS){
-            y86bin = &(current->y86bin);
-            inst_addr = y86bin->addr;
-            codes = (char*)(y86bin->codes);
-            position = &(image[inst_addr]);
-            for(int i = 0; i<y86bin->bytes; i++){
-                strncpy(position+i,codes+i,sizeof(char));
-            }
-            if(y86bin->bytes){
-                bytes_total = inst_addr + y86bin->bytes;
-            }
+    /* the image was built by assemble(), binary write it to output file
+     * (NOTE: see fwrite()) */
+    if (image_len > 0 && fwrite(image, sizeof(byte_t), image_len, out) != image_len)
+        return -1;
+    return 0;
+}
 
-        }
+/*
+ * objfile_write: generate the y86 object file (-c)
+ * args
+ *     out: point to output file (an y86 object file)
+ *
+ * return
+ *     0: success
+ *     -1: error
+ */
+int objfile_write(FILE *out)
+{
+    obj_hdr_t hdr;
+    obj_sym_t *syms;
+    symbol_t **byindex;
+    int i, strsize = 0, ret = 0;
+
+    /* end the last section */
+    sects[nsects-1].size = vmaddr - sects[nsects-1].addr;
+
+    /* symbols in the order of creation, which is what relocations refer to */
+    syms = (obj_sym_t *)malloc(symtab.cnt * sizeof(obj_sym_t) + 1);
+    byindex = (symbol_t **)malloc(symtab.cnt * sizeof(symbol_t *) + 1);
+    for (i = 0; i < symtab.size; i++)
+        if (symtab.slot[i])
+            byindex[symtab.slot[i]->index] = symtab.slot[i];
+    for (i = 0; i < symtab.cnt; i++) {
+        symbol_t *sym = byindex[i];
+        syms[i].name = strsize;
+        syms[i].sect = sym->sect;
+        syms[i].addr = sym->defined ? sym->addr - sects[sym->sect].addr : 0;
+        strsize += sym->len + 1;
     }
 
-    /* binary write y86 code to output file (NOTE: see fwrite()) */
-    fwrite(image,sizeof(char),bytes_total,out);
-    free(image);
-
-    return 0;
+    memcpy(hdr.magic, OBJ_MAGIC, 4);
+    hdr.version = OBJ_VERSION;
+    hdr.nsects = nsects;
+    hdr.nsyms = symtab.cnt;
+    hdr.nrelocs = obj_nrelocs;
+    hdr.strsize = strsize;
+
+    if (fwrite(&hdr, sizeof(hdr), 1, out) != 1
+        || fwrite(sects, sizeof(obj_sect_t), nsects, out) != nsects
+        || fwrite(image, sizeof(byte_t), sect_offset + sects[nsects-1].len, out)
+           != sect_offset + sects[nsects-1].len
+        || fwrite(syms, sizeof(obj_sym_t), symtab.cnt, out) != symtab.cnt
+        || fwrite(obj_relocs, sizeof(obj_reloc_t), obj_nrelocs, out) != obj_nrelocs)
+        ret = -1;
+    for (i = 0; i < symtab.cnt && ret == 0; i++)
+        if (fwrite(byindex[i]->name, 1, byindex[i]->len + 1, out) != byindex[i]->len + 1)
+            ret = -1;
+
+    free(syms);
+    free(byindex);
+    return ret;
 }
 
-/* whether print the readable output to screen or not ? */
-bool_t screen = FALSE; 
-
 static void hexstuff(char *dest, int value, int len)
 {
     int i;
@@ -997,7 +1527,7 @@ static void hexstuff(char *dest, int value, int len)
     }
 }
 
-void print_line(line_t *line)
+void print_line(FILE *out, line_t *line)
 {
     char buf[26];
 
@@ -1012,77 +1542,250 @@ void print_line(line_t *line)
         if (y86bin->bytes > 0)
             for (i = 0; i < y86bin->bytes; i++)
                 hexstuff(buf+9+2*i, y86bin->codes[i]&0xFF, 2);
+        if (line->reloc)
+            buf[21] = '*';
     } else {
         strcpy(buf, "                      | ");
     }
 
-    printf("%s%s\n", buf, line->y86asm);
+    fprintf(out, "%s%.*s\n", buf, line->len, line->y86asm);
+}
+
+/*
+ * list_relocs: show the fields of the object file the linker fills (-c -v),
+ * with the offset of the symbol in its section, or 0 if it is in another
+ * module, and a '*' before the '|'
+ */
+void list_relocs(void)
+{
+    int i;
+
+    for (i = 0; i < obj_nrelocs; i++) {
+        obj_reloc_t *rel = &obj_relocs[i];
+        symbol_t *sym = lst_relocs[i].sym;
+        line_t *line = &y86bin_lines[lst_relocs[i].line];
+        int off = sects[rel->sect].addr + rel->addr - line->y86bin.addr;
+
+        line->reloc = TRUE;
+        if (sym->defined)
+            put_long(line->y86bin.codes + off, sym->addr - sects[sym->sect].addr, rel->bytes);
+    }
 }
 
 /* 
  * print_screen: dump readable binary and assembly code to screen
  * (e.g., Figure 4.8 in ICS book)
  */
-void print_screen(void)
+void print_screen(FILE *out)
 {
-    line_t *tmp = y86bin_listhead->next;
-    
+    int i;
+
     /* line by line */
-    while (tmp != NULL) {
-        print_line(tmp);
-        tmp = tmp->next;
+    for (i = 0; i < y86bin_nlines; i++)
+        print_line(out, &y86bin_lines[i]);
+}
+
+/* init_tables: fill the tables shared by all sessions, once */
+void init_tables(void)
+{
+    init_char_class();
+
+    /* fill the perfect hash tables, a collision means a bad seed */
+    for (int i = 0; i < (1 << INSTR_HASH_BITS); i++)
+        instr_hash_tab[i] = INSTR_CNT;
+    for (int i = 0; i < INSTR_CNT; i++) {
+        int h = INSTR_HASH(instr_set[i].name, instr_set[i].len);
+        assert(instr_hash_tab[h] == INSTR_CNT);
+        instr_hash_tab[h] = i;
+    }
+    for (int i = 0; i < 16; i++)
+        reg_hash_tab[i] = REG_ERR;
+    for (regid_t regid = REG_EAX; regid < REG_CNT; regid++) {
+        assert(reg_hash_tab[REG_HASH(reg_table[regid].name)] == REG_ERR);
+        reg_hash_tab[REG_HASH(reg_table[regid].name)] = regid;
     }
 }
 
-/* init and finit */
+/* init and finit (a session) */
 void init(void)
 {
-    reltab = (reloc_t *)malloc(sizeof(reloc_t)); // free in finit
-    memset(reltab, 0, sizeof(reloc_t));
-
-    symtab = (symbol_t *)malloc(sizeof(symbol_t)); // free in finit
-    memset(symtab, 0, sizeof(symbol_t));
-
-    y86bin_listhead = (line_t *)malloc(sizeof(line_t)); // free in finit
-    memset(y86bin_listhead, 0, sizeof(line_t));
-    y86bin_listtail = y86bin_listhead;
+    arena.head = NULL;
+    reloc_free = NULL;
+    reloc_cnt = 0;
+
+    image = NULL;
+    image_size = 0;
+    image_len = 0;
+
+    src_buf = NULL;
+    src_size = 0;
+    src_mapped = FALSE;
+
+    symtab.size = SYMTAB_INIT;
+    symtab.cnt = 0;
+    symtab.slot = (symbol_t **)calloc(symtab.size, sizeof(symbol_t *)); // free in finit
+
+    sects = NULL;
+    nsects = 0;
+    maxsects = 0;
+    sect_offset = 0;
+    obj_relocs = NULL;
+    obj_nrelocs = 0;
+    obj_maxrelocs = 0;
+    lst_relocs = NULL;
+    if (objfile)
+        new_sect(0, 0);
+
+    vmaddr = 0;
+    y86bin_lines = NULL;
+    y86bin_nlines = 0;
+    y86bin_maxlines = 0;
     y86asm_lineno = 0;
 }
 
 void finit(void)
 {
-    reloc_t *rtmp = NULL;
-    do {
-        rtmp = reltab->next;
-        if (reltab->name) 
-            free(reltab->name);
-        free(reltab);
-        reltab = rtmp;
-    } while (reltab);
-    
-    symbol_t *stmp = NULL;
-    do {
-        stmp = symtab->next;
-        if (symtab->name) 
-            free(symtab->name);
-        free(symtab);
-        symtab = stmp;
-    } while (symtab);
-
-    line_t *ltmp = NULL;
-    do {
-        ltmp = y86bin_listhead->next;
-        if (y86bin_listhead->y86asm) 
-            free(y86bin_listhead->y86asm);
-        free(y86bin_listhead);
-        y86bin_listhead = ltmp;
-    } while (y86bin_listhead);
+    /* symbols and backpatch chains all live in the arena */
+    arena_free(&arena);
+    free(symtab.slot);
+    free(y86bin_lines);
+    free(image);
+    free(sects);
+    free(obj_relocs);
+    free(lst_relocs);
+
+    /* the listing pointed into the input until now */
+    if (src_mapped)
+        munmap(src_buf, src_size);
+    else
+        free(src_buf);
+}
+
+/* a file of 'y86asm -c', the driver assembles them on several threads */
+typedef struct job {
+    char *fname;        /* file.ys */
+    char *prefix;       /* "file.ys: " for err_print() */
+    char *listing;      /* -v output, printed in order after all are done */
+    size_t listing_len;
+    int ret;
+} job_t;
+
+job_t *jobs = NULL;
+int njobs = 0;
+int next_job = 0;   /* the next job to take, atomically */
+
+/*
+ * assemble_obj: assemble 'file.ys' of a job to 'file.o' in a session
+ *
+ * return
+ *     0: success
+ *     -1: error, the message was printed already
+ */
+int assemble_obj(job_t *job)
+{
+    int rootlen = strlen(job->fname) - 3;
+    char *outfname = NULL;
+    FILE *out, *lst;
+    int ret = -1;
+
+    y86asm_fname = job->prefix;
+    init();
+
+    if (map_input(job->fname) < 0) {
+        err_print("Can't open input file '%s'", job->fname);
+        goto done;
+    }
+    if (assemble(src_buf, src_size) < 0) {
+        err_print("Assemble y86 code error");
+        goto done;
+    }
+
+    /* generate .o file */
+    outfname = (char *)malloc(rootlen + 3);
+    strncpy(outfname, job->fname, rootlen);
+    strcpy(outfname+rootlen, ".o");
+    out = fopen(outfname, "wb");
+    if (!out) {
+        err_print("Can't open output file '%s'", outfname);
+        goto done;
+    }
+    if (objfile_write(out) < 0) {
+        err_print("Generate object file error");
+        fclose(out);
+        goto done;
+    }
+    fclose(out);
+
+    /* keep the listing until the files before it are printed */
+    if (screen) {
+        lst = open_memstream(&job->listing, &job->listing_len);
+        if (lst) {
+            list_relocs();
+            print_screen(lst);
+            fclose(lst);
+        }
+    }
+    ret = 0;
+
+done:
+    free(outfname);
+    finit();
+    return ret;
+}
+
+static void *asm_worker(void *arg)
+{
+    int i;
+
+    while ((i = __sync_fetch_and_add(&next_job, 1)) < njobs)
+        jobs[i].ret = assemble_obj(&jobs[i]);
+    return NULL;
+}
+
+/*
+ * assemble_all: assemble all the jobs on 'nthreads' threads
+ *
+ * return
+ *     0: success
+ *     -1: error in some of the files
+ */
+int assemble_all(int nthreads)
+{
+    pthread_t *threads;
+    int i, ret = 0;
+
+    if (nthreads > njobs)
+        nthreads = njobs;
+    threads = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+    for (i = 1; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, asm_worker, NULL) != 0) {
+            nthreads = i;
+            break;
+        }
+    }
+    asm_worker(NULL);
+    for (i = 1; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    for (i = 0; i < njobs; i++) {
+        if (jobs[i].listing) {
+            fwrite(jobs[i].listing, 1, jobs[i].listing_len, stdout);
+            free(jobs[i].listing);
+        }
+        if (jobs[i].ret < 0)
+            ret = -1;
+    }
+    return ret;
 }
 
 static void usage(char *pname)
 {
     printf("Usage: %s [-v] file.ys\n", pname);
+    printf("       %s [-v] -c [-j jobs] file.ys ...\n", pname);
     printf("   -v print the readable output to screen\n");
+    printf("   -c assemble each file.ys to an object file.o (see y86ld)\n");
+    printf("   -j assemble at most 'jobs' files at once (default: all)\n");
     exit(0);
 }
 
@@ -1092,22 +1795,59 @@ int main(int argc, char *argv[])
     char infname[512];
     char outfname[512];
     int nextarg = 1;
-    FILE *in = NULL, *out = NULL;
+    int nthreads = 0;
+    FILE *out = NULL;
     
     if (argc < 2)
         usage(argv[0]);
     
-    if (argv[nextarg][0] == '-') {
+    while (nextarg < argc && argv[nextarg][0] == '-') {
         char flag = argv[nextarg][1];
         switch (flag) {
           case 'v':
             screen = TRUE;
             nextarg++;
             break;
+          case 'c':
+            objfile = TRUE;
+            nextarg++;
+            break;
+          case 'j':
+            if (nextarg + 1 >= argc || (nthreads = atoi(argv[nextarg+1])) <= 0)
+                usage(argv[0]);
+            nextarg += 2;
+            break;
           default:
             usage(argv[0]);
         }
     }
+    if (nextarg >= argc)
+        usage(argv[0]);
+
+    init_tables();
+
+    /* assemble .ys files to .o files in parallel */
+    if (objfile) {
+        njobs = argc - nextarg;
+        jobs = (job_t *)calloc(njobs, sizeof(job_t));
+        for (int i = 0; i < njobs; i++) {
+            char *fname = argv[nextarg + i];
+            rootlen = strlen(fname) - 3;
+            if (rootlen < 0 || strcmp(fname + rootlen, ".ys"))
+                usage(argv[0]);
+            jobs[i].fname = fname;
+            jobs[i].prefix = (char *)malloc(strlen(fname) + 3);
+            sprintf(jobs[i].prefix, "%s: ", fname);
+        }
+        if (assemble_all(nthreads ? nthreads : njobs) < 0)
+            exit(1);
+        for (int i = 0; i < njobs; i++)
+            free(jobs[i].prefix);
+        free(jobs);
+        return 0;
+    }
+    if (nextarg != argc - 1)
+        usage(argv[0]);
 
     /* parse input file name */
     rootlen = strlen(argv[nextarg])-3;
@@ -1128,18 +1868,15 @@ int main(int argc, char *argv[])
     /* assemble .ys file */
     strncpy(infname, argv[nextarg], rootlen);
     strcpy(infname+rootlen, ".ys");
-    in = fopen(infname, "r");
-    if (!in) {
+    if (map_input(infname) < 0) {
         err_print("Can't open input file '%s'", infname);
         exit(1);
     }
     
-    if (assemble(in) < 0) {
+    if (assemble(src_buf, src_size) < 0) {
         err_print("Assemble y86 code error");
-        fclose(in);
         exit(1);
     }
-    fclose(in);
 
 
     /* relocate binary code */
@@ -1168,7 +1905,7 @@ int main(int argc, char *argv[])
     
     /* print to screen (.yo file) */
     if (screen)
-       print_screen(); 
+       print_screen(stdout); 
    
 
     /* finit */
@@ -6,8 +6,6 @@
 #include <string.h>
 #include <assert.h>
 
-#define MAX_INSLEN  512
-
 typedef unsigned char byte_t;
 typedef int word_t;
 typedef enum { FALSE, TRUE } bool_t;
@@ -69,24 +67,104 @@ typedef struct bin {
 typedef struct line {
     type_t type; /* TYPE_COMM: no y86bin, TYPE_INS: both y86bin and y86asm */
     bin_t y86bin;
-    char *y86asm;
-    
-    struct line *next;
+    char *y86asm; /* points into the input, not terminated */
+    int len;
+    bool_t reloc; /* has a field the linker fills (-c), marked in the listing */
 } line_t;
 
-/* label defined in y86 assembly code, e.g. Loop */
+struct reloc;
+
+/* label defined in y86 assembly code, e.g. Loop (interned in symtab) */
 typedef struct symbol {
     char *name;
+    int len;
+    unsigned hash;
     int addr;
-    struct symbol *next;
+    bool_t defined; /* FALSE: only referenced so far */
+    struct reloc *pending; /* backpatch chain of the references before defined */
+    int first_ref; /* order of the first pending reference, for errors */
+    int index; /* order of creation, the index in the object file */
+    int sect; /* defining section in the object file */
 } symbol_t;
 
-/* binary code need to be relocated */
+/* open-addressing hash table of symbols, one entry per distinct name */
+typedef struct symtab {
+    symbol_t **slot;
+    int size; /* power of two */
+    int cnt;
+} symtab_t;
+
+/* binary code need to be patched once its symbol is defined */
 typedef struct reloc {
-    bin_t *y86bin;
-    char *name;
+    int addr; /* image address of the field */
+    int bytes; /* bytes of the field in the image (.byte/.word: 1/2) */
+    int line; /* index of the line to patch for -v, or -1 */
     struct reloc *next;
 } reloc_t;
 
+/* bump-pointer arena, everything in it is freed at once by finit() */
+typedef struct chunk {
+    struct chunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+} chunk_t;
+
+typedef struct arena {
+    chunk_t *head;
+} arena_t;
+
+#define ARENA_CHUNK (64 * 1024)
+#define ARENA_ALIGN 8
+
+
+/*
+ * Object file (y86asm -c, linked by y86ld): an obj_hdr_t, then nsects
+ * obj_sect_t, the section data, nsyms obj_sym_t, nrelocs obj_reloc_t and
+ * the string table; all in host byte order, like the y86sim trace.
+ *
+ * Section 0 holds the code before the first .pos and is placed by the
+ * linker right after the previous section; every .pos starts an absolute
+ * section at its address, and every .align out of those a section the
+ * linker aligns. So the layout is the one of all sources in one file.
+ */
+#define OBJ_MAGIC   "Y86O"
+#define OBJ_VERSION 1
+
+typedef struct obj_hdr {
+    char magic[4];
+    int version;
+    int nsects;
+    int nsyms;
+    int nrelocs;
+    int strsize;  /* bytes of the string table */
+} obj_hdr_t;
+
+#define SECT_ABS 0x1 /* placed at 'addr' by .pos */
+
+typedef struct obj_sect {
+    int addr;   /* address of the start (0 if not SECT_ABS) */
+    int size;   /* extent up to the next section, with .align padding */
+    int len;    /* bytes of data in the file (<= size) */
+    int align;  /* the base is a multiple of it (not SECT_ABS) */
+    int flags;
+} obj_sect_t;
+
+#define SYM_UNDEF -1 /* sect of a symbol defined by another module */
+
+typedef struct obj_sym {
+    int name;  /* offset in the string table */
+    int sect;
+    int addr;  /* offset in the section */
+} obj_sym_t;
+
+/* a field the linker fills with the address of a symbol (see reloc_t) */
+typedef struct obj_reloc {
+    int sect;
+    int addr;  /* offset of the field in the section */
+    int bytes; /* bytes of the field (.byte/.word: 1/2) */
+    int sym;
+} obj_reloc_t;
+
 #endif
 
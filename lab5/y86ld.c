@@ -0,0 +1,323 @@
+/* Linker of y86asm object files (y86asm -c) into a .bin */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "y86asm.h"
+
+#define err_print(_s, _a ...) \
+    fprintf(stderr, _s"\n", ## _a);
+
+/* an object file loaded in memory */
+typedef struct module {
+    char *fname;
+    obj_hdr_t hdr;
+    obj_sect_t *sects;
+    byte_t *data;       /* data of the sections, packed in order */
+    obj_sym_t *syms;
+    obj_reloc_t *relocs;
+    char *strtab;
+    int *base;          /* address where each section is placed */
+    int *offset;        /* offset of each section in 'data' */
+} module_t;
+
+/*
+ * a symbol defined by some module; labels have no scope of their own, so
+ * two modules may define the same name as long as no other one uses it
+ */
+typedef struct global {
+    char *name;
+    int addr;
+    module_t *mod;
+} global_t;
+
+/* a placed section, to check that none overlap */
+typedef struct region {
+    int addr;
+    int len;
+    module_t *mod;
+} region_t;
+
+/* read_part: read 'n' records of 'size' bytes (free in main) */
+static void *read_part(FILE *f, size_t size, int n)
+{
+    void *p = malloc(size * n + 1);
+
+    if (p == NULL) {
+        err_print("Out of memory");
+        exit(1);
+    }
+    if (fread(p, size, n, f) != n) {
+        free(p);
+        return NULL;
+    }
+    return p;
+}
+
+/*
+ * load_module: load and check an object file
+ *
+ * return
+ *     0: success
+ *     -1: error, the file can't be read or is not a valid object
+ */
+int load_module(char *fname, module_t *mod)
+{
+    int i, datalen = 0;
+    FILE *f;
+
+    memset(mod, 0, sizeof(module_t));
+    mod->fname = fname;
+    f = fopen(fname, "rb");
+    if (!f) {
+        err_print("Can't open object file '%s'", fname);
+        return -1;
+    }
+    if (fread(&mod->hdr, sizeof(obj_hdr_t), 1, f) != 1
+        || memcmp(mod->hdr.magic, OBJ_MAGIC, 4) || mod->hdr.version != OBJ_VERSION
+        || mod->hdr.nsects <= 0 || mod->hdr.nsyms < 0 || mod->hdr.nrelocs < 0
+        || mod->hdr.strsize < 0)
+        goto invalid;
+
+    mod->sects = (obj_sect_t *)read_part(f, sizeof(obj_sect_t), mod->hdr.nsects);
+    if (mod->sects == NULL)
+        goto invalid;
+    mod->base = (int *)malloc(mod->hdr.nsects * sizeof(int));
+    mod->offset = (int *)malloc(mod->hdr.nsects * sizeof(int));
+    for (i = 0; i < mod->hdr.nsects; i++) {
+        obj_sect_t *sect = &mod->sects[i];
+        if (sect->len < 0 || sect->len > sect->size || sect->align <= 0)
+            goto invalid;
+        mod->offset[i] = datalen;
+        datalen += sect->len;
+    }
+
+    mod->data = (byte_t *)read_part(f, 1, datalen);
+    mod->syms = (obj_sym_t *)read_part(f, sizeof(obj_sym_t), mod->hdr.nsyms);
+    mod->relocs = (obj_reloc_t *)read_part(f, sizeof(obj_reloc_t), mod->hdr.nrelocs);
+    mod->strtab = (char *)read_part(f, 1, mod->hdr.strsize);
+    if (!mod->data || !mod->syms || !mod->relocs || !mod->strtab)
+        goto invalid;
+    if (mod->hdr.strsize > 0 && mod->strtab[mod->hdr.strsize-1] != '\0')
+        goto invalid;
+
+    for (i = 0; i < mod->hdr.nsyms; i++) {
+        obj_sym_t *sym = &mod->syms[i];
+        if (sym->name < 0 || sym->name >= mod->hdr.strsize
+            || sym->sect < SYM_UNDEF || sym->sect >= mod->hdr.nsects)
+            goto invalid;
+    }
+    for (i = 0; i < mod->hdr.nrelocs; i++) {
+        obj_reloc_t *rel = &mod->relocs[i];
+        if (rel->sect < 0 || rel->sect >= mod->hdr.nsects
+            || rel->sym < 0 || rel->sym >= mod->hdr.nsyms
+            || rel->bytes < 1 || rel->bytes > 4 || rel->addr < 0
+            || rel->addr + rel->bytes > mod->sects[rel->sect].len)
+            goto invalid;
+    }
+    fclose(f);
+    return 0;
+
+invalid:
+    err_print("Invalid object file '%s'", fname);
+    fclose(f);
+    return -1;
+}
+
+/*
+ * layout: place the sections of all modules, in order, as if their
+ * sources were one file: a .pos section at its address, the first section
+ * of a module after the previous section, aligned
+ */
+void layout(module_t *mods, int nmods)
+{
+    int loc = 0;
+    int m, i;
+
+    for (m = 0; m < nmods; m++) {
+        for (i = 0; i < mods[m].hdr.nsects; i++) {
+            obj_sect_t *sect = &mods[m].sects[i];
+            if (sect->flags & SECT_ABS) {
+                loc = sect->addr;
+            } else if (loc % sect->align != 0) {
+                loc += sect->align - loc % sect->align;
+            }
+            mods[m].base[i] = loc;
+            loc += sect->size;
+        }
+    }
+}
+
+static int cmp_global(const void *a, const void *b)
+{
+    return strcmp(((global_t *)a)->name, ((global_t *)b)->name);
+}
+
+static int cmp_region(const void *a, const void *b)
+{
+    return ((region_t *)a)->addr - ((region_t *)b)->addr;
+}
+
+void usage(char *pname)
+{
+    printf("Usage: %s [-h] [-o file.bin] file.o ...\n", pname);
+    printf("   -o         the output file (default: the first file.bin)\n");
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    module_t *mods;
+    global_t *globals;
+    region_t *regions;
+    int nmods, nglobals = 0, nregions = 0;
+    int m, i, size = 0;
+    char *outfname = NULL;
+    byte_t *image;
+    FILE *out;
+    int c;
+
+    while ((c = getopt(argc, argv, "ho:")) != -1) {
+        switch (c) {
+          case 'o':
+            outfname = optarg;
+            break;
+          case 'h':
+          default:
+            usage(argv[0]);
+        }
+    }
+    if (optind >= argc)
+        usage(argv[0]);
+
+    nmods = argc - optind;
+    mods = (module_t *)malloc(nmods * sizeof(module_t));
+    for (m = 0; m < nmods; m++) {
+        if (load_module(argv[optind + m], &mods[m]) < 0)
+            exit(1);
+        nglobals += mods[m].hdr.nsyms;
+        nregions += mods[m].hdr.nsects;
+    }
+
+    layout(mods, nmods);
+
+    /* all the defined symbols, sorted by name to find them (and their twins) */
+    globals = (global_t *)malloc(nglobals * sizeof(global_t) + 1);
+    nglobals = 0;
+    for (m = 0; m < nmods; m++) {
+        for (i = 0; i < mods[m].hdr.nsyms; i++) {
+            obj_sym_t *sym = &mods[m].syms[i];
+            if (sym->sect == SYM_UNDEF)
+                continue;
+            globals[nglobals].name = mods[m].strtab + sym->name;
+            globals[nglobals].addr = mods[m].base[sym->sect] + sym->addr;
+            globals[nglobals].mod = &mods[m];
+            nglobals++;
+        }
+    }
+    qsort(globals, nglobals, sizeof(global_t), cmp_global);
+
+    /* the sections with data must not overlap */
+    regions = (region_t *)malloc(nregions * sizeof(region_t));
+    nregions = 0;
+    for (m = 0; m < nmods; m++) {
+        for (i = 0; i < mods[m].hdr.nsects; i++) {
+            if (mods[m].sects[i].len == 0)
+                continue;
+            regions[nregions].addr = mods[m].base[i];
+            regions[nregions].len = mods[m].sects[i].len;
+            regions[nregions].mod = &mods[m];
+            if (regions[nregions].addr < 0) {
+                err_print("Invalid address 0x%x in '%s'",
+                          regions[nregions].addr, mods[m].fname);
+                exit(1);
+            }
+            if (regions[nregions].addr + regions[nregions].len > size)
+                size = regions[nregions].addr + regions[nregions].len;
+            nregions++;
+        }
+    }
+    qsort(regions, nregions, sizeof(region_t), cmp_region);
+    for (i = 1; i < nregions; i++) {
+        if (regions[i-1].addr + regions[i-1].len > regions[i].addr) {
+            err_print("Overlapping sections at 0x%x ('%s' and '%s')", regions[i].addr,
+                      regions[i-1].mod->fname, regions[i].mod->fname);
+            exit(1);
+        }
+    }
+
+    /* copy the sections to the image and patch the relocations */
+    image = (byte_t *)calloc(size + 1, 1);
+    for (m = 0; m < nmods; m++) {
+        module_t *mod = &mods[m];
+        for (i = 0; i < mod->hdr.nsects; i++)
+            memcpy(image + mod->base[i], mod->data + mod->offset[i], mod->sects[i].len);
+        for (i = 0; i < mod->hdr.nrelocs; i++) {
+            obj_reloc_t *rel = &mod->relocs[i];
+            obj_sym_t *sym = &mod->syms[rel->sym];
+            byte_t *field = image + mod->base[rel->sect] + rel->addr;
+            int addr, k;
+
+            if (sym->sect != SYM_UNDEF) {
+                addr = mod->base[sym->sect] + sym->addr;
+            } else {
+                global_t key, *g;
+                key.name = mod->strtab + sym->name;
+                g = (global_t *)bsearch(&key, globals, nglobals, sizeof(global_t), cmp_global);
+                if (g == NULL) {
+                    err_print("Unknown symbol:'%s' in '%s'", key.name, mod->fname);
+                    exit(1);
+                }
+                while (g > globals && strcmp(g[-1].name, key.name) == 0)
+                    g--;
+                if (g + 1 < globals + nglobals && strcmp(g[1].name, key.name) == 0) {
+                    err_print("Dup symbol:%s ('%s' and '%s') used in '%s'", key.name,
+                              g[0].mod->fname, g[1].mod->fname, mod->fname);
+                    exit(1);
+                }
+                addr = g->addr;
+            }
+            for (k = 0; k < rel->bytes; k++)
+                field[k] = (addr >> 8*k) & 0xFF;
+        }
+    }
+
+    /* binary write the image */
+    if (outfname == NULL) {
+        char *fname = mods[0].fname;
+        int rootlen = strlen(fname);
+        if (rootlen > 2 && strcmp(fname + rootlen - 2, ".o") == 0)
+            rootlen -= 2;
+        outfname = (char *)malloc(rootlen + 5);
+        memcpy(outfname, fname, rootlen);
+        strcpy(outfname + rootlen, ".bin");
+    }
+    out = fopen(outfname, "wb");
+    if (!out) {
+        err_print("Can't open output file '%s'", outfname);
+        exit(1);
+    }
+    if (fwrite(image, 1, size, out) != size) {
+        err_print("Generate binary file error");
+        fclose(out);
+        exit(1);
+    }
+    fclose(out);
+
+    for (m = 0; m < nmods; m++) {
+        free(mods[m].sects);
+        free(mods[m].data);
+        free(mods[m].syms);
+        free(mods[m].relocs);
+        free(mods[m].strtab);
+        free(mods[m].base);
+        free(mods[m].offset);
+    }
+    free(mods);
+    free(globals);
+    free(regions);
+    free(image);
+    return 0;
+}